@@ -0,0 +1,90 @@
+#include "BootManager.h"
+
+#include "IdentityManager.h"
+#include "NetworkManager.h"
+#include "StorageManager.h"
+#include "SystemManager.h"
+#include "MailManager.h"
+
+#include <libutils/Logger.h>
+
+#include <libopi/SysConfig.h>
+
+using namespace Utils;
+
+namespace KGP
+{
+
+BootManager::BootManager() = default;
+
+BootManager &BootManager::Instance()
+{
+	static BootManager mgr;
+
+	return mgr;
+}
+
+void BootManager::Start(const string &password)
+{
+	ScopedLog log("Boot start");
+
+	const string mountpoint = OPI::SysConfig().GetKeyAsString("filesystem", "storagemount");
+
+	// Storage first, since it is the slow one
+	this->storageready = StorageManager::Instance().OpenAsync( password, mountpoint );
+
+	// Managers not touching storage during initialization
+	NetworkManager::Instance();
+	IdentityManager::Instance();
+	SystemManager::Instance();
+	MailManager::Instance();
+
+	// Remote accounts and poll schedules reside on storage
+	this->fetcherstart = std::async( std::launch::async, [ready = this->storageready]()
+	{
+		if( ! ready.get() )
+		{
+			return;
+		}
+
+		MailManager& mailmgr = MailManager::Instance();
+		if( ! mailmgr.StartRemoteFetcher() )
+		{
+			logg << Logger::Error << "Failed to start remote mail fetcher: " << mailmgr.StrError() << lend;
+		}
+	});
+
+	logg << Logger::Debug << "Managers initialized, storage "
+		 << ( this->storageready.wait_for( chrono::seconds(0) ) == future_status::ready ? "ready" : "pending" ) << lend;
+}
+
+shared_future<bool> BootManager::StorageReady()
+{
+	return this->storageready;
+}
+
+bool BootManager::Wait()
+{
+	if( ! this->storageready.valid() )
+	{
+		this->global_error = "Boot not started";
+		return false;
+	}
+
+	if( ! this->storageready.get() )
+	{
+		this->global_error = StorageManager::Instance().StrError();
+		return false;
+	}
+
+	if( this->fetcherstart.valid() )
+	{
+		this->fetcherstart.wait();
+	}
+
+	return true;
+}
+
+BootManager::~BootManager() = default;
+
+} // Namespace KGP
@@ -0,0 +1,63 @@
+#ifndef BOOTMANAGER_H
+#define BOOTMANAGER_H
+
+#include "BaseManager.h"
+
+#include <future>
+#include <string>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief The BootManager class orchestrates system bring up
+ *
+ * Unlocking storage is slow, seconds of key derivation on ARM, and
+ * most of the managers don't need storage to get initialized.
+ *
+ * Storage is unlocked and mounted in the background while managers
+ * not depending on storage are initialized in the calling thread.
+ * Operations needing storage wait on the storage readiness, see
+ * StorageManager::WaitReady.
+ */
+class BootManager: public BaseManager
+{
+private:
+	BootManager();
+public:
+	static BootManager& Instance();
+
+	/**
+	 * @brief Start start system bring up
+	 *
+	 *        Returns when managers not needing storage are initialized,
+	 *        storage might still be in progress.
+	 *
+	 * @param password password to unlock storage with, if locked
+	 */
+	void Start(const string& password);
+
+	/**
+	 * @brief StorageReady
+	 * @return future telling when storage is unlocked and mounted
+	 */
+	shared_future<bool> StorageReady();
+
+	/**
+	 * @brief Wait wait for bring up, including services started
+	 *        once storage is up, to complete
+	 * @return true if storage was successfully brought up
+	 */
+	bool Wait();
+
+	virtual ~BootManager();
+private:
+	shared_future<bool> storageready;
+	future<void> fetcherstart;	// Remote fetcher started once storage is up
+};
+
+} // Namespace KGP
+
+#endif // BOOTMANAGER_H
@@ -0,0 +1,171 @@
+#include "DeviceIdentity.h"
+
+#include <libutils/FileUtils.h>
+#include <libutils/Logger.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <list>
+
+using namespace Utils;
+
+namespace KGP
+{
+namespace DeviceIdentity
+{
+
+static string realPath(const string& path)
+{
+	try
+	{
+		return File::RealPath( path );
+	}
+	catch( std::runtime_error& err)
+	{
+		logg << Logger::Debug << "Unable to resolve " << path << ": " << err.what() << lend;
+	}
+	return "";
+}
+
+/*
+ * Return all links in dir that point at device
+ */
+static list<string> linksTo(const string& dir, const string& device)
+{
+	list<string> links;
+
+	string target = realPath( device );
+	if( target == "" )
+	{
+		return links;
+	}
+
+	DIR* d = opendir( dir.c_str() );
+	if( d == nullptr )
+	{
+		logg << Logger::Debug << "Unable to open " << dir << lend;
+		return links;
+	}
+
+	struct dirent* ent = nullptr;
+	while( ( ent = readdir( d ) ) != nullptr )
+	{
+		if( ent->d_name[0] == '.' )
+		{
+			continue;
+		}
+		string link = dir + ent->d_name;
+		if( realPath( link ) == target )
+		{
+			links.emplace_back( link );
+		}
+	}
+	closedir( d );
+
+	links.sort();
+
+	return links;
+}
+
+static bool startsWith(const string& str, const string& prefix)
+{
+	return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+string DiskIdentity(const string &device)
+{
+	list<string> links = linksTo( ByID, device );
+
+	// WWN is globally unique, use if available
+	for( const auto& link: links )
+	{
+		if( startsWith( File::GetFileName( link ), "wwn-" ) )
+		{
+			return link;
+		}
+	}
+
+	// Otherwise a serial based name, i.e. ata-Model_Serial, mmc-Name_0xSerial
+	if( links.size() > 0 )
+	{
+		return links.front();
+	}
+
+	return "";
+}
+
+string PartitionIdentity(const string &partition)
+{
+	list<string> links = linksTo( ByPartUUID, partition );
+
+	if( links.size() > 0 )
+	{
+		return links.front();
+	}
+
+	links = linksTo( ByID, partition );
+	for( const auto& link: links )
+	{
+		if( startsWith( File::GetFileName( link ), "wwn-" ) )
+		{
+			return link;
+		}
+	}
+
+	if( links.size() > 0 )
+	{
+		return links.front();
+	}
+
+	return "";
+}
+
+string LUKSIdentity(const string &device)
+{
+	// LUKS1 and LUKS2 binary headers share magic and uuid location
+	constexpr size_t uuidoffset = 168;
+	constexpr size_t uuidlen = 40;
+	constexpr char magic[] = {'L','U','K','S',(char)0xba,(char)0xbe};
+
+	char hdr[uuidoffset + uuidlen] = {};
+
+	int fd = open( device.c_str(), O_RDONLY | O_CLOEXEC );
+	if( fd < 0 )
+	{
+		logg << Logger::Debug << "Unable to open " << device << ": " << strerror(errno) << lend;
+		return "";
+	}
+	ssize_t rd = pread( fd, hdr, sizeof(hdr), 0 );
+	close( fd );
+
+	if( rd != sizeof(hdr) || memcmp( hdr, magic, sizeof(magic) ) != 0 )
+	{
+		return "";
+	}
+
+	string uuid( hdr + uuidoffset, strnlen( hdr + uuidoffset, uuidlen ) );
+
+	return uuid != "" ? ByUUID + uuid : "";
+}
+
+bool IsStable(const string &path)
+{
+	return startsWith( path, "/dev/disk/by-" );
+}
+
+string Resolve(const string &path)
+{
+	struct stat st{};
+	if( lstat( path.c_str(), &st ) != 0 )
+	{
+		return "";
+	}
+	return realPath( path );
+}
+
+} // NS DeviceIdentity
+} // NS KGP
@@ -0,0 +1,72 @@
+#ifndef DEVICEIDENTITY_H
+#define DEVICEIDENTITY_H
+
+#include <string>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief DeviceIdentity, stable naming of storage devices
+ *
+ * Kernel device names such as /dev/sda or /dev/mmcblk1p1 depend on
+ * enumeration order and might change between boots. Udev maintains
+ * symlinks under /dev/disk/by-* that are derived from persistent
+ * attributes of the device (WWN, serial, partition and LUKS UUIDs).
+ *
+ * These functions translate between kernel names and such stable links.
+ * Resolving a stable link is a single readlink, no device scan needed.
+ */
+namespace DeviceIdentity
+{
+	constexpr const char* ByID			= "/dev/disk/by-id/";
+	constexpr const char* ByPartUUID	= "/dev/disk/by-partuuid/";
+	constexpr const char* ByUUID		= "/dev/disk/by-uuid/";
+
+	/**
+	 * @brief DiskIdentity find stable link for a whole disk
+	 *        Prefers WWN based names and falls back on serial
+	 *        based names under /dev/disk/by-id
+	 * @param device path to device, i.e. /dev/sdb
+	 * @return stable path or empty string if none found
+	 */
+	string DiskIdentity(const string& device);
+
+	/**
+	 * @brief PartitionIdentity find stable link for a partition
+	 *        Prefers partition UUID and falls back on by-id names
+	 * @param partition path to partition, i.e. /dev/sdb1
+	 * @return stable path or empty string if none found
+	 */
+	string PartitionIdentity(const string& partition);
+
+	/**
+	 * @brief LUKSIdentity get stable link for a LUKS container
+	 *        UUID is read from the LUKS header directly thus this
+	 *        works before udev has caught up with a fresh format.
+	 * @param device path to device holding LUKS container
+	 * @return stable path (by-uuid) or empty string if no LUKS header
+	 */
+	string LUKSIdentity(const string& device);
+
+	/**
+	 * @brief IsStable check if path is one of the stable udev links
+	 * @param path
+	 * @return true if path resides under /dev/disk/by-*
+	 */
+	bool IsStable(const string& path);
+
+	/**
+	 * @brief Resolve resolve stable link into kernel device path
+	 * @param path stable link
+	 * @return kernel device path or empty string if link not present
+	 */
+	string Resolve(const string& path);
+
+} // NS DeviceIdentity
+
+} // NS KGP
+
+#endif // DEVICEIDENTITY_H
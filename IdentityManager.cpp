@@ -110,7 +110,16 @@ bool IdentityManager::SetFqdn(const string &name, const string &domain)
 		{
 			logg << Logger::Debug << "Update MailConfig" << lend;
 
-			mailmgr.ChangeDomain(oldFqdn, newfqdn);
+			mailmgr.ChangeDomain(oldFqdn, newfqdn, [](size_t done, size_t total)
+			{
+				logg << Logger::Debug << "Renaming mail domain, " << ( total ? done * 100 / total : 100 ) << "% done" << lend;
+			});
+
+			if( ! mailmgr.Flush() )
+			{
+				this->global_error = mailmgr.StrError();
+				return false;
+			}
 		}
 	}
 	catch (std::runtime_error& err)
@@ -0,0 +1,396 @@
+#include "MailIndex.h"
+
+#include <libutils/Exceptions.h>
+#include <libutils/Logger.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+using namespace Utils;
+
+namespace KGP
+{
+
+/*
+ * Index layout, native byte order as the index never leaves the host
+ *
+ *   Header
+ *   Stamp[sources]		state of source files when written
+ *   Record[domains]		sorted on name, value is first address
+ *						record and length the number of addresses
+ *   Record[addresses]	sorted on local part within each domain,
+ *						value is user
+ *   string pool
+ *
+ * All offsets are from start of file.
+ */
+static constexpr char Magic[8] = { 'K', 'G', 'P', 'M', 'I', 'D', 'X', '1' };
+
+struct Header
+{
+	char magic[8];
+	uint64_t size;
+	uint32_t sources;
+	uint32_t domains;
+	uint32_t addresses;
+	uint32_t reserved;
+};
+
+struct Stamp
+{
+	uint64_t inode;
+	uint64_t size;
+	uint64_t sec;
+	uint64_t nsec;
+
+	bool operator==(const Stamp& other) const
+	{
+		return inode == other.inode && size == other.size && sec == other.sec && nsec == other.nsec;
+	}
+};
+
+struct MailIndex::Record
+{
+	uint32_t key;
+	uint32_t keylen;
+	uint32_t value;
+	uint32_t valuelen;
+};
+
+static Stamp stampFile(const string& path)
+{
+	struct stat st{};
+
+	if( stat( path.c_str(), &st ) != 0 )
+	{
+		return { 0, 0, 0, 0 };
+	}
+
+	return { static_cast<uint64_t>( st.st_ino ), static_cast<uint64_t>( st.st_size ),
+				static_cast<uint64_t>( st.st_mtim.tv_sec ), static_cast<uint64_t>( st.st_mtim.tv_nsec ) };
+}
+
+// Same ordering as std::string, i.e. unsigned bytewise
+static int compare(const char* data, uint32_t off, uint32_t len, const string& key)
+{
+	int res = memcmp( data + off, key.data(), min<size_t>( len, key.size() ) );
+	if( res != 0 )
+	{
+		return res;
+	}
+	return len < key.size() ? -1 : ( len > key.size() ? 1 : 0 );
+}
+
+MailIndex::MailIndex(const string &path, const list<string> &sources):
+	path(path), sources(sources), data(nullptr), size(0), inode(0), mtime({0, 0})
+{
+}
+
+void MailIndex::Write(const unordered_map<string, unordered_map<string, string> > &addresses)
+{
+	typedef pair<const string, unordered_map<string,string>> Domain;
+	typedef pair<const string, string> Address;
+
+	vector<const Domain*> domains;
+	size_t naddr = 0;
+	for( const auto& domain: addresses )
+	{
+		domains.push_back( &domain );
+		naddr += domain.second.size();
+	}
+	sort( domains.begin(), domains.end(), [](const Domain* a, const Domain* b){ return a->first < b->first; } );
+
+	const size_t tables = sizeof( Header ) + this->sources.size() * sizeof( Stamp );
+	const size_t poolstart = tables + ( domains.size() + naddr ) * sizeof( Record );
+
+	vector<Record> records;
+	records.reserve( domains.size() + naddr );
+	records.resize( domains.size() );
+	string pool;
+
+	auto addString = [&pool, poolstart](const string& s, uint32_t& off, uint32_t& len)
+	{
+		off = poolstart + pool.size();
+		len = s.size();
+		pool += s;
+	};
+
+	vector<const Address*> addrs;
+	for( size_t i = 0; i < domains.size(); i++ )
+	{
+		addString( domains[i]->first, records[i].key, records[i].keylen );
+		records[i].value = records.size() - domains.size();
+		records[i].valuelen = domains[i]->second.size();
+
+		addrs.clear();
+		for( const auto& addr: domains[i]->second )
+		{
+			addrs.push_back( &addr );
+		}
+		sort( addrs.begin(), addrs.end(), [](const Address* a, const Address* b){ return a->first < b->first; } );
+
+		for( const Address* addr: addrs )
+		{
+			Record rec;
+			addString( addr->first, rec.key, rec.keylen );
+			addString( addr->second, rec.value, rec.valuelen );
+			records.push_back( rec );
+		}
+	}
+
+	Header header{};
+	memcpy( header.magic, Magic, sizeof( Magic ) );
+	header.size = poolstart + pool.size();
+	header.sources = this->sources.size();
+	header.domains = domains.size();
+	header.addresses = naddr;
+
+	if( header.size > UINT32_MAX )
+	{
+		throw std::runtime_error("Mail index too large");
+	}
+
+	string buf;
+	buf.reserve( header.size );
+	buf.append( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+	for( const string& source: this->sources )
+	{
+		const Stamp stamp = stampFile( source );
+		buf.append( reinterpret_cast<const char*>( &stamp ), sizeof( stamp ) );
+	}
+	buf.append( reinterpret_cast<const char*>( records.data() ), records.size() * sizeof( Record ) );
+	buf += pool;
+
+	/*
+	 * Not synced, the index can always be regenerated. A damaged
+	 * index after a crash fails validation when mapped.
+	 */
+	string tmpl = this->path + ".XXXXXX";
+	vector<char> name( tmpl.begin(), tmpl.end() );
+	name.push_back('\0');
+
+	// Unique name, concurrent writers never share a temporary file
+	int fd = mkostemp( name.data(), O_CLOEXEC );
+	if( fd < 0 )
+	{
+		throw ErrnoException("Failed to create temporary index for " + this->path );
+	}
+	const string tmp( name.data() );
+
+	// Index reveals the maps, same owner as them and no world access
+	struct stat st{};
+	if( fchmod( fd, 0640 ) != 0 || ( ! this->sources.empty() && stat( this->sources.front().c_str(), &st ) == 0 &&
+			fchown( fd, st.st_uid, st.st_gid ) != 0 ) )
+	{
+		close( fd );
+		unlink( tmp.c_str() );
+		throw ErrnoException("Failed to set owner of " + tmp );
+	}
+
+	size_t written = 0;
+	while( written < buf.size() )
+	{
+		ssize_t res = write( fd, buf.data() + written, buf.size() - written );
+		if( res < 0 )
+		{
+			close( fd );
+			unlink( tmp.c_str() );
+			throw ErrnoException("Failed to write " + tmp );
+		}
+		written += res;
+	}
+	close( fd );
+
+	if( rename( tmp.c_str(), this->path.c_str() ) != 0 )
+	{
+		unlink( tmp.c_str() );
+		throw ErrnoException("Failed to replace " + this->path );
+	}
+
+	logg << Logger::Debug << "Wrote mail index, " << header.domains << " domains "
+		 << header.addresses << " addresses" << lend;
+}
+
+bool MailIndex::Current()
+{
+	struct stat st{};
+
+	if( stat( this->path.c_str(), &st ) != 0 )
+	{
+		this->unmap();
+		return false;
+	}
+
+	if( ! this->data || st.st_ino != this->inode || static_cast<size_t>( st.st_size ) != this->size ||
+			st.st_mtim.tv_sec != this->mtime.tv_sec || st.st_mtim.tv_nsec != this->mtime.tv_nsec )
+	{
+		this->unmap();
+		if( ! this->map() )
+		{
+			return false;
+		}
+	}
+
+	const Stamp* stamps = reinterpret_cast<const Stamp*>( this->data + sizeof( Header ) );
+	for( const string& source: this->sources )
+	{
+		if( ! ( stampFile( source ) == *stamps++ ) )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool MailIndex::hasDomain(const string &domain) const
+{
+	return this->findDomain( domain ) != nullptr;
+}
+
+bool MailIndex::hasAddress(const string &domain, const string &address) const
+{
+	return this->findAddress( domain, address ) != nullptr;
+}
+
+bool MailIndex::GetAddress(const string &domain, const string &address, const char *&user, size_t &len) const
+{
+	const Record* rec = this->findAddress( domain, address );
+	if( ! rec )
+	{
+		return false;
+	}
+
+	user = this->data + rec->value;
+	len = rec->valuelen;
+
+	return true;
+}
+
+MailIndex::~MailIndex()
+{
+	this->unmap();
+}
+
+void MailIndex::unmap()
+{
+	if( this->data )
+	{
+		munmap( const_cast<char*>( this->data ), this->size );
+	}
+	this->data = nullptr;
+	this->size = 0;
+	this->inode = 0;
+	this->mtime = {0, 0};
+}
+
+bool MailIndex::map()
+{
+	int fd = open( this->path.c_str(), O_RDONLY | O_CLOEXEC );
+	if( fd < 0 )
+	{
+		return false;
+	}
+
+	struct stat st{};
+	if( fstat( fd, &st ) != 0 || static_cast<size_t>( st.st_size ) < sizeof( Header ) )
+	{
+		close( fd );
+		return false;
+	}
+
+	void* addr = mmap( nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( addr == MAP_FAILED )
+	{
+		logg << Logger::Notice << "Failed to map mail index: " << strerror( errno ) << lend;
+		return false;
+	}
+
+	this->data = static_cast<const char*>( addr );
+	this->size = st.st_size;
+	this->inode = st.st_ino;
+	this->mtime = st.st_mtim;
+
+	// Validate once per index, lookups then trust offsets
+	const Header* h = reinterpret_cast<const Header*>( this->data );
+	const size_t tables = sizeof( Header ) + h->sources * sizeof( Stamp );
+	const size_t nrec = static_cast<size_t>( h->domains ) + h->addresses;
+	bool valid = memcmp( h->magic, Magic, sizeof( Magic ) ) == 0 &&
+			h->size == this->size &&
+			h->sources == this->sources.size() &&
+			tables + nrec * sizeof( Record ) <= this->size;
+
+	const Record* rec = reinterpret_cast<const Record*>( this->data + tables );
+	for( size_t i = 0; valid && i < nrec; i++ )
+	{
+		valid = static_cast<size_t>( rec[i].key ) + rec[i].keylen <= this->size &&
+				( i < h->domains ?
+					static_cast<size_t>( rec[i].value ) + rec[i].valuelen <= h->addresses :
+					static_cast<size_t>( rec[i].value ) + rec[i].valuelen <= this->size );
+	}
+
+	if( ! valid )
+	{
+		logg << Logger::Notice << "Ignoring invalid mail index " << this->path << lend;
+		this->unmap();
+		return false;
+	}
+
+	return true;
+}
+
+const MailIndex::Record *MailIndex::findDomain(const string &domain) const
+{
+	const Header* h = reinterpret_cast<const Header*>( this->data );
+	const Record* first = reinterpret_cast<const Record*>( this->data + sizeof( Header ) + h->sources * sizeof( Stamp ) );
+	const Record* last = first + h->domains;
+
+	const Record* rec = lower_bound( first, last, domain, [this](const Record& r, const string& key)
+	{
+		return compare( this->data, r.key, r.keylen, key ) < 0;
+	});
+
+	if( rec == last || compare( this->data, rec->key, rec->keylen, domain ) != 0 )
+	{
+		return nullptr;
+	}
+
+	return rec;
+}
+
+const MailIndex::Record *MailIndex::findAddress(const string &domain, const string &address) const
+{
+	const Record* dom = this->findDomain( domain );
+	if( ! dom )
+	{
+		return nullptr;
+	}
+
+	const Header* h = reinterpret_cast<const Header*>( this->data );
+	const Record* addrs = reinterpret_cast<const Record*>( this->data + sizeof( Header ) + h->sources * sizeof( Stamp ) ) + h->domains;
+	const Record* first = addrs + dom->value;
+	const Record* last = first + dom->valuelen;
+
+	const Record* rec = lower_bound( first, last, address, [this](const Record& r, const string& key)
+	{
+		return compare( this->data, r.key, r.keylen, key ) < 0;
+	});
+
+	if( rec == last || compare( this->data, rec->key, rec->keylen, address ) != 0 )
+	{
+		return nullptr;
+	}
+
+	return rec;
+}
+
+} // Namespace KGP
@@ -0,0 +1,99 @@
+#ifndef MAILINDEX_H
+#define MAILINDEX_H
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief The MailIndex class, sorted binary index of mail domains and
+ *        addresses
+ *
+ * The index is a single file holding sorted tables of domains and of
+ * local parts per domain, with offsets into a string pool. It is mapped
+ * read only and lookups are binary searches directly in the mapping,
+ * without parsing or allocating. Any number of processes may map the
+ * same index.
+ *
+ * The index is derived data. It records the identity (inode, size and
+ * modification time) of the files it was generated from, typically the
+ * virtual mailbox and domain maps and the mail journal, and is only
+ * considered current while these are unchanged. A new index is written
+ * under a temporary name and renamed into place, readers pick it up on
+ * their next lookup. The index gets the owner of the first source and
+ * mode 0640.
+ */
+class MailIndex
+{
+public:
+	/**
+	 * @brief MailIndex
+	 * @param path index file
+	 * @param sources files the index is derived from
+	 */
+	MailIndex(const string& path, const list<string>& sources);
+
+	/**
+	 * @brief Write generate a new index
+	 * @param addresses domain -> localpart -> user. Sources should be
+	 *        written before, their current state is recorded
+	 */
+	void Write(const unordered_map<string, unordered_map<string,string>>& addresses);
+
+	/**
+	 * @brief Current map index if replaced on disk and check that it
+	 *        matches its sources
+	 * @return true if lookups can be made
+	 */
+	bool Current();
+
+	/*
+	 * Lookups, only valid if Current returned true
+	 */
+	bool hasDomain(const string& domain) const;
+	bool hasAddress(const string& domain, const string& address) const;
+
+	/**
+	 * @brief GetAddress look up user for address
+	 * @param domain
+	 * @param address local part
+	 * @param user set to user, points into index and is valid until
+	 *        next call to Current
+	 * @param len set to length of user
+	 * @return true if address found
+	 */
+	bool GetAddress(const string& domain, const string& address, const char*& user, size_t& len) const;
+
+	virtual ~MailIndex();
+
+private:
+	struct Record;
+
+	void unmap();
+	bool map();
+	const Record* findDomain(const string& domain) const;
+	const Record* findAddress(const string& domain, const string& address) const;
+
+	string path;
+	list<string> sources;
+
+	// Currently mapped index
+	const char* data;
+	size_t size;
+	ino_t inode;
+	struct timespec mtime;
+};
+
+} // Namespace KGP
+
+#endif // MAILINDEX_H
@@ -1,23 +1,51 @@
 #include "MailManager.h"
+#include "StorageManager.h"
+#include "PostfixConfig.h"
+#include "PostfixTable.h"
 
-#include <libopi/FetchmailConfig.h>
 #include <libopi/ServiceHelper.h>
-#include <libopi/MailConfig.h>
 
-#include <libutils/UserGroups.h>
-#include <libutils/Process.h>
+#include <libutils/FileUtils.h>
 #include <libutils/Logger.h>
 
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+
 using namespace OPI;
 
 //TODO: move to sysconfig or better, move storage to secop
 #define FETCHMAILRC	"/var/opi/etc/fetchmailrc"
+#define FETCHSCHEDULE	"/var/opi/etc/fetchschedule.json"
+#define POSTFIXMAIN	"/etc/postfix/main.cf"
+#define POSTFIXTABLETYPE	"cdb"
+#define POSTMAP	"/usr/sbin/postmap"
 
 namespace KGP
 {
 
-MailManager::MailManager(): fetchmailupdated(false), postfixupdated(false)
+MailManager::MailManager():
+	fetchmailupdated(false), postfixupdated(false), postfixreload(false),
+	reloads(0), reloadsskipped(0),
+	transaction(false), txfetchmail(false), txpostfix(false), txreload(false),
+	txsync(false), txsyncforce(false), txchanges(0),
+	remoteaccounts(FETCHMAILRC),
+	syncdelay(DefaultSyncDelay), syncpending(false), syncforce(false), syncstop(false)
 {
+	if( SCFG.HasKey("mail", "syncdelay") )
+	{
+		this->syncdelay = chrono::milliseconds( SCFG.GetKeyAsInt("mail", "syncdelay") );
+	}
+
+	this->queue = std::make_unique<MailQueue>(
+				SCFG.HasKey("mail", "queuedir") ? SCFG.GetKeyAsString("mail", "queuedir") : "/var/spool/postfix",
+				chrono::seconds( SCFG.HasKey("mail", "queueinterval") ? SCFG.GetKeyAsInt("mail", "queueinterval") : 60 ),
+				SCFG.HasKey("mail", "queuescanlimit") ? SCFG.GetKeyAsInt("mail", "queuescanlimit") : 1000 );
+
+	this->maps.SetLocalDomains( MailManager::localDomains() );
+
 	logg << Logger::Notice << "Mailmanager initialized" << lend;
 }
 
@@ -30,12 +58,12 @@ MailManager &MailManager::Instance()
 
 void MailManager::DeleteUser(const string &user)
 {
-	// Remove any fetchmail accounts
-	list<map<string,string>> accounts = this->GetRemoteAccounts( user );
-
-	for(map<string,string>& account: accounts)
+	ChangeScope scope( *this );
+	// Remove any fetchmail accounts, one write for all
+	this->waitStorage();
+	if( this->remoteaccounts.DeleteUserAccounts( user ) > 0 )
 	{
-		this->DeleteRemoteAccount( account["host"], account["identity"]);
+		this->writeFetchmail();
 	}
 
 	// Delete all incoming addresses
@@ -44,8 +72,9 @@ void MailManager::DeleteUser(const string &user)
 	// Delete user from localmail
 	this->RemoveLocalAddress(user);
 
-	// If in aliases, remove as well
+	// If in aliases, remove as well. Admin mail aliases use the local address
 	this->RemoveUserAliases( user );
+	this->RemoveUserAliases( user + "@localdomain" );
 }
 
 bool MailManager::AddToAdmin(const string &user)
@@ -72,22 +101,24 @@ bool MailManager::RemoveFromAdmin(const string &user)
 
 bool MailManager::SetHostname(const string &name, const string& domain)
 {
+	ChangeScope scope( *this );
 	try
 	{
 		File::Write("/etc/mailname", name + "."+ domain, File::UserRW | File::GroupRead | File::OtherRead);
 
-		bool res = false;
-		stringstream cmd;
-		cmd << "/usr/sbin/postconf -e \"myhostname=" << name << "." << domain <<"\"";
-		tie(res, std::ignore) = Process::Exec(cmd.str() );
+		PostfixConfig maincf( POSTFIXMAIN );
+		maincf.Set( "myhostname", name + "." + domain );
 
-		if( ! res )
+		if( maincf.Write() )
 		{
-			this->global_error = "Failed to update postfix hostname";
-			logg << Logger::Error << this->global_error << lend;
-			return false;
+			// main.cf changed, needs a reload
+			this->postfixreload = true;
+			this->postfixupdated = true;
 		}
 
+		// Admin aliases follow the new hostname
+		this->maps.SetLocalDomains( MailManager::localDomains() );
+
 	}
 	catch (std::runtime_error& err)
 	{
@@ -101,116 +132,125 @@ bool MailManager::SetHostname(const string &name, const string& domain)
 
 list<string> MailManager::GetDomains()
 {
-	return MailConfig().GetDomains();
+	this->waitStorage();
+
+	return this->maps.GetDomains();
 }
 
 void MailManager::AddDomain(const string &domain)
 {
-	MailConfig mc;
+	ChangeScope scope( *this );
+	this->waitStorage();
 
-	mc.AddDomain(domain);
-	mc.WriteConfig();
+	this->maps.AddDomain(domain);
 	this->postfixupdated = true;
+	this->flushChange();
 }
 
 void MailManager::DeleteDomain(const string &domain)
 {
-	MailConfig mc;
-	mc.DeleteDomain( domain );
-	mc.WriteConfig();
+	ChangeScope scope( *this );
+	this->waitStorage();
+
+	this->maps.DeleteDomain( domain );
 	this->postfixupdated = true;
+	this->flushChange();
 }
 
 void MailManager::SetAddress(const string &domain, const string &address, const string &user)
 {
-	MailConfig mc;
-	mc.SetAddress(domain, address, user);
-	mc.WriteConfig();
+	ChangeScope scope( *this );
+	this->waitStorage();
+
+	this->maps.SetAddress(domain, address, user);
 	this->postfixupdated = true;
+	this->flushChange();
 }
 
 void MailManager::DeleteAddress(const string &domain, const string &address)
 {
-	MailConfig mc;
-	mc.DeleteAddress(domain, address);
-	mc.WriteConfig();
+	ChangeScope scope( *this );
+	this->waitStorage();
+
+	this->maps.DeleteAddress(domain, address);
 	this->postfixupdated = true;
+	this->flushChange();
 }
 
 void MailManager::DeleteAddresses(const string &user)
 {
-	MailConfig mc;
-
-	list<string> doms = mc.GetDomains();
+	ChangeScope scope( *this );
+	this->waitStorage();
 
-	for( const auto& domain: doms)
-	{
-		list<tuple<string,string>> addrs = mc.GetAddresses(domain);
-
-		for( const tuple<string,string> &addr: addrs)
-		{
-			string localpart, auser;
-			tie(localpart, auser) = addr;
-
-			if( auser == user )
-			{
-				mc.DeleteAddress(domain,localpart);
-			}
-		}
-
-	}
-	mc.WriteConfig();
+	this->maps.DeleteUserAddresses( user );
 	this->postfixupdated = true;
+	this->flushChange();
+}
+
+list<tuple<string, string> > MailManager::GetUserAddresses(const string &user)
+{
+	this->waitStorage();
 
+	return this->maps.GetUserAddresses( user );
 }
 
 list<tuple<string, string> > MailManager::GetAddresses(const string &domain)
 {
-	MailConfig mc;
-	return mc.GetAddresses(domain);
+	this->waitStorage();
+
+	return this->maps.GetAddresses(domain);
 }
 
-void MailManager::ChangeDomain(const string &from, const string &to)
+void MailManager::ChangeDomain(const string &from, const string &to, MailMaps::Progress progress)
 {
-	MailConfig mc;
-	mc.ChangeDomain(from, to);
-	mc.WriteConfig();
+	ChangeScope scope( *this );
+	this->waitStorage();
+
+	if( this->transaction )
+	{
+		// Map files are rewritten in place, nothing to roll back to
+		this->global_error = "Mail domain change not possible within transaction";
+		logg << Logger::Error << this->global_error << lend;
+		throw std::runtime_error( this->global_error );
+	}
+
+	this->maps.ChangeDomain(from, to, progress);
 	this->postfixupdated = true;
 }
 
 tuple<string, string> MailManager::GetAddress(const string &domain, const string &address)
 {
-	return MailConfig().GetAddress(domain, address);
+	this->waitStorage();
+
+	return this->maps.GetAddress(domain, address);
 }
 
 bool MailManager::hasDomain(const string &domain)
 {
-	return MailConfig().hasDomain(domain);
+	this->waitStorage();
+
+	return this->maps.hasDomain(domain);
 }
 
 bool MailManager::hasAddress(const string &domain, const string &address)
 {
-	return MailConfig().hasAddress(domain, address);
+	this->waitStorage();
+
+	return this->maps.hasAddress(domain, address);
 }
 
 bool MailManager::SetLocalAddress(const string &user)
 {
-	const string localmail(SCFG.GetKeyAsString("filesystem", "storagemount")+SCFG.GetKeyAsString("mail", "localmail"));
+	ChangeScope scope( *this );
+	if( ! this->storageReady() )
+	{
+		return false;
+	}
+
 	try
 	{
 		// Add user to localdomain mailboxfile
-
-		OPI::MailMapFile mmf( localmail );
-		mmf.ReadConfig();
-		mmf.SetAddress("localdomain", user, user);
-		mmf.WriteConfig();
-
-		if( chown( localmail.c_str(), User::UserToUID("postfix"), Group::GroupToGID("postfix") ) != 0 )
-		{
-			this->global_error = string("Failed to chown localmail (")+strerror(errno)+")";
-			logg << Logger::Error << this->global_error << lend;
-			return false;
-		}
+		this->maps.SetLocalAddress("localdomain", user, user);
 	}
 	catch( runtime_error& err)
 	{
@@ -219,20 +259,21 @@ bool MailManager::SetLocalAddress(const string &user)
 	}
 
 	this->postfixupdated = true;
-	return true;
+	return this->Flush();
 }
 
 bool MailManager::RemoveLocalAddress(const string &user)
 {
-	const string localmail(SCFG.GetKeyAsString("filesystem", "storagemount")+SCFG.GetKeyAsString("mail", "localmail"));
+	ChangeScope scope( *this );
+	if( ! this->storageReady() )
+	{
+		return false;
+	}
+
 	try
 	{
 		// Remove user from localdomain mailboxfile
-
-		OPI::MailMapFile mmf( localmail );
-		mmf.ReadConfig();
-		mmf.DeleteAddress("localdomain", user);
-		mmf.WriteConfig();
+		this->maps.DeleteLocalAddress("localdomain", user);
 	}
 	catch( runtime_error& err)
 	{
@@ -242,62 +283,71 @@ bool MailManager::RemoveLocalAddress(const string &user)
 	}
 
 	this->postfixupdated = true;
-	return true;
+	return this->Flush();
 }
 
 list<map<string, string> > MailManager::GetRemoteAccounts(const string &user)
 {
-	FetchmailConfig fc( FETCHMAILRC );
+	this->waitStorage();
 
-	return fc.GetAccounts( user );
+	return this->remoteaccounts.GetAccounts( user );
 }
 
 map<string, string> MailManager::GetRemoteAccount(const string &hostname, const string &identity)
 {
-	FetchmailConfig fc( FETCHMAILRC );
+	this->waitStorage();
 
-	return fc.GetAccount( hostname, identity);
+	map<string,string> account = this->remoteaccounts.GetAccount( hostname, identity);
+
+	if( this->fetcher )
+	{
+		for( const auto& status: this->fetcher->GetStatus( hostname, identity ) )
+		{
+			account[status.first] = status.second;
+		}
+	}
+
+	return account;
 }
 
 void MailManager::AddRemoteAccount(const string &email, const string &host, const string &identity, const string &password, const string &user, bool ssl)
 {
-	FetchmailConfig fc( FETCHMAILRC);
+	ChangeScope scope( *this );
+	this->waitStorage();
 
-	fc.AddAccount(email, host, identity, password, user, ssl );
-	fc.WriteConfig();
-
-	this->fetchmailupdated = true;
+	this->remoteaccounts.AddAccount(email, host, identity, password, user, ssl );
+	this->writeFetchmail();
 }
 
 void MailManager::UpdateRemoteAccount(const string &email, const string &host, const string &identity, const string &password, const string &user, bool ssl)
 {
-	FetchmailConfig fc( FETCHMAILRC );
-
-	fc.UpdateAccount(email, host, identity, password, user, ssl );
-	fc.WriteConfig();
+	ChangeScope scope( *this );
+	this->waitStorage();
 
-	this->fetchmailupdated = true;
+	this->remoteaccounts.UpdateAccount(email, host, identity, password, user, ssl );
+	this->writeFetchmail();
 }
 
 void MailManager::DeleteRemoteAccount(const string &hostname, const string &identity)
 {
-	FetchmailConfig fc( FETCHMAILRC );
-
-	fc.DeleteAccount(hostname, identity);
-	fc.WriteConfig();
+	ChangeScope scope( *this );
+	this->waitStorage();
 
-	this->fetchmailupdated = true;
+	this->remoteaccounts.DeleteAccount(hostname, identity);
+	this->writeFetchmail();
 }
 
 list<string> MailManager::GetAliases()
 {
+	if( ! this->storageReady() )
+	{
+		return {};
+	}
+
 	list<string> ret;
-	const string virtual_aliases(SCFG.GetKeyAsString("filesystem", "storagemount") + SCFG.GetKeyAsString("mail","virtualalias"));
 	try
 	{
-		OPI::MailAliasFile mf( virtual_aliases );
-
-		ret = mf.GetAliases();
+		ret = this->maps.GetAliases();
 	}
 	catch( runtime_error& err)
 	{
@@ -308,13 +358,15 @@ list<string> MailManager::GetAliases()
 
 list<string> MailManager::GetAliasUsers(const string &alias)
 {
+	if( ! this->storageReady() )
+	{
+		return {};
+	}
+
 	list<string> ret;
-	const string virtual_aliases(SCFG.GetKeyAsString("filesystem", "storagemount") + SCFG.GetKeyAsString("mail","virtualalias"));
 	try
 	{
-		OPI::MailAliasFile mf( virtual_aliases );
-
-		ret = mf.GetUsers( alias );
+		ret = this->maps.GetAliasUsers( alias );
 	}
 	catch( runtime_error& err)
 	{
@@ -325,14 +377,15 @@ list<string> MailManager::GetAliasUsers(const string &alias)
 
 bool MailManager::AddUserAlias(const string &alias, const string &user)
 {
-	const string virtual_aliases(SCFG.GetKeyAsString("filesystem", "storagemount") + SCFG.GetKeyAsString("mail","virtualalias"));
-	try
+	ChangeScope scope( *this );
+	if( ! this->storageReady() )
 	{
-		OPI::MailAliasFile mf( virtual_aliases );
-
-		mf.AddUser(alias,user);
+		return false;
+	}
 
-		mf.WriteConfig();
+	try
+	{
+		this->maps.AddAliasUser(alias,user);
 	}
 	catch( runtime_error& err)
 	{
@@ -340,27 +393,21 @@ bool MailManager::AddUserAlias(const string &alias, const string &user)
 		return false;
 	}
 
-	if ( chown( virtual_aliases.c_str(), User::UserToUID("postfix"), Group::GroupToGID("postfix") ) != 0 )
-	{
-		this->global_error = strerror(errno);
-		logg << Logger::Error << "Failed to chown aliases file: " << this->global_error << lend;
-		return false;
-	}
-
 	this->postfixupdated = true;
-	return true;
+	return this->Flush();
 }
 
 bool MailManager::RemoveUserAlias(const string &alias, const string &user)
 {
-	const string virtual_aliases(SCFG.GetKeyAsString("filesystem", "storagemount") + SCFG.GetKeyAsString("mail","virtualalias"));
-	try
+	ChangeScope scope( *this );
+	if( ! this->storageReady() )
 	{
-		OPI::MailAliasFile mf( virtual_aliases );
-
-		mf.RemoveUser(alias, user);
+		return false;
+	}
 
-		mf.WriteConfig();
+	try
+	{
+		this->maps.RemoveAliasUser(alias, user);
 	}
 	catch( runtime_error& err)
 	{
@@ -369,31 +416,50 @@ bool MailManager::RemoveUserAlias(const string &alias, const string &user)
 		return false;
 	}
 
-	return true;
+	this->postfixupdated = true;
+	return this->Flush();
 }
 
-bool MailManager::RemoveUserAliases(const string &user)
+list<string> MailManager::GetUserAliases(const string &user)
 {
-	list<string> aliases = this->GetAliases();
-
-	for( const string& alias: aliases)
+	if( ! this->storageReady() )
 	{
+		return {};
+	}
 
-		list<string> users = this->GetAliasUsers( alias );
+	list<string> ret;
+	try
+	{
+		ret = this->maps.GetUserAliases( user );
+	}
+	catch( runtime_error& err)
+	{
+		this->global_error = string("Failed to retrieve aliases (")+err.what()+")";
+	}
+	return ret;
+}
 
-		for( const string& auser: users)
-		{
-			if( auser == user )
-			{
-				if( ! this->RemoveUserAlias(alias, user) )
-				{
-					return false;
-				}
-			}
-		}
+bool MailManager::RemoveUserAliases(const string &user)
+{
+	ChangeScope scope( *this );
+	if( ! this->storageReady() )
+	{
+		return false;
+	}
 
+	try
+	{
+		this->maps.RemoveUserAliases( user );
 	}
-	return true;
+	catch( runtime_error& err)
+	{
+		this->global_error = string("Failed to remove user aliases (")+err.what()+")";
+		logg << Logger::Error << this->global_error << lend;
+		return false;
+	}
+
+	this->postfixupdated = true;
+	return this->Flush();
 }
 
 
@@ -401,133 +467,867 @@ bool MailManager::RemoveUserAliases(const string &user)
 // Merge of update_postfix and reload fetchmail
 bool MailManager::Synchronize(bool force)
 {
-	bool p_ret = true; // Postfixreturn
+	SyncResult res = this->synchronize( force );
+
+	if( res == SyncDeferred )
+	{
+		this->global_error = "Mail synchronize deferred to end of transaction";
+		logg << Logger::Debug << this->global_error << lend;
+	}
+
+	return res == SyncOk;
+}
+
+MailManager::SyncResult MailManager::synchronize(bool force)
+{
+	if( ! this->storageReady() )
+	{
+		return SyncFailed;
+	}
+
+	lock_guard<mutex> l( this->synclock );
+
+	if( this->transaction )
+	{
+		this->txsync = true;
+		this->txsyncforce |= force;
+		return SyncDeferred;
+	}
+
+	// Changes made while synchronizing are picked up next round
+	const bool reload = this->postfixreload.exchange( false ) || this->maps.DomainsChanged() || force;
+	const bool postfix = this->postfixupdated.exchange( false ) || reload;
+	const bool fetchmail = this->fetchmailupdated.exchange( false ) || force;
+
+	bool p_ret = this->Flush(); // Postfixreturn
 	bool f_ret = true; // Fetchmailreturn
 	SysConfig sysconfig;
 
-	if( this->postfixupdated || force )
+	if( postfix )
 	{
 		bool status = false;
-		string aliases = sysconfig.GetKeyAsString("filesystem","storagemount") + "/" + sysconfig.GetKeyAsString("mail","vmailbox");
-		tie(status, std::ignore) = Utils::Process::Exec( "/usr/sbin/postmap " + aliases );
-		if( !status )
+		const string storage = sysconfig.GetKeyAsString("filesystem","storagemount") + "/";
+		const string tabletype = MailManager::tableType( sysconfig );
+		const string postmap = MailManager::postmapCommand( sysconfig );
+		const list<pair<string,string>> tables =
 		{
-			this->global_error = "Falied to process aliases file";
-			logg << Logger::Error << this->global_error  << lend;
-			p_ret = false;
-		}
+			{ storage + sysconfig.GetKeyAsString("mail", "vmailbox"),	"Falied to process aliases file" },
+			{ storage + sysconfig.GetKeyAsString("mail", "saslpasswd"),	"Falied to process sasl password file" },
+			{ storage + sysconfig.GetKeyAsString("mail", "localmail"),	"Falied to process local mail file" },
+		};
 
-		string saslpwd = sysconfig.GetKeyAsString("filesystem","storagemount") + "/" + sysconfig.GetKeyAsString("mail","saslpasswd");
-		tie(status, std::ignore) = Utils::Process::Exec( "/usr/sbin/postmap " + saslpwd );
-		if( !status )
+		// Fold journaled changes into the map files postfix tables are built from
+		try
+		{
+			if( this->maps.Compact() )
+			{
+				logg << Logger::Debug << "Compacted mail maps" << lend;
+			}
+		}
+		catch( std::runtime_error& err )
 		{
-			this->global_error = "Falied to process sasl password file";
+			this->global_error = string("Failed to write mail maps (")+err.what()+")";
 			logg << Logger::Error << this->global_error << lend;
 			p_ret = false;
 		}
 
-		string localmail = sysconfig.GetKeyAsString("filesystem","storagemount") + "/" + sysconfig.GetKeyAsString("mail","localmail");
-		tie(status, std::ignore) = Utils::Process::Exec( "/usr/sbin/postmap " + localmail );
-		if( !status )
+		for( const auto& table: tables )
 		{
-			this->global_error = "Falied to process local mail file";
+			PostfixTable pt( table.first, tabletype, postmap );
+
+			if( pt.Update( force ) == PostfixTable::Failed )
+			{
+				this->global_error = table.second;
+				logg << Logger::Error << this->global_error << lend;
+				p_ret = false;
+			}
+		}
+
+		// Domain alias expansion is held in memory, no need to reparse it
+		PostfixTable domainaliases( MailMaps::DomainAliasMap( sysconfig ), tabletype, postmap );
+		if( domainaliases.Update( this->maps.DomainAliasEntries(), force ) == PostfixTable::Failed )
+		{
+			this->global_error = "Failed to process domain alias map";
 			logg << Logger::Error << this->global_error << lend;
 			p_ret = false;
 		}
 
-		status = ServiceHelper::Reload("postfix");
-		if( !status )
+		/*
+		 * Postfix picks up rebuilt lookup tables by itself, only domain list
+		 * and main.cf are read at (re)start
+		 */
+		if( reload )
 		{
-			this->global_error = "Falied to reload postfix";
+			logg << Logger::Notice << "Domains or postfix configuration changed, reloading postfix" << lend;
+			this->reloads++;
+
+			status = this->service( "postfix", "reload" );
+			if( !status )
+			{
+				this->global_error = "Falied to reload postfix";
+				logg << Logger::Error << this->global_error << lend;
+				p_ret = false;
+			}
+		}
+		else
+		{
+			logg << Logger::Debug << "Only lookup tables changed, not reloading postfix" << lend;
+			this->reloadsskipped++;
+		}
+
+		if( ! p_ret )
+		{
+			this->postfixupdated = true;
+			this->postfixreload = this->postfixreload || reload;
+		}
+	}
+
+	if ( fetchmail )
+	{
+		f_ret = this->reloadFetchmail( force );
+
+		if( ! f_ret )
+		{
+			this->fetchmailupdated = true;
+			this->global_error = "Falied to restart fetchmail";
 			logg << Logger::Error << this->global_error << lend;
-			p_ret = false;
 		}
+	}
+
+	return p_ret && f_ret ? SyncOk : SyncFailed;
+}
+
+MailManager::SyncStats MailManager::GetSyncStats()
+{
+	return { this->reloads.load(), this->reloadsskipped.load() };
+}
+
+void MailManager::SetServiceControl(ServiceControl control)
+{
+	this->servicecontrol = control;
+}
+
+MailQueue::Stats MailManager::GetQueueStats(bool refresh)
+{
+	return this->queue->GetStats( refresh );
+}
+
+shared_future<bool> MailManager::SynchronizeAsync(bool force)
+{
+	lock_guard<mutex> l( this->asynclock );
 
-		if( p_ret )
+	const auto now = chrono::steady_clock::now();
+
+	if( ! this->syncpending )
+	{
+		this->syncresult = promise<bool>();
+		this->syncfuture = this->syncresult.get_future().share();
+		this->syncpending = true;
+		this->firstrequest = now;
+	}
+	this->lastrequest = now;
+	this->syncforce |= force;
+
+	if( ! this->syncworker.joinable() )
+	{
+		this->syncworker = thread( &MailManager::syncWorker, this );
+	}
+	this->synccond.notify_one();
+
+	return this->syncfuture;
+}
+
+void MailManager::SetSyncDelay(chrono::milliseconds delay)
+{
+	lock_guard<mutex> l( this->asynclock );
+
+	this->syncdelay = delay;
+	this->synccond.notify_one();
+}
+
+
+bool MailManager::Flush()
+{
+	if( this->transaction )
+	{
+		return true;
+	}
+
+	try
+	{
+		if( this->maps.Flush() )
 		{
-			this->postfixupdated = false;
+			logg << Logger::Debug << "Flushed mail maps" << lend;
 		}
+
+		this->remoteaccounts.Write();
 	}
+	catch( std::runtime_error& err )
+	{
+		this->global_error = string("Failed to write mail maps (")+err.what()+")";
+		logg << Logger::Error << this->global_error << lend;
+		return false;
+	}
+	return true;
+}
 
-	if ( this->fetchmailupdated || force )
+bool MailManager::Begin()
+{
+	if( ! this->storageReady() )
 	{
-		f_ret = ServiceHelper::Stop( "fetchmail" );
-		f_ret &= ServiceHelper::Start( "fetchmail" );
+		return false;
+	}
+
+	unique_lock<mutex> tl( this->txlock );
 
-		if( f_ret)
+	if( this->transaction && this->txowner == this_thread::get_id() )
+	{
+		this->global_error = "Mail transaction already in progress";
+		logg << Logger::Error << this->global_error << lend;
+		return false;
+	}
+
+	// Wait for other transactions and changes made outside them
+	this->txcond.wait( tl, [this]{ return ! this->transaction && this->txchanges == 0; } );
+
+	// Waits for any running synchronize
+	lock_guard<mutex> l( this->synclock );
+
+	// Start from disk state, rollback then is a matter of rereading
+	if( ! this->Flush() )
+	{
+		return false;
+	}
+
+	this->txpostfix = this->postfixupdated;
+	this->txreload = this->postfixreload;
+	this->txfetchmail = this->fetchmailupdated;
+	this->txsync = false;
+	this->txsyncforce = false;
+	this->txowner = this_thread::get_id();
+	this->transaction = true;
+
+	return true;
+}
+
+bool MailManager::Commit(bool synchronize)
+{
+	if( ! this->transaction || this->txowner != this_thread::get_id() )
+	{
+		this->global_error = "No mail transaction in progress";
+		logg << Logger::Error << this->global_error << lend;
+		return false;
+	}
+
+	bool flushed, deferred, force;
+	{
+		lock_guard<mutex> l( this->synclock );
+
+		this->transaction = false;
+		deferred = this->txsync;
+		force = this->txsyncforce;
+
+		flushed = this->Flush();
+		if( ! flushed )
 		{
-			this->fetchmailupdated = false;
+			// Drop whatever did not make it to disk
+			this->maps.Discard();
+			this->remoteaccounts.Discard();
 		}
-		else
+	}
+
+	if( flushed && synchronize )
+	{
+		this->transactionEnded( false, false );
+		return this->Synchronize( force );
+	}
+
+	this->transactionEnded( deferred, force );
+
+	return flushed;
+}
+
+void MailManager::Rollback()
+{
+	if( ! this->transaction || this->txowner != this_thread::get_id() )
+	{
+		return;
+	}
+
+	logg << Logger::Notice << "Rolling back mail transaction" << lend;
+
+	bool deferred, force;
+	{
+		lock_guard<mutex> l( this->synclock );
+
+		this->maps.Discard();
+		this->remoteaccounts.Discard();
+		this->postfixupdated = this->txpostfix;
+		this->postfixreload = this->txreload;
+		this->fetchmailupdated = this->txfetchmail;
+		this->transaction = false;
+		deferred = this->txsync;
+		force = this->txsyncforce;
+	}
+
+	this->transactionEnded( deferred, force );
+}
+
+void MailManager::transactionEnded(bool sync, bool force)
+{
+	{
+		lock_guard<mutex> l( this->txlock );
+		this->txowner = thread::id();
+	}
+	this->txcond.notify_all();
+
+	{
+		// Taken so a worker checking transaction does not miss the wakeup
+		lock_guard<mutex> l( this->asynclock );
+		if( this->syncstop )
 		{
-			this->global_error = "Falied to restart fetchmail";
-			logg << Logger::Error << this->global_error << lend;
+			return;
+		}
+	}
+	this->synccond.notify_all();
+
+	if( sync )
+	{
+		// Synchronize requested during transaction
+		this->SynchronizeAsync( force );
+	}
+}
+
+MailManager::ChangeScope::ChangeScope(MailManager &mgr): mgr(mgr), counted(false)
+{
+	unique_lock<mutex> l( mgr.txlock );
+
+	if( mgr.transaction && mgr.txowner == this_thread::get_id() )
+	{
+		// Part of our own transaction
+		return;
+	}
+
+	mgr.txcond.wait( l, [&mgr]{ return ! mgr.transaction; } );
+	mgr.txchanges++;
+	this->counted = true;
+}
+
+MailManager::ChangeScope::~ChangeScope()
+{
+	if( this->counted )
+	{
+		{
+			lock_guard<mutex> l( this->mgr.txlock );
+			this->mgr.txchanges--;
 		}
+		this->mgr.txcond.notify_all();
+	}
+}
+
+void MailManager::flushChange()
+{
+	if( ! this->Flush() )
+	{
+		throw std::runtime_error( this->global_error );
 	}
+}
 
+void MailManager::writeFetchmail()
+{
+	this->fetchmailupdated = true;
 
-	return p_ret && f_ret;
+	if( ! this->transaction )
+	{
+		this->remoteaccounts.Write();
+	}
 }
 
+bool MailManager::StartRemoteFetcher()
+{
+	if( ! MailManager::builtinFetcher() )
+	{
+		return true;
+	}
+
+	// Accounts and schedules are read from storage
+	if( ! this->storageReady() )
+	{
+		return false;
+	}
+
+	// Make sure we do not fetch twice
+	if( ServiceHelper::IsRunning( "fetchmail" ) && ! ServiceHelper::Stop( "fetchmail" ) )
+	{
+		this->global_error = "Failed to stop fetchmail";
+		logg << Logger::Error << this->global_error << lend;
+		return false;
+	}
+
+	return this->updateFetcher();
+}
+
+bool MailManager::builtinFetcher()
+{
+	return SCFG.HasKey("mail", "fetcher") && SCFG.GetKeyAsString("mail", "fetcher") == "builtin";
+}
+
+bool MailManager::updateFetcher()
+{
+	list<RemoteFetcher::Account> accounts;
+	try
+	{
+		for( const auto& account: this->remoteaccounts.GetAccounts() )
+		{
+			try
+			{
+				accounts.push_back( RemoteFetcher::FromConfig( account ) );
+			}
+			catch( std::runtime_error& err )
+			{
+				// One broken account should not stop the others
+				logg << Logger::Error << "Skipping remote account: " << err.what() << lend;
+			}
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		this->global_error = string("Failed to read remote accounts (") + err.what() + ")";
+		logg << Logger::Error << this->global_error << lend;
+		return false;
+	}
+
+	if( ! this->fetcher )
+	{
+		this->fetcher = std::make_unique<RemoteFetcher>( nullptr, FETCHSCHEDULE );
+		if( SCFG.HasKey("mail", "fetchconcurrency") )
+		{
+			this->fetcher->MaxConcurrent = SCFG.GetKeyAsInt("mail", "fetchconcurrency");
+		}
+	}
+	this->fetcher->SetAccounts( accounts );
+
+	return true;
+}
+
+bool MailManager::reloadFetchmail(bool restart)
+{
+	if( MailManager::builtinFetcher() )
+	{
+		// Only changed accounts are restarted
+		return this->updateFetcher();
+	}
+
+	if( ! restart && ServiceHelper::IsRunning( "fetchmail" ) )
+	{
+		/*
+		 * Fetchmail in daemon mode rereads a changed rc file at start of
+		 * next poll cycle, SIGUSR1 makes that happen now. A poll in
+		 * progress is allowed to finish.
+		 */
+		int pid = ServiceHelper::GetPid( "fetchmail" );
+		if( pid > 0 && kill( pid, SIGUSR1 ) == 0 )
+		{
+			logg << Logger::Debug << "Signalled fetchmail to pick up new configuration" << lend;
+			return true;
+		}
+
+		logg << Logger::Notice << "Unable to signal fetchmail, restarting" << lend;
+	}
+
+	bool ret = this->service( "fetchmail", "stop" );
+	ret &= this->service( "fetchmail", "start" );
+
+	return ret;
+}
+
+/*
+ * Domains postfix delivers locally, mydestination with the variables
+ * it normally uses expanded and lookup tables skipped, plus localdomain
+ * used for local addresses.
+ */
+set<string> MailManager::localDomains()
+{
+	set<string> domains = { "localdomain" };
+
+	try
+	{
+		PostfixConfig maincf( POSTFIXMAIN );
+
+		string hostname = maincf.Get( "myhostname" );
+		if( hostname.empty() && File::FileExists( "/etc/mailname" ) )
+		{
+			hostname = File::GetContentAsString( "/etc/mailname", true );
+			hostname.erase( hostname.find_last_not_of( " \t\r\n" ) + 1 );
+		}
+
+		string domain = maincf.Get( "mydomain" );
+		if( domain.empty() && hostname.find( '.' ) != string::npos )
+		{
+			domain = hostname.substr( hostname.find( '.' ) + 1 );
+		}
+
+		const map<string,string> vars = { { "myhostname", hostname }, { "mydomain", domain } };
+		const string destinations = maincf.Get( "mydestination", "$myhostname, localhost.$mydomain, localhost" );
+
+		size_t pos = 0;
+		while( pos < destinations.size() )
+		{
+			size_t end = destinations.find_first_of( ", \t", pos );
+			string dest = destinations.substr( pos, end == string::npos ? string::npos : end - pos );
+			pos = end == string::npos ? destinations.size() : end + 1;
+
+			// Expand $name and ${name}, unknown variables drop the entry
+			bool known = true;
+			size_t var;
+			while( known && ( var = dest.find( '$' ) ) != string::npos )
+			{
+				const bool braced = var + 1 < dest.size() && dest[var + 1] == '{';
+				const size_t start = var + ( braced ? 2 : 1 );
+				const size_t stop = braced ? dest.find( '}', start ) : dest.find_first_not_of( "abcdefghijklmnopqrstuvwxyz0123456789_", start );
+				const string name = dest.substr( start, stop == string::npos ? string::npos : stop - start );
+				const auto& val = vars.find( name );
+
+				known = val != vars.end() && ! val->second.empty();
+				if( known )
+				{
+					dest.replace( var, stop == string::npos ? string::npos : stop + ( braced ? 1 : 0 ) - var, val->second );
+				}
+			}
+
+			if( known && ! dest.empty() && dest.find_first_of( ":/" ) == string::npos )
+			{
+				transform( dest.begin(), dest.end(), dest.begin(), ::tolower );
+				domains.insert( dest );
+			}
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		logg << Logger::Notice << "Unable to read local mail domains: " << err.what() << lend;
+	}
+
+	return domains;
+}
+
+bool MailManager::service(const string &name, const string &action)
+{
+	if( this->servicecontrol )
+	{
+		return this->servicecontrol( name, action );
+	}
+
+	if( action == "reload" )
+	{
+		return ServiceHelper::Reload( name );
+	}
+
+	return action == "start" ? ServiceHelper::Start( name ) : ServiceHelper::Stop( name );
+}
+
+void MailManager::syncWorker()
+{
+	unique_lock<mutex> l( this->asynclock );
+
+	while( true )
+	{
+		this->synccond.wait( l, [this]{ return this->syncpending || this->syncstop; } );
+
+		if( ! this->syncpending )
+		{
+			break;
+		}
+
+		// Wait for requests to quiet down, but not forever
+		while( ! this->syncstop )
+		{
+			const auto deadline = min( this->lastrequest + this->syncdelay,
+									   this->firstrequest + this->syncdelay * MaxSyncDelays );
+
+			if( chrono::steady_clock::now() >= deadline )
+			{
+				break;
+			}
+			this->synccond.wait_until( l, deadline );
+		}
+
+		promise<bool> result = std::move( this->syncresult );
+		const bool force = this->syncforce;
+		this->syncpending = false;
+		this->syncforce = false;
+
+		l.unlock();
+
+		bool res = false;
+		while( true )
+		{
+			SyncResult sr = SyncFailed;
+			try
+			{
+				logg << Logger::Debug << "Running coalesced mail synchronize" << lend;
+				sr = this->synchronize( force );
+			}
+			catch( std::runtime_error& err )
+			{
+				logg << Logger::Error << "Mail synchronize failed: " << err.what() << lend;
+			}
+
+			if( sr != SyncDeferred )
+			{
+				res = sr == SyncOk;
+				break;
+			}
+
+			// Do not report success for work not done, wait for transaction to end
+			l.lock();
+			this->synccond.wait( l, [this]{ return ! this->transaction || this->syncstop; } );
+			const bool stop = this->syncstop;
+			l.unlock();
+
+			if( stop )
+			{
+				break;
+			}
+		}
+		result.set_value( res );
+
+		l.lock();
+	}
+}
 
 // From opi-b postfix_fixpaths
 void MailManager::SetupEnvironment()
 {
+	if( ! StorageManager::Instance().WaitReady() )
+	{
+		logg << Logger::Error << "Storage not available, unable to setup mail environment" << lend;
+		return;
+	}
+
 	SysConfig sysconfig;
+	const string storage = sysconfig.GetKeyAsString("filesystem","storagemount");
+	const string domains = storage + sysconfig.GetKeyAsString("mail","vdomains");
+	const string domainaliases = MailMaps::DomainAliasMap( sysconfig );
+	const pair<uid_t,gid_t> owner = MailMaps::PostfixOwner();
+
+	/*
+	 * Create missing files and hand them to postfix, owner is set on
+	 * the descriptor used to create or open the file.
+	 *
+	 * Domain wide aliases are expanded into a lookup table, make sure
+	 * it exists and that postfix consults it before the regexp map
+	 */
+	const list<pair<string,string>> files =
+	{
+		{ storage + sysconfig.GetKeyAsString("mail","vmailbox"), "aliases file" },
+		{ storage + sysconfig.GetKeyAsString("mail","saslpasswd"), "saslpasswd file" },
+		{ domains, "domain file" },
+		{ storage + sysconfig.GetKeyAsString("mail","localmail"), "local mail file" },
+		{ domainaliases, "domain alias map" },
+	};
+
+	for( const auto& file: files )
+	{
+		int fd = open( file.first.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, File::UserRW );
+		if( fd < 0 )
+		{
+			logg << Logger::Error << "Failed to create " << file.second << lend;
+			continue;
+		}
+
+		if( fchown( fd, owner.first, owner.second ) != 0 )
+		{
+			logg << Logger::Error << "Failed to change owner on " << file.second << lend;
+		}
+		close( fd );
+	}
+
+	int fd = open( File::GetPath( domains ).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+	if( fd < 0 || fchown( fd, owner.first, owner.second ) != 0 )
+	{
+		logg << Logger::Error << "Failed to change owner on config directory"<<lend;
+	}
 
-	string aliases = sysconfig.GetKeyAsString("filesystem","storagemount") + sysconfig.GetKeyAsString("mail","vmailbox");
-	if( ! File::FileExists( aliases ) )
+	if( fd < 0 || fchmod( fd, File::UserRWX ) != 0 )
 	{
-		File::Write( aliases, "", File::UserRW);
+		logg << Logger::Error << "Failed to change mode on config directory"<<lend;
 	}
 
-	string saslpwd = sysconfig.GetKeyAsString("filesystem","storagemount")  + sysconfig.GetKeyAsString("mail","saslpasswd");
-	if( ! File::FileExists( saslpwd ) )
+	if( fd >= 0 )
 	{
-		File::Write( saslpwd, "", File::UserRW);
+		close( fd );
 	}
 
-	string domains = sysconfig.GetKeyAsString("filesystem","storagemount") + sysconfig.GetKeyAsString("mail","vdomains");
-	if( ! File::FileExists( domains ) )
+	/*
+	 * Build all tables with configured type and make sure postfix
+	 * looks them up with that type, i.e. migrates hash tables to cdb
+	 */
+	const string tabletype = MailManager::tableType( sysconfig );
+	const string postmap = MailManager::postmapCommand( sysconfig );
+	const list<string> tables =
 	{
-		File::Write( domains, "", File::UserRW);
+		storage + sysconfig.GetKeyAsString("mail","vmailbox"),
+		storage + sysconfig.GetKeyAsString("mail","saslpasswd"),
+		storage + sysconfig.GetKeyAsString("mail","localmail"),
+		domainaliases,
+	};
+
+	bool built = true;
+	for( const string& table: tables )
+	{
+		if( PostfixTable( table, tabletype, postmap ).Update() == PostfixTable::Failed )
+		{
+			logg << Logger::Error << "Failed to process " << table << lend;
+			built = false;
+		}
 	}
 
-	string localmail = sysconfig.GetKeyAsString("filesystem","storagemount") + sysconfig.GetKeyAsString("mail","localmail");
-	if( ! File::FileExists( localmail ) )
+	// main.cf is only read by postfix at (re)start
+	bool reload = false;
+
+	try
+	{
+		if( built && MailManager::migrateTables( tabletype, tables ) )
+		{
+			logg << Logger::Notice << "Postfix lookup tables migrated to " << tabletype << lend;
+			reload = true;
+		}
+	}
+	catch( std::runtime_error& err )
 	{
-		File::Write( localmail, "", File::UserRW);
+		logg << Logger::Error << "Failed to migrate postfix lookup tables: " << err.what() << lend;
 	}
 
-	if( chown( aliases.c_str(), User::UserToUID("postfix"), Group::GroupToGID("postfix") ) != 0)
+	try
 	{
-		logg << Logger::Error << "Failed to change owner on aliases file"<<lend;
+		PostfixConfig maincf( POSTFIXMAIN );
+		const string aliasmaps = maincf.Get( "virtual_alias_maps" );
+		const string domainmap = tabletype + ":" + domainaliases;
+		if( built && aliasmaps.find( domainmap ) == string::npos )
+		{
+			maincf.Set( "virtual_alias_maps", domainmap + ( aliasmaps.empty() ? "" : ", " + aliasmaps ) );
+			if( maincf.Write() )
+			{
+				logg << Logger::Notice << "Added domain alias map to postfix configuration" << lend;
+				reload = true;
+			}
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		logg << Logger::Error << "Failed to add domain alias map to postfix configuration: " << err.what() << lend;
 	}
 
-	if( chown( saslpwd.c_str(), User::UserToUID("postfix"), Group::GroupToGID("postfix") ) != 0)
+	if( reload && ServiceHelper::IsRunning( "postfix" ) && ! ServiceHelper::Reload( "postfix" ) )
 	{
-		logg << Logger::Error << "Failed to change owner on saslpasswd file"<<lend;
+		logg << Logger::Error << "Failed to reload postfix" << lend;
 	}
+}
+
+string MailManager::tableType(SysConfig &cfg)
+{
+	return cfg.HasKey("mail","tabletype") ? cfg.GetKeyAsString("mail","tabletype") : POSTFIXTABLETYPE;
+}
 
-	if( chown( domains.c_str(), User::UserToUID("postfix"), Group::GroupToGID("postfix") ) != 0)
+string MailManager::postmapCommand(SysConfig &cfg)
+{
+	return cfg.HasKey("mail","postmap") ? cfg.GetKeyAsString("mail","postmap") : POSTMAP;
+}
+
+bool MailManager::migrateTables(const string &type, const list<string> &sources)
+{
+	static const set<string> types = { "hash", "btree", "lmdb", "cdb", "dbm", "sdbm" };
+	const char* sep = ", \t";
+
+	// Compare paths with repeated slashes collapsed
+	auto normalize = [](string path)
 	{
-		logg << Logger::Error << "Failed to change owner on domain file"<<lend;
+		path.erase( unique( path.begin(), path.end(), [](char a, char b){ return a == '/' && b == '/'; } ), path.end() );
+		return path;
+	};
+
+	set<string> paths;
+	for( const string& source: sources )
+	{
+		paths.insert( normalize( source ) );
 	}
 
-	if( chown( File::GetPath(domains).c_str(), User::UserToUID("postfix"), Group::GroupToGID("postfix") ) != 0)
+	PostfixConfig maincf( POSTFIXMAIN );
+	bool changed = false;
+
+	for( const auto& param: maincf.Parameters() )
 	{
-		logg << Logger::Error << "Failed to change owner on config directory"<<lend;
+		string value = param.second;
+		bool update = false;
+
+		size_t pos = value.find_first_not_of( sep );
+		while( pos != string::npos )
+		{
+			const size_t end = value.find_first_of( sep, pos );
+			const string lookup = value.substr( pos, end == string::npos ? string::npos : end - pos );
+			const size_t colon = lookup.find( ':' );
+
+			if( colon != string::npos && lookup.compare( 0, colon, type ) != 0 &&
+					types.find( lookup.substr( 0, colon ) ) != types.end() &&
+					paths.find( normalize( lookup.substr( colon + 1 ) ) ) != paths.end() )
+			{
+				value.replace( pos, colon, type );
+				update = true;
+			}
+
+			pos = value.find_first_not_of( sep, value.find_first_of( sep, pos ) );
+		}
+
+		if( update )
+		{
+			maincf.Set( param.first, value );
+			changed = true;
+		}
 	}
 
-	if( chmod( File::GetPath(domains).c_str(), File::UserRWX ) != 0)
+	return changed && maincf.Write();
+}
+
+bool MailManager::storageReady()
+{
+	if( ! StorageManager::Instance().WaitReady() )
 	{
-		logg << Logger::Error << "Failed to change mode on config directory"<<lend;
+		this->global_error = "Mail storage not available";
+		logg << Logger::Error << this->global_error << lend;
+		return false;
 	}
+	return true;
+}
 
+void MailManager::waitStorage()
+{
+	if( ! this->storageReady() )
+	{
+		throw std::runtime_error( this->global_error );
+	}
 }
 
 MailManager::~MailManager()
 {
+	{
+		lock_guard<mutex> l( this->asynclock );
+		this->syncstop = true;
+		this->synccond.notify_one();
+	}
+
+	if( this->syncworker.joinable() )
+	{
+		// Any pending synchronize is carried out before worker exits
+		this->syncworker.join();
+	}
+
+	this->Rollback();
+	this->Flush();
+
+	if( this->fetcher )
+	{
+		this->fetcher->Stop();
+	}
 	logg << Logger::Notice << "Mailmanager destroyed" << lend;
 }
 
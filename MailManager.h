@@ -2,10 +2,23 @@
 #define MAILMANAGER_H
 
 #include "BaseManager.h"
-
+#include "MailMaps.h"
+#include "MailQueue.h"
+#include "RemoteAccounts.h"
+#include "RemoteFetcher.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <string>
 #include <list>
 #include <map>
+#include <memory>
+#include <set>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 
@@ -117,6 +130,13 @@ public:
 	 */
 	void DeleteAddresses(const string& user);
 
+	/**
+	 * @brief GetUserAddresses get all addresses delivered to user
+	 * @param user
+	 * @return list with tuples domain,localpart
+	 */
+	list<tuple<string,string>> GetUserAddresses(const string& user);
+
 	/**
 	 * @brief GetAddresses get addresses for specific domain
 	 * @param domain domain to retrieve adresses for
@@ -130,10 +150,15 @@ public:
 	 * Moves all users in one domain to a new, to, one deleting the
 	 * old, from, domain.
 	 *
+	 * The mail maps are rewritten on disk line by line, in bounded
+	 * memory, before returning, and can thus not be rolled back. It is
+	 * refused, with a runtime_error, within a transaction.
+	 *
 	 * @param from currently existing domain on system
 	 * @param to none existant, new, domain in system
+	 * @param progress optional callback, bytes processed and total
 	 */
-	void ChangeDomain(const string& from, const string& to);
+	void ChangeDomain(const string& from, const string& to, MailMaps::Progress progress = nullptr);
 
 	/**
 	 * @brief GetAddress gets user for specific domain and local part
@@ -160,6 +185,10 @@ public:
 
 	/**
 	 * @brief GetRemoteAccount get info on remote account
+	 *
+	 * When the built in fetcher is used, the fetcher status is included
+	 * as well (state, push, fetched, lastmail, interval, nextpoll and polls).
+	 *
 	 * @param hostname provider hostnama
 	 * @param identity remote identity
 	 * @return map with account data key, value
@@ -195,6 +224,18 @@ public:
 	 */
 	void DeleteRemoteAccount(const string& hostname, const string& identity);
 
+	/**
+	 * @brief StartRemoteFetcher start built in remote mail fetcher
+	 *
+	 * With mail/fetcher set to builtin in sysconfig remote accounts
+	 * are handled by RemoteFetcher instead of fetchmail. Does nothing
+	 * if fetchmail is used. Waits for storage, where accounts and poll
+	 * schedules are kept.
+	 *
+	 * @return true upon success
+	 */
+	bool StartRemoteFetcher();
+
 	// Aliases management - MailAliasFile
 	/**
 	 * @brief GetAliases get all aliases
@@ -232,17 +273,134 @@ public:
 	 */
 	bool RemoveUserAliases(const string& user);
 
+	/**
+	 * @brief GetUserAliases get all aliases user is a member of
+	 * @param user
+	 * @return list of aliases
+	 */
+	list<string> GetUserAliases(const string& user);
+
 
 	// Misc functions
 
 	/**
 	 * @brief Synchronize synchronize settings with mailserver
-	 * (Restarts/reloads mailsystem)
+	 * (Rebuilds lookup tables, has fetchmail reread its configuration.
+	 * Postfix is only reloaded if domains or its configuration changed)
+	 * Within a transaction nothing is synchronized, false is returned
+	 * and the synchronize is carried out upon Commit or Rollback.
+	 *
 	 * @param force force synchronization
 	 * @return true upon success
 	 */
 	bool Synchronize(bool force = false);
 
+	/**
+	 * @brief SynchronizeAsync request a synchronize in the background
+	 *
+	 * Requests are coalesced, the synchronize runs once no new request
+	 * has arrived within the sync delay. All requests coalesced into
+	 * one run share the same future. A synchronize falling within a
+	 * transaction waits for the transaction to end.
+	 *
+	 * @param force force synchronization
+	 * @return future with result of synchronize
+	 */
+	shared_future<bool> SynchronizeAsync(bool force = false);
+
+	/**
+	 * @brief The SyncStats struct, outcome of synchronizations
+	 */
+	struct SyncStats
+	{
+		uint64_t reloads;			/**< Postfix reloads performed */
+		uint64_t reloadsskipped;	/**< Synchronizations where only tables were rebuilt */
+	};
+
+	/**
+	 * @brief GetSyncStats get postfix reload statistics
+	 * @return
+	 */
+	SyncStats GetSyncStats();
+
+	/**
+	 * @brief ServiceControl function performing action, start, stop or
+	 *        reload, on system service
+	 */
+	typedef function<bool(const string& service, const string& action)> ServiceControl;
+
+	/**
+	 * @brief SetServiceControl replace service handling, i.e. when
+	 *        running without a live mailsystem. Not thread safe,
+	 *        set before use.
+	 * @param control, nullptr restores default, ServiceHelper
+	 */
+	void SetServiceControl(ServiceControl control);
+
+	/**
+	 * @brief GetQueueStats get postfix mail queue statistics
+	 *
+	 * Message counts per queue, age of oldest message and deferred
+	 * recipients per domain. Statistics are cached and refreshed when
+	 * older than mail/queueinterval seconds in sysconfig (default 60).
+	 * A scan opens at most mail/queuescanlimit queue files (default
+	 * 1000), remaining messages are examined by following scans.
+	 *
+	 * @param refresh rescan regardless of refresh interval
+	 * @return queue statistics
+	 */
+	MailQueue::Stats GetQueueStats(bool refresh = false);
+
+	/**
+	 * @brief SetSyncDelay set debounce window for SynchronizeAsync
+	 *        (default mail/syncdelay in ms from sysconfig or 1s)
+	 * @param delay
+	 */
+	void SetSyncDelay(chrono::milliseconds delay);
+
+	/**
+	 * @brief Flush write pending mail map changes to disk
+	 *
+	 * Outside a transaction each change is flushed when made, within
+	 * one changes are kept in memory until Commit. Flush appends the
+	 * changes to the mail map journal, the map files themselves are
+	 * rewritten by Synchronize.
+	 *
+	 * @return true upon success
+	 */
+	bool Flush();
+
+	/**
+	 * @brief Begin start a transaction
+	 *
+	 * Domain, address, alias, local mail and remote account changes
+	 * made after Begin are kept in memory. Commit writes each changed
+	 * file once and synchronizes the mailsystem once. Rollback, or a
+	 * failed Commit, drops all changes made since Begin.
+	 *
+	 * A transaction belongs to the thread calling Begin. Begin, and
+	 * changes made from other threads, wait for it to end, so Rollback
+	 * never drops changes someone else made. Transactions do not nest.
+	 *
+	 * @return true upon success
+	 */
+	bool Begin();
+
+	/**
+	 * @brief Commit write changes made since Begin and synchronize,
+	 *        from the thread that called Begin
+	 * @param synchronize synchronize mailsystem, if false caller is
+	 *        responsible for a later Synchronize or SynchronizeAsync
+	 * @return true upon success
+	 */
+	bool Commit(bool synchronize = true);
+
+	/**
+	 * @brief Rollback drop changes made since Begin, from the thread
+	 *        that called Begin
+	 */
+	void Rollback();
+
 	/**
 	 * @brief SetupEnvironment
 	 *
@@ -254,8 +412,137 @@ public:
 
 	virtual ~MailManager();
 private:
-	bool fetchmailupdated;
-	bool postfixupdated;
+	/**
+	 * @brief storageReady wait for any pending storage bring up,
+	 *        mail configuration resides on storage.
+	 * @return true if storage available
+	 */
+	bool storageReady();
+
+	/**
+	 * @brief waitStorage as storageReady but throws if not available
+	 */
+	void waitStorage();
+
+	/**
+	 * @brief flushChange flush a domain or address change, throws
+	 *        runtime_error if it could not be written
+	 */
+	void flushChange();
+
+	/**
+	 * @brief writeFetchmail write remote account changes, deferred
+	 *        to commit within a transaction
+	 */
+	void writeFetchmail();
+
+	/**
+	 * @brief reloadFetchmail make fetchmail use updated configuration
+	 * @param restart do a full restart instead of a graceful reload
+	 * @return true upon success
+	 */
+	bool reloadFetchmail(bool restart);
+
+	static bool builtinFetcher();
+	bool updateFetcher();
+
+	bool service(const string& name, const string& action);
+
+	static set<string> localDomains();
+
+	/*
+	 * Postfix lookup table type and postmap command, from sysconfig.
+	 * Tables are cdb, compiled in process, unless configured otherwise
+	 */
+	static string tableType(OPI::SysConfig& cfg);
+	static string postmapCommand(OPI::SysConfig& cfg);
+
+	/**
+	 * @brief migrateTables make main.cf look up tables built from sources
+	 *        using type, i.e. hash:/path becomes cdb:/path
+	 * @param type table type
+	 * @param sources text map files
+	 * @return true if main.cf changed
+	 */
+	static bool migrateTables(const string& type, const list<string>& sources);
+
+	enum SyncResult
+	{
+		SyncOk,
+		SyncFailed,
+		SyncDeferred,	// Transaction in progress
+	};
+
+	SyncResult synchronize(bool force);
+	void syncWorker();
+
+	/*
+	 * Wake a background synchronize waiting on the transaction and
+	 * carry out any synchronize requested during it
+	 */
+	void transactionEnded(bool sync, bool force);
+
+	/*
+	 * Held by mail changes made outside a transaction, waits for a
+	 * transaction owned by another thread to end and keeps a new
+	 * one from starting meanwhile
+	 */
+	class ChangeScope
+	{
+	public:
+		ChangeScope(MailManager& mgr);
+		~ChangeScope();
+	private:
+		MailManager& mgr;
+		bool counted;
+	};
+
+	MailMaps maps;
+	atomic<bool> fetchmailupdated;
+	atomic<bool> postfixupdated;
+	atomic<bool> postfixreload;	// Domains or main.cf changed, postfix needs reload
+	atomic<uint64_t> reloads;
+	atomic<uint64_t> reloadsskipped;
+
+	/*
+	 * Changed with synclock held, a synchronize, and thus compaction,
+	 * never overlaps a transaction
+	 */
+	atomic<bool> transaction;
+	bool txfetchmail;	// Update flags at Begin, restored upon rollback
+	bool txpostfix;
+	bool txreload;
+	bool txsync;		// Synchronize requested during transaction
+	bool txsyncforce;
+	mutex txlock;
+	condition_variable txcond;	// Signaled when transaction or txchanges drops
+	thread::id txowner;
+	int txchanges;			// Changes in progress outside transaction
+
+	RemoteAccounts remoteaccounts;
+
+	unique_ptr<RemoteFetcher> fetcher;
+
+	unique_ptr<MailQueue> queue;
+
+	ServiceControl servicecontrol;
+
+	// Background synchronize
+	static constexpr chrono::milliseconds DefaultSyncDelay{1000};
+	static constexpr int MaxSyncDelays = 10;	// Max wait, in delays, from first request
+
+	mutex synclock;		// Serializes Synchronize
+	mutex asynclock;
+	condition_variable synccond;
+	chrono::milliseconds syncdelay;
+	bool syncpending;
+	bool syncforce;
+	bool syncstop;
+	chrono::steady_clock::time_point firstrequest;
+	chrono::steady_clock::time_point lastrequest;
+	promise<bool> syncresult;
+	shared_future<bool> syncfuture;
+	thread syncworker;
 };
 } // Namespace KGP
 
@@ -0,0 +1,1370 @@
+#include "MailMaps.h"
+#include "PostfixConfig.h"
+#include "PostfixTable.h"
+
+#include <libutils/Logger.h>
+
+#include <libutils/Exceptions.h>
+#include <libutils/FileUtils.h>
+#include <libutils/UserGroups.h>
+
+#include <libopi/SysConfig.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+using namespace Utils;
+using namespace OPI;
+
+namespace KGP
+{
+
+// Compact when journal grows beyond this
+static constexpr off_t CompactSize = 1024 * 1024;
+
+// Lines between progress reports when renaming a domain
+static constexpr size_t ProgressInterval = 10000;
+
+bool MailMaps::FileState::Changed()
+{
+	struct stat st{};
+
+	if( stat( this->path.c_str(), &st ) != 0 )
+	{
+		// Missing now, changed if we had it before
+		return this->inode != 0;
+	}
+
+	return st.st_ino != this->inode ||
+			st.st_size != this->size ||
+			st.st_mtim.tv_sec != this->mtime.tv_sec ||
+			st.st_mtim.tv_nsec != this->mtime.tv_nsec;
+}
+
+void MailMaps::FileState::Update()
+{
+	struct stat st{};
+
+	if( stat( this->path.c_str(), &st ) != 0 )
+	{
+		this->inode = 0;
+		this->size = 0;
+		this->mtime = {0, 0};
+		return;
+	}
+
+	this->inode = st.st_ino;
+	this->size = st.st_size;
+	this->mtime = st.st_mtim;
+}
+
+/*
+ * Make sure a rewritten map is on disk before the journal
+ * holding the same changes is dropped. Local mail and aliases
+ * are read by postfix directly, these are kept owned by postfix.
+ */
+static void syncFile(const string& path, bool postfix = false)
+{
+	int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+	if( fd < 0 )
+	{
+		throw ErrnoException("Failed to open "+path);
+	}
+
+	const pair<uid_t,gid_t> owner = postfix ? MailMaps::PostfixOwner() : pair<uid_t,gid_t>( -1, -1 );
+	if( postfix && fchown( fd, owner.first, owner.second ) != 0 )
+	{
+		close( fd );
+		throw ErrnoException("Failed to chown "+path);
+	}
+
+	int res = fsync( fd );
+	close( fd );
+
+	if( res != 0 )
+	{
+		throw ErrnoException("Failed to sync "+path);
+	}
+}
+
+/*
+ * Rewrite a map file one line at a time into a new file, keeping
+ * owner and mode, and move it into place. rewrite returns false to
+ * drop the line.
+ */
+static void rewriteFile(const string& path, const function<bool(string& line)>& rewrite,
+						size_t& done, size_t total, const MailMaps::Progress& progress)
+{
+	struct stat st{};
+	ifstream in( path );
+	if( ! in || stat( path.c_str(), &st ) != 0 )
+	{
+		throw std::runtime_error("Failed to open " + path );
+	}
+
+	const string tmp = path + ".new";
+	FILE* out = fopen( tmp.c_str(), "we" );
+	if( ! out )
+	{
+		throw ErrnoException("Failed to create " + tmp );
+	}
+
+	auto fail = [&out, &tmp](const string& msg)
+	{
+		fclose( out );
+		unlink( tmp.c_str() );
+		throw ErrnoException( msg );
+	};
+
+	if( fchown( fileno( out ), st.st_uid, st.st_gid ) != 0 || fchmod( fileno( out ), st.st_mode & 07777 ) != 0 )
+	{
+		fail( "Failed to set owner and mode on " + tmp );
+	}
+
+	string line;
+	size_t lines = 0;
+	while( getline( in, line ) )
+	{
+		done += line.size() + 1;
+
+		if( rewrite( line ) && ( fputs( line.c_str(), out ) == EOF || fputc( '\n', out ) == EOF ) )
+		{
+			fail( "Failed to write " + tmp );
+		}
+
+		if( progress && ++lines % ProgressInterval == 0 )
+		{
+			progress( done, total );
+		}
+	}
+
+	if( in.bad() )
+	{
+		fail( "Failed to read " + path );
+	}
+
+	if( fflush( out ) != 0 || fsync( fileno( out ) ) != 0 )
+	{
+		fail( "Failed to sync " + tmp );
+	}
+	fclose( out );
+
+	if( rename( tmp.c_str(), path.c_str() ) != 0 )
+	{
+		unlink( tmp.c_str() );
+		throw ErrnoException("Failed to replace " + path );
+	}
+}
+
+MailMaps::MailMaps(): dirty(false), domainschanged(false), localdirty(false), aliasdirty(false),
+	domainaliasdirty(false), expanddirty(false), domainaliasactive(false)
+{
+	SysConfig cfg;
+	const string storage = cfg.GetKeyAsString("filesystem", "storagemount");
+
+	this->vmailbox = { storage + cfg.GetKeyAsString("mail", "vmailbox"), {0, 0}, 0, 0 };
+	this->vdomains = { storage + cfg.GetKeyAsString("mail", "vdomains"), {0, 0}, 0, 0 };
+	this->localstate = { storage + cfg.GetKeyAsString("mail", "localmail"), {0, 0}, 0, 0 };
+	this->aliasstate = { storage + cfg.GetKeyAsString("mail", "virtualalias"), {0, 0}, 0, 0 };
+
+	// Kept next to the virtual alias map unless configured
+	const string aliasdir = File::GetPath( this->aliasstate.path );
+	this->domainaliasstate = { cfg.HasKey("mail", "domainalias") ?
+								storage + cfg.GetKeyAsString("mail", "domainalias") : aliasdir + "/domainalias",
+								{0, 0}, 0, 0 };
+	this->domainaliasmap = MailMaps::DomainAliasMap( cfg );
+
+	this->journalstate = { cfg.HasKey("mail", "journal") ?
+								storage + cfg.GetKeyAsString("mail", "journal") :
+								File::GetPath( this->vmailbox.path ) + "/mailmaps.journal",
+								{0, 0}, 0, 0 };
+
+	this->index = std::make_unique<MailIndex>( cfg.HasKey("mail", "index") ?
+								storage + cfg.GetKeyAsString("mail", "index") :
+								File::GetPath( this->vmailbox.path ) + "/mailmaps.index",
+								list<string>{ this->vmailbox.path, this->vdomains.path, this->journalstate.path } );
+}
+
+list<string> MailMaps::GetDomains()
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	list<string> ret;
+	for( const auto& domain: this->addresses )
+	{
+		ret.emplace_back( domain.first );
+	}
+	ret.sort();
+
+	return ret;
+}
+
+bool MailMaps::hasDomain(const string &domain)
+{
+	lock_guard<mutex> l( this->lock );
+
+	if( this->indexed() )
+	{
+		return this->index->hasDomain( domain );
+	}
+
+	this->revalidate();
+
+	return this->addresses.find( domain ) != this->addresses.end();
+}
+
+void MailMaps::AddDomain(const string &domain)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->change( { "AddDomain", domain } );
+}
+
+void MailMaps::DeleteDomain(const string &domain)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->change( { "DeleteDomain", domain } );
+}
+
+list<tuple<string, string> > MailMaps::GetAddresses(const string &domain)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	list<tuple<string,string>> ret;
+
+	const auto& dom = this->addresses.find( domain );
+	if( dom != this->addresses.end() )
+	{
+		for( const auto& addr: dom->second )
+		{
+			ret.emplace_back( addr.first, addr.second );
+		}
+	}
+	ret.sort();
+
+	return ret;
+}
+
+tuple<string, string> MailMaps::GetAddress(const string &domain, const string &address)
+{
+	lock_guard<mutex> l( this->lock );
+
+	if( this->indexed() )
+	{
+		const char* user = nullptr;
+		size_t len = 0;
+
+		if( ! this->index->GetAddress( domain, address, user, len ) )
+		{
+			throw std::runtime_error( this->index->hasDomain( domain ) ? "Address not found" : "Domain not found" );
+		}
+
+		return make_tuple( address, string( user, len ) );
+	}
+
+	this->revalidate();
+
+	const auto& dom = this->addresses.find( domain );
+	if( dom == this->addresses.end() )
+	{
+		throw std::runtime_error("Domain not found");
+	}
+
+	const auto& addr = dom->second.find( address );
+	if( addr == dom->second.end() )
+	{
+		throw std::runtime_error("Address not found");
+	}
+
+	return make_tuple( addr->first, addr->second );
+}
+
+bool MailMaps::hasAddress(const string &domain, const string &address)
+{
+	lock_guard<mutex> l( this->lock );
+
+	if( this->indexed() )
+	{
+		return this->index->hasAddress( domain, address );
+	}
+
+	this->revalidate();
+
+	const auto& dom = this->addresses.find( domain );
+
+	return dom != this->addresses.end() && dom->second.find( address ) != dom->second.end();
+}
+
+void MailMaps::SetAddress(const string &domain, const string &address, const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->change( { "SetAddress", domain, address, user } );
+}
+
+void MailMaps::DeleteAddress(const string &domain, const string &address)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->change( { "DeleteAddress", domain, address } );
+}
+
+void MailMaps::ChangeDomain(const string &from, const string &to, Progress progress)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	if( from == to || this->addresses.find( from ) == this->addresses.end() )
+	{
+		return;
+	}
+
+	// Files are the source of the rewrite, bring them up to date
+	this->compact();
+
+	this->streamRename( from, to, progress );
+
+	// Files already hold the result
+	this->changeDomain( from, to );
+	this->dirty = false;
+	this->vmailbox.Update();
+	this->vdomains.Update();
+
+	this->updateIndex();
+}
+
+list<tuple<string, string> > MailMaps::GetUserAddresses(const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	list<tuple<string,string>> ret;
+
+	const auto& addrs = this->useraddresses.find( user );
+	if( addrs != this->useraddresses.end() )
+	{
+		for( const auto& addr: addrs->second )
+		{
+			ret.emplace_back( addr.first, addr.second );
+		}
+	}
+
+	return ret;
+}
+
+void MailMaps::DeleteUserAddresses(const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	const auto& addrs = this->useraddresses.find( user );
+	if( addrs == this->useraddresses.end() )
+	{
+		return;
+	}
+
+	// Journaled per address, replay then does not depend on map content
+	const set<pair<string,string>> remove = addrs->second;
+	for( const auto& addr: remove )
+	{
+		this->change( { "DeleteAddress", addr.first, addr.second } );
+	}
+}
+
+void MailMaps::SetLocalAddress(const string &domain, const string &address, const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->change( { "SetLocalAddress", domain, address, user } );
+}
+
+void MailMaps::DeleteLocalAddress(const string &domain, const string &address)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->change( { "DeleteLocalAddress", domain, address } );
+}
+
+list<string> MailMaps::GetAliases()
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	list<string> ret = this->aliases->GetAliases();
+	for( const string& local: this->domainaliases->GetAliases() )
+	{
+		ret.push_back( "/^" + local + "@/" );
+	}
+
+	return ret;
+}
+
+list<string> MailMaps::GetAliasUsers(const string &alias)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	string local;
+	if( this->expandedAlias( alias, local ) )
+	{
+		return this->domainaliases->GetUsers( local );
+	}
+
+	return this->aliases->GetUsers( alias );
+}
+
+void MailMaps::AddAliasUser(const string &alias, const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->change( { "AddAliasUser", alias, user } );
+}
+
+void MailMaps::RemoveAliasUser(const string &alias, const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->change( { "RemoveAliasUser", alias, user } );
+}
+
+list<string> MailMaps::GetUserAliases(const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	const auto& ua = this->useraliases.find( user );
+	if( ua == this->useraliases.end() )
+	{
+		return {};
+	}
+
+	return list<string>( ua->second.begin(), ua->second.end() );
+}
+
+void MailMaps::RemoveUserAliases(const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	const auto& ua = this->useraliases.find( user );
+	if( ua == this->useraliases.end() )
+	{
+		return;
+	}
+
+	const set<string> remove = ua->second;
+	for( const string& alias: remove )
+	{
+		this->change( { "RemoveAliasUser", alias, user } );
+	}
+}
+
+bool MailMaps::Flush()
+{
+	lock_guard<mutex> l( this->lock );
+
+	if( this->pending.empty() )
+	{
+		return false;
+	}
+
+	if( this->journalstate.size + static_cast<off_t>( this->pending.size() ) > CompactSize )
+	{
+		return this->compact();
+	}
+
+	return this->appendJournal();
+}
+
+bool MailMaps::Compact()
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	return this->compact();
+}
+
+bool MailMaps::Dirty()
+{
+	lock_guard<mutex> l( this->lock );
+
+	return ! this->pending.empty();
+}
+
+bool MailMaps::DomainsChanged()
+{
+	lock_guard<mutex> l( this->lock );
+
+	bool ret = this->domainschanged;
+	this->domainschanged = false;
+
+	return ret;
+}
+
+void MailMaps::SetLocalDomains(const set<string> &domains)
+{
+	lock_guard<mutex> l( this->lock );
+
+	if( domains != this->localdomains )
+	{
+		this->localdomains = domains;
+		this->expanddirty = true;
+	}
+}
+
+string MailMaps::DomainAliasMap()
+{
+	SysConfig cfg;
+
+	return MailMaps::DomainAliasMap( cfg );
+}
+
+string MailMaps::DomainAliasMap(SysConfig &cfg)
+{
+	const string storage = cfg.GetKeyAsString("filesystem", "storagemount");
+
+	if( cfg.HasKey("mail", "domainaliasmap") )
+	{
+		return storage + cfg.GetKeyAsString("mail", "domainaliasmap");
+	}
+
+	// Path ends up in main.cf, keep it free of repeated slashes
+	string dir = File::GetPath( storage + cfg.GetKeyAsString("mail", "virtualalias") );
+	if( dir.empty() || dir.back() != '/' )
+	{
+		dir += "/";
+	}
+	return dir + "domainaliasmap";
+}
+
+pair<uid_t, gid_t> MailMaps::PostfixOwner()
+{
+	// Name service lookups might be slow, i.e. LDAP or sssd backed
+	static const pair<uid_t,gid_t> owner( User::UserToUID("postfix"), Group::GroupToGID("postfix") );
+
+	return owner;
+}
+
+void MailMaps::Discard()
+{
+	lock_guard<mutex> l( this->lock );
+
+	this->mc.reset();
+	this->addresses.clear();
+	this->useraddresses.clear();
+	this->dirty = false;
+	this->domainschanged = false;
+
+	this->localmail.reset();
+	this->localdirty = false;
+
+	this->aliases.reset();
+	this->useraliases.clear();
+	this->aliasdirty = false;
+
+	this->domainaliases.reset();
+	this->domainaliasdirty = false;
+	this->expanddirty = false;
+
+	// Journaled changes are kept, they are replayed upon next access
+	this->pending.clear();
+}
+
+MailMaps::~MailMaps()
+{
+	try
+	{
+		this->Flush();
+	}
+	catch( std::runtime_error& err )
+	{
+		logg << Logger::Error << "Failed to write mail maps: " << err.what() << lend;
+	}
+}
+
+void MailMaps::revalidate()
+{
+	if( this->mc && ( ! this->pending.empty() || ! this->changedOnDisk() ) )
+	{
+		// Pending local changes wins over changes on disk
+		return;
+	}
+
+	this->load();
+}
+
+bool MailMaps::changedOnDisk()
+{
+	return this->vmailbox.Changed() || this->vdomains.Changed() ||
+			this->localstate.Changed() || this->aliasstate.Changed() ||
+			this->domainaliasstate.Changed() || this->journalstate.Changed();
+}
+
+bool MailMaps::indexed()
+{
+	if( this->mc && ( ! this->pending.empty() || ! this->changedOnDisk() ) )
+	{
+		// Loaded copy is up to date
+		return false;
+	}
+
+	return this->index->Current();
+}
+
+void MailMaps::updateIndex()
+{
+	if( ! this->pending.empty() || this->index->Current() )
+	{
+		return;
+	}
+
+	try
+	{
+		this->index->Write( this->addresses );
+	}
+	catch( std::runtime_error& err )
+	{
+		// Lookups then fall back on the maps
+		logg << Logger::Notice << "Failed to write mail index: " << err.what() << lend;
+	}
+}
+
+void MailMaps::load()
+{
+	logg << Logger::Debug << "Loading mail maps" << lend;
+
+	// Stat before read, a change during read is then caught next time
+	this->vmailbox.Update();
+	this->vdomains.Update();
+	this->localstate.Update();
+
+	this->mc = std::make_unique<MailConfig>();
+	this->addresses.clear();
+	this->useraddresses.clear();
+	this->dirty = false;
+
+	for( const auto& domain: this->mc->GetDomains() )
+	{
+		auto& dom = this->addresses[domain];
+		for( const auto& addr: this->mc->GetAddresses( domain ) )
+		{
+			dom[std::get<0>(addr)] = std::get<1>(addr);
+			this->indexAddress( domain, std::get<0>(addr), std::get<1>(addr) );
+		}
+	}
+
+	this->localmail = std::make_unique<MailMapFile>( this->localstate.path );
+	this->localmail->ReadConfig();
+	this->localdirty = false;
+
+	this->loadAliases();
+
+	// Domains might have changed under us
+	this->expanddirty = true;
+
+	this->replay();
+
+	this->updateIndex();
+}
+
+void MailMaps::loadAliases()
+{
+	this->aliasstate.Update();
+	this->aliases = std::make_unique<MailAliasFile>( this->aliasstate.path );
+	this->useraliases.clear();
+	this->aliasdirty = false;
+
+	if( ! File::FileExists( this->domainaliasstate.path ) )
+	{
+		File::Write( this->domainaliasstate.path, "", File::UserRW );
+	}
+	this->domainaliasstate.Update();
+	this->domainaliases = std::make_unique<MailAliasFile>( this->domainaliasstate.path );
+	this->domainaliasdirty = false;
+	this->domainaliasactive = this->domainAliasMapActive();
+
+	for( const string& alias: this->aliases->GetAliases() )
+	{
+		string local;
+		const list<string> users = this->aliases->GetUsers( alias );
+		for( const string& user: users )
+		{
+			this->useraliases[user].insert( alias );
+		}
+
+		if( this->expandedAlias( alias, local ) )
+		{
+			logg << Logger::Notice << "Moving domain alias " << alias << " to domain alias file" << lend;
+			for( const string& user: users )
+			{
+				this->domainaliases->AddUser( local, user );
+				this->aliases->RemoveUser( alias, user );
+			}
+			this->aliasdirty = true;
+			this->domainaliasdirty = true;
+		}
+	}
+
+	for( const string& local: this->domainaliases->GetAliases() )
+	{
+		for( const string& user: this->domainaliases->GetUsers( local ) )
+		{
+			this->useraliases[user].insert( "/^" + local + "@/" );
+		}
+	}
+}
+
+/*
+ * Journal record, one per line: <length> <checksum> <operation>
+ * where operation is name and arguments separated by tabs. Length
+ * and checksum cover the operation.
+ */
+void MailMaps::replay()
+{
+	this->journalstate.Update();
+	if( this->journalstate.size == 0 )
+	{
+		return;
+	}
+
+	const string journal = File::GetContentAsString( this->journalstate.path, true );
+
+	size_t pos = 0;
+	size_t ops = 0;
+	while( pos < journal.size() )
+	{
+		const size_t lenend = journal.find( ' ', pos );
+		const size_t sumend = lenend == string::npos ? string::npos : journal.find( ' ', lenend + 1 );
+		if( sumend == string::npos )
+		{
+			break;
+		}
+
+		size_t len = 0;
+		try
+		{
+			len = stoul( journal.substr( pos, lenend - pos ) );
+		}
+		catch( std::exception& )
+		{
+			break;
+		}
+
+		const size_t start = sumend + 1;
+		if( start + len >= journal.size() || journal[start + len] != '\n' )
+		{
+			break;
+		}
+
+		const string record = journal.substr( start, len );
+		if( PostfixTable::Checksum( record ) != journal.substr( lenend + 1, sumend - lenend - 1 ) )
+		{
+			break;
+		}
+
+		vector<string> op;
+		size_t fpos = 0;
+		while( true )
+		{
+			const size_t fend = record.find( '\t', fpos );
+			op.push_back( record.substr( fpos, fend == string::npos ? string::npos : fend - fpos ) );
+			if( fend == string::npos )
+			{
+				break;
+			}
+			fpos = fend + 1;
+		}
+
+		try
+		{
+			this->apply( op );
+		}
+		catch( std::runtime_error& err )
+		{
+			logg << Logger::Notice << "Failed to replay " << op[0] << " from mail journal: " << err.what() << lend;
+		}
+
+		ops++;
+		pos = start + len + 1;
+	}
+
+	if( pos < journal.size() )
+	{
+		// Torn write, never acknowledged to caller
+		logg << Logger::Notice << "Dropping incomplete record at end of mail journal" << lend;
+		if( truncate( this->journalstate.path.c_str(), pos ) != 0 )
+		{
+			throw ErrnoException("Failed to truncate mail journal");
+		}
+		this->journalstate.Update();
+	}
+
+	logg << Logger::Debug << "Replayed " << ops << " mail journal records" << lend;
+}
+
+void MailMaps::change(const vector<string> &op)
+{
+	this->apply( op );
+
+	string record;
+	for( const string& field: op )
+	{
+		record += ( record.empty() ? "" : "\t" ) + field;
+	}
+
+	this->pending += to_string( record.size() ) + " " + PostfixTable::Checksum( record ) + " " + record + "\n";
+}
+
+void MailMaps::apply(const vector<string> &op)
+{
+	const string& name = op[0];
+
+	if( name == "AddDomain" && op.size() == 2 )
+	{
+		this->addDomain( op[1] );
+	}
+	else if( name == "DeleteDomain" && op.size() == 2 )
+	{
+		this->deleteDomain( op[1] );
+	}
+	else if( name == "SetAddress" && op.size() == 4 )
+	{
+		this->setAddress( op[1], op[2], op[3] );
+	}
+	else if( name == "DeleteAddress" && op.size() == 3 )
+	{
+		this->deleteAddress( op[1], op[2] );
+	}
+	else if( name == "SetLocalAddress" && op.size() == 4 )
+	{
+		this->setLocalAddress( op[1], op[2], op[3] );
+	}
+	else if( name == "DeleteLocalAddress" && op.size() == 3 )
+	{
+		this->deleteLocalAddress( op[1], op[2] );
+	}
+	else if( name == "AddAliasUser" && op.size() == 3 )
+	{
+		this->addAliasUser( op[1], op[2] );
+	}
+	else if( name == "RemoveAliasUser" && op.size() == 3 )
+	{
+		this->removeAliasUser( op[1], op[2] );
+	}
+	else
+	{
+		throw std::runtime_error("Unknown mail map operation " + name );
+	}
+}
+
+bool MailMaps::appendJournal()
+{
+	int fd = open( this->journalstate.path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600 );
+	if( fd < 0 )
+	{
+		throw ErrnoException("Failed to open mail journal");
+	}
+
+	size_t written = 0;
+	while( written < this->pending.size() )
+	{
+		ssize_t res = write( fd, this->pending.data() + written, this->pending.size() - written );
+		if( res < 0 )
+		{
+			close( fd );
+			throw ErrnoException("Failed to write mail journal");
+		}
+		written += res;
+	}
+
+	if( fdatasync( fd ) != 0 )
+	{
+		close( fd );
+		throw ErrnoException("Failed to sync mail journal");
+	}
+	close( fd );
+
+	this->pending.clear();
+	this->journalstate.Update();
+
+	return true;
+}
+
+bool MailMaps::compact()
+{
+	bool written = false;
+
+	if( this->dirty )
+	{
+		this->mc->WriteConfig();
+		syncFile( this->vmailbox.path );
+		syncFile( this->vdomains.path );
+		this->vmailbox.Update();
+		this->vdomains.Update();
+		this->dirty = false;
+		written = true;
+	}
+
+	if( this->localdirty )
+	{
+		this->localmail->WriteConfig();
+		syncFile( this->localstate.path, true );
+		this->localstate.Update();
+		this->localdirty = false;
+		written = true;
+	}
+
+	if( this->aliasdirty )
+	{
+		this->aliases->WriteConfig();
+		syncFile( this->aliasstate.path, true );
+		this->aliasstate.Update();
+		this->aliasdirty = false;
+		written = true;
+	}
+
+	if( this->domainaliasdirty )
+	{
+		this->domainaliases->WriteConfig();
+		syncFile( this->domainaliasstate.path );
+		this->domainaliasstate.Update();
+		this->domainaliasdirty = false;
+		written = true;
+	}
+
+	// Everything journaled is in the map files now
+	this->pending.clear();
+	if( this->journalstate.size > 0 )
+	{
+		if( truncate( this->journalstate.path.c_str(), 0 ) != 0 )
+		{
+			throw ErrnoException("Failed to truncate mail journal");
+		}
+		this->journalstate.Update();
+	}
+
+	if( this->expanddirty )
+	{
+		written = this->writeDomainAliasMap() || written;
+	}
+
+	this->updateIndex();
+
+	return written;
+}
+
+void MailMaps::streamRename(const string &from, const string &to, const Progress &progress)
+{
+	logg << Logger::Notice << "Renaming mail domain " << from << " to " << to << lend;
+
+	const auto& fromdom = this->addresses.find( from );
+	const bool hasto = this->addresses.find( to ) != this->addresses.end();
+	const string fromsuffix = "@" + from;
+	const string tosuffix = "@" + to;
+
+	size_t done = 0;
+	const size_t total = this->vmailbox.size + this->vdomains.size;
+
+	auto key = [](const string& line)
+	{
+		const size_t end = line.find_first_of( " \t" );
+		return end == string::npos ? line : line.substr( 0, end );
+	};
+
+	auto endsWith = [](const string& s, const string& suffix)
+	{
+		return s.size() > suffix.size() && s.compare( s.size() - suffix.size(), suffix.size(), suffix ) == 0;
+	};
+
+	rewriteFile( this->vmailbox.path, [&](string& line)
+	{
+		const string k = key( line );
+		if( endsWith( k, fromsuffix ) )
+		{
+			line = k.substr( 0, k.size() - fromsuffix.size() ) + tosuffix + line.substr( k.size() );
+		}
+		else if( hasto && endsWith( k, tosuffix ) )
+		{
+			// Replaced by address moved from old domain
+			return fromdom->second.find( k.substr( 0, k.size() - tosuffix.size() ) ) == fromdom->second.end();
+		}
+		return true;
+	}, done, total, progress );
+
+	rewriteFile( this->vdomains.path, [&](string& line)
+	{
+		const string k = key( line );
+		if( k == from )
+		{
+			if( hasto )
+			{
+				return false;
+			}
+			line = to + line.substr( k.size() );
+		}
+		return true;
+	}, done, total, progress );
+
+	if( progress )
+	{
+		progress( total, total );
+	}
+}
+
+void MailMaps::addDomain(const string &domain)
+{
+	this->mc->AddDomain( domain );
+	this->addresses[domain];
+	this->dirty = true;
+	this->domainschanged = true;
+	this->expanddirty = true;
+}
+
+void MailMaps::deleteDomain(const string &domain)
+{
+	this->mc->DeleteDomain( domain );
+
+	const auto& dom = this->addresses.find( domain );
+	if( dom != this->addresses.end() )
+	{
+		for( const auto& addr: dom->second )
+		{
+			this->unindexAddress( domain, addr.first, addr.second );
+		}
+		this->addresses.erase( dom );
+	}
+	this->dirty = true;
+	this->domainschanged = true;
+	this->expanddirty = true;
+}
+
+void MailMaps::setAddress(const string &domain, const string &address, const string &user)
+{
+	this->mc->SetAddress( domain, address, user );
+
+	if( this->addresses.find( domain ) == this->addresses.end() )
+	{
+		this->domainschanged = true;
+		this->expanddirty = true;
+	}
+
+	auto& dom = this->addresses[domain];
+	const auto& addr = dom.find( address );
+	if( addr != dom.end() )
+	{
+		this->unindexAddress( domain, address, addr->second );
+	}
+	dom[address] = user;
+	this->indexAddress( domain, address, user );
+	this->dirty = true;
+}
+
+void MailMaps::deleteAddress(const string &domain, const string &address)
+{
+	this->mc->DeleteAddress( domain, address );
+
+	const auto& dom = this->addresses.find( domain );
+	if( dom != this->addresses.end() )
+	{
+		const auto& addr = dom->second.find( address );
+		if( addr != dom->second.end() )
+		{
+			this->unindexAddress( domain, address, addr->second );
+			dom->second.erase( addr );
+		}
+
+		// Domain is removed along with its last address
+		if( ! this->mc->hasDomain( domain ) )
+		{
+			this->addresses.erase( dom );
+			this->domainschanged = true;
+			this->expanddirty = true;
+		}
+	}
+	this->dirty = true;
+}
+
+void MailMaps::changeDomain(const string &from, const string &to)
+{
+	this->mc->ChangeDomain( from, to );
+
+	const auto& dom = this->addresses.find( from );
+	if( dom != this->addresses.end() && this->addresses.find( to ) == this->addresses.end() )
+	{
+		// Relink domain under new name, addresses are not copied
+		auto node = this->addresses.extract( dom );
+		node.key() = to;
+		const auto& todom = this->addresses.insert( std::move( node ) ).position;
+
+		for( const auto& addr: todom->second )
+		{
+			this->unindexAddress( from, addr.first, addr.second );
+			this->indexAddress( to, addr.first, addr.second );
+		}
+	}
+	else if( dom != this->addresses.end() )
+	{
+		auto addrs = std::move( dom->second );
+		this->addresses.erase( dom );
+
+		auto& todom = this->addresses[to];
+		for( auto& addr: addrs )
+		{
+			this->unindexAddress( from, addr.first, addr.second );
+
+			const auto& existing = todom.find( addr.first );
+			if( existing != todom.end() )
+			{
+				this->unindexAddress( to, addr.first, existing->second );
+			}
+			this->indexAddress( to, addr.first, addr.second );
+			todom[addr.first] = std::move( addr.second );
+		}
+	}
+	this->dirty = true;
+	this->domainschanged = true;
+	this->expanddirty = true;
+}
+
+void MailMaps::setLocalAddress(const string &domain, const string &address, const string &user)
+{
+	this->localmail->SetAddress( domain, address, user );
+	this->localdirty = true;
+}
+
+void MailMaps::deleteLocalAddress(const string &domain, const string &address)
+{
+	this->localmail->DeleteAddress( domain, address );
+	this->localdirty = true;
+}
+
+void MailMaps::addAliasUser(const string &alias, const string &user)
+{
+	string local;
+	if( this->expandedAlias( alias, local ) )
+	{
+		this->domainaliases->AddUser( local, user );
+		this->domainaliasdirty = true;
+		this->expanddirty = true;
+	}
+	else
+	{
+		this->aliases->AddUser( alias, user );
+		this->aliasdirty = true;
+	}
+	this->useraliases[user].insert( alias );
+}
+
+void MailMaps::removeAliasUser(const string &alias, const string &user)
+{
+	string local;
+	if( this->expandedAlias( alias, local ) )
+	{
+		this->domainaliases->RemoveUser( local, user );
+		this->domainaliasdirty = true;
+		this->expanddirty = true;
+	}
+	else
+	{
+		this->aliases->RemoveUser( alias, user );
+		this->aliasdirty = true;
+	}
+
+	const auto& ua = this->useraliases.find( user );
+	if( ua != this->useraliases.end() )
+	{
+		ua->second.erase( alias );
+		if( ua->second.empty() )
+		{
+			this->useraliases.erase( ua );
+		}
+	}
+}
+
+list<pair<string, string> > MailMaps::DomainAliasEntries()
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	return this->expandDomainAliases();
+}
+
+list<pair<string, string> > MailMaps::expandDomainAliases()
+{
+	// Local domains too, aliases for root@localdomain and alike are only here
+	set<string> domains = this->localdomains;
+	for( const auto& domain: this->addresses )
+	{
+		domains.insert( domain.first );
+	}
+
+	list<pair<string,string>> entries;
+	for( const string& local: this->domainaliases->GetAliases() )
+	{
+		string users;
+		for( const string& user: this->domainaliases->GetUsers( local ) )
+		{
+			users += ( users.empty() ? "" : ", " ) + user;
+		}
+		if( users.empty() )
+		{
+			continue;
+		}
+
+		for( const string& domain: domains )
+		{
+			entries.emplace_back( local + "@" + domain, users );
+		}
+	}
+
+	return entries;
+}
+
+bool MailMaps::writeDomainAliasMap()
+{
+	string content;
+	for( const auto& entry: this->expandDomainAliases() )
+	{
+		content += entry.first + "\t" + entry.second + "\n";
+	}
+
+	this->expanddirty = false;
+
+	if( File::FileExists( this->domainaliasmap ) && File::GetContentAsString( this->domainaliasmap, true ) == content )
+	{
+		return false;
+	}
+
+	const string tmp = this->domainaliasmap + ".tmp";
+	int fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, File::UserRW );
+	if( fd < 0 )
+	{
+		throw ErrnoException("Failed to create " + tmp );
+	}
+
+	const pair<uid_t,gid_t> owner = MailMaps::PostfixOwner();
+	if( fchown( fd, owner.first, owner.second ) != 0 )
+	{
+		close( fd );
+		unlink( tmp.c_str() );
+		throw ErrnoException("Failed to chown " + tmp );
+	}
+
+	size_t written = 0;
+	while( written < content.size() )
+	{
+		ssize_t res = write( fd, content.data() + written, content.size() - written );
+		if( res < 0 )
+		{
+			close( fd );
+			unlink( tmp.c_str() );
+			throw ErrnoException("Failed to write " + tmp );
+		}
+		written += res;
+	}
+	close( fd );
+
+	if( rename( tmp.c_str(), this->domainaliasmap.c_str() ) != 0 )
+	{
+		unlink( tmp.c_str() );
+		throw ErrnoException("Failed to replace " + this->domainaliasmap );
+	}
+
+	return true;
+}
+
+bool MailMaps::expandedAlias(const string &alias, string &local)
+{
+	return this->domainaliasactive && MailMaps::domainAlias( alias, local );
+}
+
+bool MailMaps::domainAliasMapActive()
+{
+	const char* sep = ", \t";
+
+	// Compare paths with repeated slashes collapsed
+	auto normalize = [](string path)
+	{
+		path.erase( unique( path.begin(), path.end(), [](char a, char b){ return a == '/' && b == '/'; } ), path.end() );
+		return path;
+	};
+
+	try
+	{
+		const string maps = PostfixConfig().Get( "virtual_alias_maps" );
+
+		size_t pos = maps.find_first_not_of( sep );
+		while( pos != string::npos )
+		{
+			const size_t end = maps.find_first_of( sep, pos );
+			const string lookup = maps.substr( pos, end == string::npos ? string::npos : end - pos );
+			const size_t colon = lookup.find( ':' );
+
+			if( colon != string::npos && normalize( lookup.substr( colon + 1 ) ) == normalize( this->domainaliasmap ) )
+			{
+				return File::FileExists( PostfixTable( this->domainaliasmap, lookup.substr( 0, colon ) ).TablePath() );
+			}
+
+			pos = maps.find_first_not_of( sep, end );
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		logg << Logger::Error << "Failed to read postfix configuration: " << err.what() << lend;
+	}
+
+	return false;
+}
+
+bool MailMaps::domainAlias(const string &alias, string &local)
+{
+	// Exactly /^local@/ where local is a plain local part
+	if( alias.size() < 5 || alias.compare( 0, 2, "/^" ) != 0 || alias.compare( alias.size() - 2, 2, "@/" ) != 0 )
+	{
+		return false;
+	}
+
+	const string part = alias.substr( 2, alias.size() - 4 );
+	if( part.empty() || part.find_first_of( "@/\\.^$*+?()[]{}|" ) != string::npos )
+	{
+		return false;
+	}
+
+	local = part;
+	return true;
+}
+
+void MailMaps::indexAddress(const string &domain, const string &address, const string &user)
+{
+	this->useraddresses[user].emplace( domain, address );
+}
+
+void MailMaps::unindexAddress(const string &domain, const string &address, const string &user)
+{
+	const auto& ua = this->useraddresses.find( user );
+	if( ua != this->useraddresses.end() )
+	{
+		ua->second.erase( make_pair( domain, address ) );
+		if( ua->second.empty() )
+		{
+			this->useraddresses.erase( ua );
+		}
+	}
+}
+
+} // Namespace KGP
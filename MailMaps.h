@@ -0,0 +1,321 @@
+#ifndef MAILMAPS_H
+#define MAILMAPS_H
+
+#include "MailIndex.h"
+
+#include <libopi/MailConfig.h>
+#include <libopi/SysConfig.h>
+
+#include <sys/stat.h>
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief The MailMaps class, in memory copy of the mail maps
+ *
+ * Keeps one parsed copy of the virtual domain and mailbox maps indexed
+ * on domain and local part, as well as the local mail and virtual alias
+ * maps. Reads are answered from memory, the backing files are only
+ * reparsed when changed on disk by someone else.
+ *
+ * Reverse indexes from user to addresses and from alias target to
+ * aliases are maintained as well, making per user lookups and cleanup
+ * proportional to the number of entries of that user.
+ *
+ * Domain wide aliases, on the form /^local@/, are not kept in the
+ * regexp virtual alias map. They are stored separately, in the domain
+ * alias file, and expanded into one entry per virtual and local domain
+ * in the domain alias map, local@domain -> users. That map is compiled into a
+ * postfix lookup table, thus postfix never has to run the regexps when
+ * looking up a recipient. The expansion is rewritten whenever domains
+ * or domain aliases change. Domain wide aliases found in the virtual
+ * alias map are moved over upon load, once the domain alias map is
+ * compiled and postfix main.cf looks it up. Until then they are kept
+ * in the regexp map.
+ *
+ * Changes are applied in memory and appended to a change journal upon
+ * Flush, one small synced write regardless of map sizes. The journal
+ * is replayed on top of the map files when loading. Compact writes the
+ * map files, one write per changed file, and empties the journal.
+ * Journal records carry a length and checksum, a torn record at the
+ * end of the journal is dropped upon replay. Only operations giving
+ * the same result when replayed on a map already holding them are
+ * journaled, domain renames are written to the map files directly.
+ * Discard drops changes not yet flushed.
+ *
+ * Each time the map files are written, and when loading maps not yet
+ * indexed, a sorted binary index of domains and addresses is generated.
+ * Domain and address lookups are answered from that index, without
+ * reading the maps, as long as this copy is not loaded or is out of
+ * date and the index matches the maps and journal on disk. Other
+ * processes share the same index. Appending to the journal leaves the
+ * index out of date until next compaction, keeping Flush cheap.
+ */
+class MailMaps
+{
+public:
+	/**
+	 * @brief Progress callback, bytes processed and total bytes
+	 */
+	typedef function<void(size_t done, size_t total)> Progress;
+
+	MailMaps();
+
+	list<string> GetDomains();
+	bool hasDomain(const string& domain);
+	void AddDomain(const string& domain);
+	void DeleteDomain(const string& domain);
+
+	list<tuple<string,string>> GetAddresses(const string& domain);
+	tuple<string,string> GetAddress(const string& domain, const string& address);
+	bool hasAddress(const string& domain, const string& address);
+	void SetAddress(const string& domain, const string& address, const string& user);
+	void DeleteAddress(const string& domain, const string& address);
+
+	/**
+	 * @brief ChangeDomain move all addresses of one domain to another
+	 *
+	 * The map files are rewritten line by line into new files which
+	 * then replace the old ones, the whole map is never held twice.
+	 * Pending changes are written first, the rename is on disk upon
+	 * return.
+	 *
+	 * @param from existing domain
+	 * @param to new domain
+	 * @param progress optional progress callback
+	 */
+	void ChangeDomain(const string& from, const string& to, Progress progress = nullptr);
+
+	/**
+	 * @brief GetUserAddresses get all addresses delivered to user
+	 * @param user
+	 * @return list of tuples domain, localpart
+	 */
+	list<tuple<string,string>> GetUserAddresses(const string& user);
+
+	/**
+	 * @brief DeleteUserAddresses delete all addresses delivered to user
+	 * @param user
+	 */
+	void DeleteUserAddresses(const string& user);
+
+	// Local mail, localdomain mailboxes
+	void SetLocalAddress(const string& domain, const string& address, const string& user);
+	void DeleteLocalAddress(const string& domain, const string& address);
+
+	// Virtual aliases, including domain wide aliases
+	list<string> GetAliases();
+	list<string> GetAliasUsers(const string& alias);
+	void AddAliasUser(const string& alias, const string& user);
+	void RemoveAliasUser(const string& alias, const string& user);
+
+	/**
+	 * @brief GetUserAliases get aliases that has user as a target
+	 * @param user alias target
+	 * @return list of aliases
+	 */
+	list<string> GetUserAliases(const string& user);
+
+	/**
+	 * @brief RemoveUserAliases remove user from all aliases
+	 * @param user alias target
+	 */
+	void RemoveUserAliases(const string& user);
+
+	/**
+	 * @brief Flush write pending changes to journal, compacts if
+	 *        journal grew too large or a domain was renamed
+	 * @return true if anything was written
+	 */
+	bool Flush();
+
+	/**
+	 * @brief Compact write map files, including pending changes, and
+	 *        empty the journal
+	 * @return true if any map file was written
+	 */
+	bool Compact();
+
+	/**
+	 * @brief Dirty
+	 * @return true if there are changes not yet written to disk
+	 */
+	bool Dirty();
+
+	/**
+	 * @brief Discard drop all changes not yet flushed, maps are
+	 *        reread from disk upon next access
+	 */
+	void Discard();
+
+	/**
+	 * @brief DomainsChanged check, and clear, if set of domains changed
+	 *        since last call. Unlike addresses the domain list is only
+	 *        read by postfix at (re)start.
+	 * @return true if domains added or removed
+	 */
+	bool DomainsChanged();
+
+	/**
+	 * @brief SetLocalDomains set domains postfix delivers locally,
+	 *        i.e. localdomain and mydestination. Domain aliases are
+	 *        expanded for these as well as for the virtual domains.
+	 * @param domains
+	 */
+	void SetLocalDomains(const set<string>& domains);
+
+	/**
+	 * @brief DomainAliasMap
+	 * @return path of text map with domain aliases expanded per domain
+	 */
+	static string DomainAliasMap();
+	static string DomainAliasMap(OPI::SysConfig& cfg);
+
+	/**
+	 * @brief DomainAliasEntries
+	 * @return domain aliases expanded per domain, the content of the
+	 *         domain alias map, as key value pairs
+	 */
+	list<pair<string,string>> DomainAliasEntries();
+
+	/**
+	 * @brief PostfixOwner
+	 * @return uid and gid of postfix, looked up once
+	 */
+	static pair<uid_t,gid_t> PostfixOwner();
+
+	virtual ~MailMaps();
+
+private:
+
+	/**
+	 * @brief The FileState struct, used to detect changes to backing files
+	 */
+	struct FileState
+	{
+		string path;
+		struct timespec mtime;
+		off_t size;
+		ino_t inode;
+
+		bool Changed();
+		void Update();
+	};
+
+	/*
+	 * Reload if backing files or journal changed on disk, called
+	 * with lock held
+	 */
+	void revalidate();
+	bool changedOnDisk();
+
+	/*
+	 * Check if lookups should use index, regenerate index if out
+	 * of date and without pending changes
+	 */
+	bool indexed();
+	void updateIndex();
+
+	void load();
+	void loadAliases();
+	void replay();
+
+	/*
+	 * Apply operation in memory and queue it for the journal
+	 */
+	void change(const vector<string>& op);
+	void apply(const vector<string>& op);
+	bool appendJournal();
+	bool compact();
+	void streamRename(const string& from, const string& to, const Progress& progress);
+	list<pair<string,string>> expandDomainAliases();
+	bool writeDomainAliasMap();
+
+	// Operations, name followed by arguments
+	void addDomain(const string& domain);
+	void deleteDomain(const string& domain);
+	void setAddress(const string& domain, const string& address, const string& user);
+	void deleteAddress(const string& domain, const string& address);
+	void changeDomain(const string& from, const string& to);
+	void setLocalAddress(const string& domain, const string& address, const string& user);
+	void deleteLocalAddress(const string& domain, const string& address);
+	void addAliasUser(const string& alias, const string& user);
+	void removeAliasUser(const string& alias, const string& user);
+
+	/*
+	 * Check if alias is a domain wide alias, /^local@/, and
+	 * if so retrieve local part
+	 */
+	static bool domainAlias(const string& alias, string& local);
+
+	/*
+	 * As above, but only once postfix looks up the expanded map,
+	 * until then domain aliases stay in the regexp map
+	 */
+	bool expandedAlias(const string& alias, string& local);
+	bool domainAliasMapActive();
+
+	void indexAddress(const string& domain, const string& address, const string& user);
+	void unindexAddress(const string& domain, const string& address, const string& user);
+
+	unique_ptr<OPI::MailConfig> mc;
+
+	// domain -> localpart -> user
+	unordered_map<string, unordered_map<string,string>> addresses;
+
+	// user -> (domain, localpart)
+	unordered_map<string, set<pair<string,string>>> useraddresses;
+
+	FileState vmailbox;
+	FileState vdomains;
+	bool dirty;
+	bool domainschanged;
+
+	unique_ptr<OPI::MailMapFile> localmail;
+	FileState localstate;
+	bool localdirty;
+
+	unique_ptr<OPI::MailAliasFile> aliases;
+
+	// alias target -> aliases
+	unordered_map<string, set<string>> useraliases;
+	FileState aliasstate;
+	bool aliasdirty;
+
+	// Domain wide aliases keyed on local part
+	unique_ptr<OPI::MailAliasFile> domainaliases;
+	FileState domainaliasstate;
+	bool domainaliasdirty;
+
+	// Expansion of domain aliases, out of date
+	string domainaliasmap;
+	set<string> localdomains;
+	bool expanddirty;
+	bool domainaliasactive;		// Map compiled and in main.cf
+
+	// Journal records not yet written
+	string pending;
+	FileState journalstate;
+
+	unique_ptr<MailIndex> index;
+
+	mutex lock;
+};
+
+} // Namespace KGP
+
+#endif // MAILMAPS_H
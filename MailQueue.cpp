@@ -0,0 +1,293 @@
+#include "MailQueue.h"
+
+#include <libutils/Logger.h>
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+
+using namespace Utils;
+
+namespace KGP
+{
+
+// Queues reported, in order messages normally pass them
+static const char* queues[] = { "incoming", "active", "deferred", "hold" };
+
+// Queue file records needed are at start of file
+static constexpr size_t HeaderSize = 4096;
+
+MailQueue::MailQueue(const string &spool, chrono::seconds interval, size_t scanlimit):
+	spool(spool), interval(interval), scanlimit(scanlimit), generation(0), stats()
+{
+}
+
+MailQueue::Stats MailQueue::GetStats(bool refresh)
+{
+	lock_guard<mutex> l( this->lock );
+
+	if( refresh || this->stats.updated == 0 ||
+			chrono::steady_clock::now() - this->lastscan >= this->interval )
+	{
+		this->scan();
+	}
+
+	return this->stats;
+}
+
+void MailQueue::scan()
+{
+	const auto now = chrono::steady_clock::now();
+	const uint64_t gen = ++this->generation;
+
+	Stats s{};
+	size_t opened = 0;
+	s.complete = true;
+
+	unordered_map<string,string> deferlogs;
+	MailQueue::listQueue( this->spool + "/defer", deferlogs );
+
+	map<string, size_t> newdeferrals;
+	for( const char* queue: queues )
+	{
+		unordered_map<string,string> files;
+		MailQueue::listQueue( this->spool + "/" + queue, files );
+
+		const bool deferred = queue[0] == 'd';
+		for( const auto& file: files )
+		{
+			auto msg = this->messages.find( file.first );
+			if( msg == this->messages.end() )
+			{
+				msg = this->messages.emplace( file.first, Message{ queue[0], 0, false, {}, gen } ).first;
+			}
+			else if( msg->second.queue != queue[0] )
+			{
+				// Moved, a new deferral if moved into deferred
+				msg->second.queue = queue[0];
+				msg->second.deferexamined = false;
+				msg->second.domains.clear();
+			}
+			Message& m = msg->second;
+			m.seen = gen;
+
+			if( m.arrival == 0 )
+			{
+				if( opened < this->scanlimit )
+				{
+					opened++;
+					m.arrival = MailQueue::arrival( file.second );
+				}
+				else
+				{
+					s.complete = false;
+				}
+			}
+
+			if( deferred && ! m.deferexamined )
+			{
+				const auto& log = deferlogs.find( file.first );
+				if( log != deferlogs.end() && opened < this->scanlimit )
+				{
+					opened++;
+					m.domains = MailQueue::deferDomains( log->second );
+					m.deferexamined = true;
+					for( const string& domain: m.domains )
+					{
+						newdeferrals[domain]++;
+					}
+				}
+				else if( log != deferlogs.end() )
+				{
+					s.complete = false;
+				}
+			}
+
+			if( m.arrival != 0 && ( s.oldest == 0 || m.arrival < s.oldest ) )
+			{
+				s.oldest = m.arrival;
+			}
+
+			if( deferred )
+			{
+				for( const string& domain: m.domains )
+				{
+					s.domains[domain].deferred++;
+				}
+			}
+		}
+
+		switch( queue[0] )
+		{
+		case 'i': s.incoming = files.size(); break;
+		case 'a': s.active = files.size(); break;
+		case 'd': s.deferred = files.size(); break;
+		case 'h': s.hold = files.size(); break;
+		}
+	}
+
+	// Forget messages that left the queue
+	for( auto it = this->messages.begin(); it != this->messages.end(); )
+	{
+		it = it->second.seen != gen ? this->messages.erase( it ) : std::next( it );
+	}
+
+	// Rates need a previous scan, first one sees all deferrals as new
+	if( this->stats.updated != 0 )
+	{
+		const double hours = chrono::duration<double>( now - this->lastscan ).count() / 3600;
+		for( auto& domain: s.domains )
+		{
+			const auto& nd = newdeferrals.find( domain.first );
+			domain.second.rate = nd != newdeferrals.end() && hours > 0 ? nd->second / hours : 0;
+		}
+	}
+
+	s.updated = time( nullptr );
+	this->stats = s;
+	this->lastscan = now;
+
+	logg << Logger::Debug << "Scanned mail queue, opened " << opened << " files"
+		 << ( s.complete ? "" : ", scan limit reached" ) << lend;
+}
+
+void MailQueue::listQueue(const string &dir, unordered_map<string, string> &files, int depth)
+{
+	DIR* d = opendir( dir.c_str() );
+	if( ! d )
+	{
+		// Not all queues exist on all installations
+		return;
+	}
+
+	struct dirent* ent;
+	while( ( ent = readdir( d ) ) != nullptr )
+	{
+		if( ent->d_name[0] == '.' )
+		{
+			continue;
+		}
+
+		const string path = dir + "/" + ent->d_name;
+		unsigned char type = ent->d_type;
+		if( type == DT_UNKNOWN )
+		{
+			struct stat st{};
+			if( lstat( path.c_str(), &st ) != 0 )
+			{
+				continue;
+			}
+			type = S_ISDIR( st.st_mode ) ? DT_DIR : ( S_ISREG( st.st_mode ) ? DT_REG : DT_UNKNOWN );
+		}
+
+		if( type == DT_DIR && depth < 2 )
+		{
+			// Hashed queue subdirectory
+			MailQueue::listQueue( path, files, depth + 1 );
+		}
+		else if( type == DT_REG )
+		{
+			files[ent->d_name] = path;
+		}
+	}
+	closedir( d );
+}
+
+/*
+ * Queue file records are type, length as 7 bit groups low first
+ * with high bit set on all but the last, and data. The time record
+ * holds arrival time as text, seconds optionally followed by
+ * microseconds. Message content follows the envelope records.
+ */
+time_t MailQueue::arrival(const string &path)
+{
+	int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+	if( fd < 0 )
+	{
+		// Moved or delivered since listed
+		return 0;
+	}
+
+	unsigned char buf[HeaderSize];
+	ssize_t len = read( fd, buf, sizeof( buf ) );
+
+	struct stat st{};
+	const bool hasstat = fstat( fd, &st ) == 0;
+	close( fd );
+
+	size_t pos = 0;
+	while( len > 0 && pos < static_cast<size_t>( len ) )
+	{
+		const unsigned char type = buf[pos++];
+
+		size_t reclen = 0;
+		int shift = 0;
+		while( pos < static_cast<size_t>( len ) && shift < 32 )
+		{
+			const unsigned char c = buf[pos++];
+			reclen |= static_cast<size_t>( c & 0x7f ) << shift;
+			shift += 7;
+			if( ! ( c & 0x80 ) )
+			{
+				break;
+			}
+		}
+
+		if( type == 'M' || pos + reclen > static_cast<size_t>( len ) )
+		{
+			break;
+		}
+
+		if( type == 'T' )
+		{
+			const string data( reinterpret_cast<const char*>( buf + pos ), reclen );
+			const time_t t = strtoll( data.c_str(), nullptr, 10 );
+			if( t > 0 )
+			{
+				return t;
+			}
+		}
+		pos += reclen;
+	}
+
+	// Not a queue file we understand, best effort
+	return hasstat ? st.st_ctime : time( nullptr );
+}
+
+vector<string> MailQueue::deferDomains(const string &path)
+{
+	vector<string> domains;
+
+	ifstream in( path );
+	string line;
+	while( getline( in, line ) )
+	{
+		if( line.compare( 0, 10, "recipient=" ) != 0 )
+		{
+			continue;
+		}
+
+		const size_t at = line.rfind( '@' );
+		if( at == string::npos || at < 10 )
+		{
+			continue;
+		}
+
+		string domain = line.substr( at + 1 );
+		transform( domain.begin(), domain.end(), domain.begin(), ::tolower );
+		if( find( domains.begin(), domains.end(), domain ) == domains.end() )
+		{
+			domains.push_back( domain );
+		}
+	}
+
+	return domains;
+}
+
+} // Namespace KGP
@@ -0,0 +1,106 @@
+#ifndef MAILQUEUE_H
+#define MAILQUEUE_H
+
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief The MailQueue class, statistics on the postfix mail queue
+ *
+ * Statistics are gathered by scanning the queue directories directly,
+ * no postqueue or showq involved. Each message seen is remembered, a
+ * scan thus only opens queue files new since the previous scan. The
+ * number of files opened in one scan is capped, messages not examined
+ * are still counted and are picked up by following scans.
+ *
+ * Statistics are cached and only refreshed when older than the refresh
+ * interval.
+ */
+class MailQueue
+{
+public:
+
+	struct DomainStats
+	{
+		size_t deferred;	/**< Deferred recipients in queue */
+		double rate;		/**< New deferrals per hour, between last two scans */
+	};
+
+	struct Stats
+	{
+		size_t incoming;
+		size_t active;
+		size_t deferred;
+		size_t hold;
+		time_t oldest;		/**< Arrival time of oldest message, 0 if queue empty */
+		map<string, DomainStats> domains;	/**< Deferred recipient domains */
+		bool complete;		/**< False if scan cap left messages unexamined */
+		time_t updated;		/**< Time of last scan */
+	};
+
+	/**
+	 * @brief MailQueue
+	 * @param spool postfix queue directory
+	 * @param interval refresh interval
+	 * @param scanlimit max number of files opened per scan
+	 */
+	MailQueue(const string& spool = "/var/spool/postfix",
+			  chrono::seconds interval = chrono::seconds(60),
+			  size_t scanlimit = 1000);
+
+	/**
+	 * @brief GetStats get queue statistics
+	 * @param refresh rescan regardless of refresh interval
+	 * @return
+	 */
+	Stats GetStats(bool refresh = false);
+
+	virtual ~MailQueue() = default;
+
+private:
+
+	struct Message
+	{
+		char queue;				// First letter of queue directory
+		time_t arrival;			// 0 until examined
+		bool deferexamined;		// Defer log read
+		vector<string> domains;	// Deferred recipient domains
+		uint64_t seen;			// Scan generation
+	};
+
+	void scan();
+
+	/*
+	 * List queue files in (hashed) queue directory,
+	 * queue id -> path
+	 */
+	static void listQueue(const string& dir, unordered_map<string,string>& files, int depth = 0);
+
+	static time_t arrival(const string& path);
+	static vector<string> deferDomains(const string& path);
+
+	string spool;
+	chrono::seconds interval;
+	size_t scanlimit;
+
+	mutex lock;
+	unordered_map<string, Message> messages;
+	uint64_t generation;
+	chrono::steady_clock::time_point lastscan;
+	Stats stats;
+};
+
+} // Namespace KGP
+
+#endif // MAILQUEUE_H
@@ -0,0 +1,251 @@
+#include "PostfixConfig.h"
+
+#include <libutils/Exceptions.h>
+#include <libutils/Logger.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <set>
+
+using namespace Utils;
+
+namespace KGP
+{
+
+static const char* ws = " \t\r";
+
+static string trim(const string& s)
+{
+	const size_t start = s.find_first_not_of( ws );
+	if( start == string::npos )
+	{
+		return "";
+	}
+	return s.substr( start, s.find_last_not_of( ws ) - start + 1 );
+}
+
+PostfixConfig::PostfixConfig(const string &path): path(path)
+{
+}
+
+string PostfixConfig::Get(const string &name, const string &def)
+{
+	const map<string, Param> params = PostfixConfig::parse( this->read() );
+	const auto& param = params.find( name );
+
+	return param != params.end() ? param->second.value : def;
+}
+
+bool PostfixConfig::HasKey(const string &name)
+{
+	const map<string, Param> params = PostfixConfig::parse( this->read() );
+
+	return params.find( name ) != params.end();
+}
+
+map<string, string> PostfixConfig::Parameters()
+{
+	map<string,string> ret;
+	for( const auto& param: PostfixConfig::parse( this->read() ) )
+	{
+		ret[param.first] = param.second.value;
+	}
+
+	return ret;
+}
+
+void PostfixConfig::Set(const string &name, const string &value)
+{
+	if( name.empty() || name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") != string::npos )
+	{
+		throw std::runtime_error("Invalid postfix parameter name: " + name );
+	}
+
+	if( value.find_first_of("\r\n") != string::npos )
+	{
+		throw std::runtime_error("Invalid value for postfix parameter " + name );
+	}
+
+	this->changes[name] = { true, trim( value ) };
+}
+
+void PostfixConfig::Remove(const string &name)
+{
+	this->changes[name] = { false, "" };
+}
+
+bool PostfixConfig::Write()
+{
+	vector<string> lines = this->read();
+	const map<string, Param> params = PostfixConfig::parse( lines );
+
+	set<size_t> drop;
+	vector<string> append;
+	bool replaced = false;
+	for( const auto& change: this->changes )
+	{
+		const auto& param = params.find( change.first );
+		if( ! change.second.first )
+		{
+			if( param != params.end() )
+			{
+				drop.insert( param->second.lines.begin(), param->second.lines.end() );
+			}
+			continue;
+		}
+
+		const string line = change.first + " = " + change.second.second;
+		if( param == params.end() )
+		{
+			append.push_back( line );
+		}
+		else if( param->second.value != change.second.second )
+		{
+			// Single definition left
+			lines[param->second.line] = line;
+			drop.insert( param->second.lines.begin(), param->second.lines.end() );
+			drop.erase( param->second.line );
+			replaced = true;
+		}
+	}
+	this->changes.clear();
+
+	if( ! replaced && drop.empty() && append.empty() )
+	{
+		return false;
+	}
+
+	string content;
+	for( size_t i = 0; i < lines.size(); i++ )
+	{
+		if( drop.find( i ) == drop.end() )
+		{
+			content += lines[i] + "\n";
+		}
+	}
+	for( const string& line: append )
+	{
+		content += line + "\n";
+	}
+
+	struct stat st{};
+	if( stat( this->path.c_str(), &st ) != 0 )
+	{
+		st.st_uid = getuid();
+		st.st_gid = getgid();
+		st.st_mode = 0644;
+	}
+
+	const string tmp = this->path + ".new";
+	int fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+	if( fd < 0 )
+	{
+		throw ErrnoException("Failed to create " + tmp );
+	}
+
+	auto fail = [&fd, &tmp](const string& msg)
+	{
+		close( fd );
+		unlink( tmp.c_str() );
+		throw ErrnoException( msg );
+	};
+
+	if( fchown( fd, st.st_uid, st.st_gid ) != 0 || fchmod( fd, st.st_mode & 07777 ) != 0 )
+	{
+		fail( "Failed to set owner and mode on " + tmp );
+	}
+
+	size_t written = 0;
+	while( written < content.size() )
+	{
+		ssize_t res = write( fd, content.data() + written, content.size() - written );
+		if( res < 0 )
+		{
+			fail( "Failed to write " + tmp );
+		}
+		written += res;
+	}
+
+	if( fsync( fd ) != 0 )
+	{
+		fail( "Failed to sync " + tmp );
+	}
+	close( fd );
+
+	if( rename( tmp.c_str(), this->path.c_str() ) != 0 )
+	{
+		unlink( tmp.c_str() );
+		throw ErrnoException("Failed to replace " + this->path );
+	}
+
+	logg << Logger::Debug << "Updated " << this->path << lend;
+
+	return true;
+}
+
+vector<string> PostfixConfig::read()
+{
+	vector<string> lines;
+
+	ifstream in( this->path );
+	string line;
+	while( getline( in, line ) )
+	{
+		lines.push_back( line );
+	}
+
+	if( in.bad() )
+	{
+		throw std::runtime_error("Failed to read " + this->path );
+	}
+
+	return lines;
+}
+
+map<string, PostfixConfig::Param> PostfixConfig::parse(const vector<string> &lines)
+{
+	map<string, Param> params;
+	Param* current = nullptr;
+
+	for( size_t i = 0; i < lines.size(); i++ )
+	{
+		const string& line = lines[i];
+		const size_t first = line.find_first_not_of( ws );
+		if( first == string::npos || line[first] == '#' )
+		{
+			// Blank lines and comments do not end a logical line
+			continue;
+		}
+
+		if( first > 0 )
+		{
+			if( current )
+			{
+				current->lines.push_back( i );
+				current->value += ( current->value.empty() ? "" : " " ) + trim( line );
+			}
+			continue;
+		}
+
+		const size_t eq = line.find( '=' );
+		if( eq == string::npos )
+		{
+			logg << Logger::Notice << "Ignoring malformed postfix configuration line: " << line << lend;
+			current = nullptr;
+			continue;
+		}
+
+		// Last definition wins
+		current = &params[trim( line.substr( 0, eq ) )];
+		current->line = i;
+		current->lines.push_back( i );
+		current->value = trim( line.substr( eq + 1 ) );
+	}
+
+	return params;
+}
+
+} // Namespace KGP
@@ -0,0 +1,92 @@
+#ifndef POSTFIXCONFIG_H
+#define POSTFIXCONFIG_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief The PostfixConfig class, reads and updates postfix main.cf
+ *
+ * Handles the file the way postconf does, "name = value" with lines
+ * starting with whitespace continuing the previous line and lines
+ * starting with # being comments. The last definition of a parameter
+ * is the one in effect, changing a parameter leaves one definition.
+ *
+ * Changes are queued by Set and Remove and applied together by Write,
+ * which rereads the file, edits it and replaces it with a new file
+ * with same owner and mode. Comments, ordering and other parameters
+ * are left untouched. Values are never expanded.
+ */
+class PostfixConfig
+{
+public:
+	/**
+	 * @brief PostfixConfig
+	 * @param path configuration file, i.e. main.cf
+	 */
+	PostfixConfig(const string& path = "/etc/postfix/main.cf");
+
+	/**
+	 * @brief Get current value of parameter, queued changes not included
+	 * @param name parameter name
+	 * @param def returned if parameter not set
+	 * @return value, continuation lines joined with a space
+	 */
+	string Get(const string& name, const string& def = "");
+
+	bool HasKey(const string& name);
+
+	/**
+	 * @brief Parameters get all parameters, queued changes not included
+	 * @return name, value of each parameter
+	 */
+	map<string,string> Parameters();
+
+	/**
+	 * @brief Set queue change of parameter
+	 * @param name parameter name
+	 * @param value new value, must not contain newlines
+	 */
+	void Set(const string& name, const string& value);
+
+	/**
+	 * @brief Remove queue removal of parameter
+	 * @param name parameter name
+	 */
+	void Remove(const string& name);
+
+	/**
+	 * @brief Write apply queued changes in one write
+	 * @return true if file content changed
+	 */
+	bool Write();
+
+	virtual ~PostfixConfig() = default;
+
+private:
+	struct Param
+	{
+		size_t line;			// Definition in effect
+		vector<size_t> lines;	// All definition and continuation lines
+		string value;
+	};
+
+	vector<string> read();
+	static map<string, Param> parse(const vector<string>& lines);
+
+	string path;
+
+	// name -> new value, removal if not set
+	map<string, pair<bool,string>> changes;
+};
+
+} // Namespace KGP
+
+#endif // POSTFIXCONFIG_H
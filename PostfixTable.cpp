@@ -0,0 +1,436 @@
+#include "PostfixTable.h"
+
+#include <libutils/Exceptions.h>
+#include <libutils/FileUtils.h>
+#include <libutils/Logger.h>
+#include <libutils/Process.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <unordered_set>
+#include <vector>
+
+using namespace Utils;
+
+namespace KGP
+{
+
+// Constant database, see http://cr.yp.to/cdb/cdb.txt
+static constexpr uint32_t CDBHeaderSize = 256 * 8;
+
+static uint32_t cdbHash(const string& key)
+{
+	uint32_t h = 5381;
+	for( unsigned char c: key )
+	{
+		h = ( ( h << 5 ) + h ) ^ c;
+	}
+	return h;
+}
+
+// 64 bit FNV-1a, used for content checksums
+static constexpr uint64_t FNVOffset = 0xcbf29ce484222325ULL;
+
+static uint64_t fnv(uint64_t h, const string& data)
+{
+	for( unsigned char c: data )
+	{
+		h ^= c;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static string hex(uint64_t h)
+{
+	char buf[17];
+	snprintf( buf, sizeof( buf ), "%016llx", static_cast<unsigned long long>( h ) );
+
+	return buf;
+}
+
+static void putUint32(vector<char>& buf, uint32_t val)
+{
+	for( int i = 0; i < 4; i++ )
+	{
+		buf.push_back( static_cast<char>( ( val >> ( 8 * i ) ) & 0xff ) );
+	}
+}
+
+static void setUint32(vector<char>& buf, size_t pos, uint32_t val)
+{
+	for( int i = 0; i < 4; i++ )
+	{
+		buf[pos + i] = static_cast<char>( ( val >> ( 8 * i ) ) & 0xff );
+	}
+}
+
+/*
+ * Write buffer to a temporary file next to path and rename into place,
+ * owner and mode taken from like if given, else 0644
+ */
+static void writeAtomic(const string& path, const char* data, size_t len, const string& like)
+{
+	struct stat st{};
+	st.st_mode = 0644;
+	st.st_uid = geteuid();
+	st.st_gid = getegid();
+	if( like != "" && stat( like.c_str(), &st ) != 0 )
+	{
+		throw ErrnoException("Failed to stat " + like );
+	}
+
+	string tmpl = path + ".XXXXXX";
+	vector<char> name( tmpl.begin(), tmpl.end() );
+	name.push_back('\0');
+
+	int fd = mkstemp( name.data() );
+	if( fd < 0 )
+	{
+		throw ErrnoException("Failed to create temporary table for " + path );
+	}
+
+	size_t written = 0;
+	while( written < len )
+	{
+		ssize_t res = write( fd, data + written, len - written );
+		if( res < 0 )
+		{
+			close( fd );
+			unlink( name.data() );
+			throw ErrnoException("Failed to write table " + path );
+		}
+		written += res;
+	}
+
+	if( fchown( fd, st.st_uid, st.st_gid ) != 0 || fchmod( fd, st.st_mode & 0777 ) != 0 )
+	{
+		close( fd );
+		unlink( name.data() );
+		throw ErrnoException("Failed to set owner of table " + path );
+	}
+
+	if( fsync( fd ) != 0 )
+	{
+		close( fd );
+		unlink( name.data() );
+		throw ErrnoException("Failed to sync table " + path );
+	}
+	close( fd );
+
+	if( rename( name.data(), path.c_str() ) != 0 )
+	{
+		unlink( name.data() );
+		throw ErrnoException("Failed to rename table " + path );
+	}
+}
+
+PostfixTable::PostfixTable(const string &source, const string &type, const string &postmap):
+	source(source), type(type), postmapcmd(postmap)
+{
+}
+
+PostfixTable::Result PostfixTable::Update(bool force)
+{
+	string content;
+	try
+	{
+		content = File::GetContentAsString( this->source, true );
+	}
+	catch( std::runtime_error& err )
+	{
+		this->error = string("Failed to read ") + this->source + " (" + err.what() + ")";
+		logg << Logger::Error << this->error << lend;
+		return Failed;
+	}
+
+	return this->update( this->type + ":" + PostfixTable::Checksum( content ), force, [&]()
+	{
+		return this->type == "cdb" ? this->compile( PostfixTable::Parse( content ) ) : this->postmap( content );
+	});
+}
+
+PostfixTable::Result PostfixTable::Update(const list<pair<string, string> > &entries, bool force)
+{
+	uint64_t h = FNVOffset;
+	for( const auto& entry: entries )
+	{
+		h = fnv( h, entry.first );
+		h = fnv( h, "\t" );
+		h = fnv( h, entry.second );
+		h = fnv( h, "\n" );
+	}
+
+	return this->update( this->type + ":entries:" + hex( h ), force, [&]()
+	{
+		if( this->type == "cdb" )
+		{
+			// Keys are case insensitive, as postmap does
+			list<pair<string,string>> lower( entries );
+			for( auto& entry: lower )
+			{
+				transform( entry.first.begin(), entry.first.end(), entry.first.begin(), ::tolower );
+			}
+			return this->compile( lower );
+		}
+
+		string content;
+		for( const auto& entry: entries )
+		{
+			content += entry.first + "\t" + entry.second + "\n";
+		}
+		return this->postmap( content );
+	});
+}
+
+string PostfixTable::TablePath() const
+{
+	if( this->type == "cdb" )
+	{
+		return this->source + ".cdb";
+	}
+	if( this->type == "lmdb" )
+	{
+		return this->source + ".lmdb";
+	}
+	return this->source + ".db";
+}
+
+string PostfixTable::StrError() const
+{
+	return this->error;
+}
+
+list<pair<string, string> > PostfixTable::Parse(const string &content)
+{
+	list<pair<string,string>> ret;
+	string logical;
+
+	auto addEntry = [&ret](const string& line)
+	{
+		const char* ws = " \t\r\n";
+		size_t kstart = line.find_first_not_of( ws );
+		if( kstart == string::npos || line[kstart] == '#' )
+		{
+			return;
+		}
+
+		size_t kend = line.find_first_of( ws, kstart );
+		string key = line.substr( kstart, kend - kstart );
+		transform( key.begin(), key.end(), key.begin(), ::tolower );
+
+		string value;
+		if( kend != string::npos )
+		{
+			size_t vstart = line.find_first_not_of( ws, kend );
+			if( vstart != string::npos )
+			{
+				size_t vend = line.find_last_not_of( ws );
+				value = line.substr( vstart, vend - vstart + 1 );
+			}
+		}
+		ret.emplace_back( std::move( key ), std::move( value ) );
+	};
+
+	istringstream in( content );
+	string line;
+	while( getline( in, line ) )
+	{
+		size_t first = line.find_first_not_of(" \t\r");
+		if( first == string::npos || line[first] == '#' )
+		{
+			continue;
+		}
+
+		if( first > 0 && ! logical.empty() )
+		{
+			// Continuation of previous line
+			logical += " " + line.substr( first );
+			continue;
+		}
+
+		addEntry( logical );
+		logical = line;
+	}
+	addEntry( logical );
+
+	return ret;
+}
+
+void PostfixTable::WriteCDB(const string &path, const list<pair<string, string> > &entries, const string &like)
+{
+	struct Slot
+	{
+		uint32_t hash;
+		uint32_t pos;
+	};
+
+	vector<char> buf( CDBHeaderSize, 0 );
+	vector<Slot> slots[256];
+	unordered_set<string> seen;
+
+	for( const auto& entry: entries )
+	{
+		if( ! seen.insert( entry.first ).second )
+		{
+			logg << Logger::Notice << "Duplicate entry " << entry.first << " in " << path << " ignored" << lend;
+			continue;
+		}
+
+		if( buf.size() + 8 + entry.first.size() + entry.second.size() > UINT32_MAX )
+		{
+			throw std::runtime_error("Table too large: " + path );
+		}
+
+		uint32_t hash = cdbHash( entry.first );
+		slots[hash & 0xff].push_back( { hash, static_cast<uint32_t>( buf.size() ) } );
+
+		putUint32( buf, entry.first.size() );
+		putUint32( buf, entry.second.size() );
+		buf.insert( buf.end(), entry.first.begin(), entry.first.end() );
+		buf.insert( buf.end(), entry.second.begin(), entry.second.end() );
+	}
+
+	// Hash tables, twice the number of entries, open addressing
+	for( int i = 0; i < 256; i++ )
+	{
+		const uint32_t len = slots[i].size() * 2;
+		const size_t start = buf.size();
+
+		setUint32( buf, i * 8, start );
+		setUint32( buf, i * 8 + 4, len );
+
+		buf.resize( start + len * 8, 0 );
+		for( const Slot& slot: slots[i] )
+		{
+			uint32_t s = ( slot.hash >> 8 ) % len;
+			while( buf[start + s * 8 + 4] || buf[start + s * 8 + 5] ||
+				   buf[start + s * 8 + 6] || buf[start + s * 8 + 7] )
+			{
+				// Slot taken, record positions are never zero
+				s = ( s + 1 ) % len;
+			}
+			setUint32( buf, start + s * 8, slot.hash );
+			setUint32( buf, start + s * 8 + 4, slot.pos );
+		}
+	}
+
+	if( buf.size() > UINT32_MAX )
+	{
+		throw std::runtime_error("Table too large: " + path );
+	}
+
+	writeAtomic( path, buf.data(), buf.size(), like );
+}
+
+string PostfixTable::Checksum(const string &content)
+{
+	return hex( fnv( FNVOffset, content ) );
+}
+
+PostfixTable::Result PostfixTable::update(const string &sum, bool force, const function<bool ()> &build)
+{
+	const string sumfile = this->source + ".sum";
+
+	if( ! force && File::FileExists( sumfile ) && File::FileExists( this->TablePath() ) )
+	{
+		try
+		{
+			if( File::GetContentAsString( sumfile, true ) == sum )
+			{
+				logg << Logger::Debug << "Table " << this->source << " unchanged" << lend;
+				return Unchanged;
+			}
+		}
+		catch( std::runtime_error& err )
+		{
+			logg << Logger::Notice << "Unable to read checksum for " << this->source << ": " << err.what() << lend;
+		}
+	}
+
+	if( ! build() )
+	{
+		return Failed;
+	}
+
+	try
+	{
+		File::Write( sumfile, sum, File::UserRW );
+	}
+	catch( std::runtime_error& err )
+	{
+		// Only means a rebuild next time
+		logg << Logger::Notice << "Unable to write checksum for " << this->source << ": " << err.what() << lend;
+	}
+
+	return Rebuilt;
+}
+
+bool PostfixTable::compile(const list<pair<string, string> > &entries)
+{
+	try
+	{
+		// Tables are as sensitive as their source, i.e. sasl passwords
+		PostfixTable::WriteCDB( this->TablePath(), entries, File::FileExists( this->source ) ? this->source : "" );
+	}
+	catch( std::runtime_error& err )
+	{
+		this->error = string("Failed to compile ") + this->source + " (" + err.what() + ")";
+		logg << Logger::Error << this->error << lend;
+		return false;
+	}
+
+	return true;
+}
+
+bool PostfixTable::postmap(const string &content)
+{
+	/*
+	 * Let postmap work on a staged copy of the source and move
+	 * the resulting table into place
+	 */
+	const string staged = this->source + ".new";
+	const string stagedtable = PostfixTable( staged, this->type ).TablePath();
+
+	try
+	{
+		File::Write( staged, content, File::UserRW );
+	}
+	catch( std::runtime_error& err )
+	{
+		this->error = string("Failed to stage ") + this->source + " (" + err.what() + ")";
+		logg << Logger::Error << this->error << lend;
+		return false;
+	}
+
+	bool res = false;
+	tie(res, std::ignore) = Process::Exec( this->postmapcmd + " " + this->type + ":" + staged );
+	unlink( staged.c_str() );
+
+	if( ! res )
+	{
+		unlink( stagedtable.c_str() );
+		this->error = "Failed to process " + this->source;
+		logg << Logger::Error << this->error << lend;
+		return false;
+	}
+
+	if( rename( stagedtable.c_str(), this->TablePath().c_str() ) != 0 )
+	{
+		unlink( stagedtable.c_str() );
+		this->error = string("Failed to rename table for ") + this->source + " (" + strerror(errno) + ")";
+		logg << Logger::Error << this->error << lend;
+		return false;
+	}
+
+	return true;
+}
+
+} // Namespace KGP
@@ -0,0 +1,118 @@
+#ifndef POSTFIXTABLE_H
+#define POSTFIXTABLE_H
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <string>
+#include <utility>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief The PostfixTable class, maintains a postfix lookup table
+ *        compiled from a text map file
+ *
+ * The text file is parsed the same way postmap does, the first word
+ * on a line is the (lower case) key and the remainder the value.
+ * Lines starting with whitespace continue the previous line.
+ *
+ * A checksum of the source is kept next to it, source.sum, and the
+ * table is only rebuilt if the source content changed. Tables are
+ * created under a temporary name and renamed into place, postfix
+ * thus never sees a partially written table.
+ *
+ * cdb tables are written in process, other types are handed over
+ * to postmap. Tables can be built from entries already held in memory,
+ * skipping the read and parse of the source.
+ */
+class PostfixTable
+{
+public:
+	enum Result
+	{
+		Unchanged,	/**< Source not changed, table left as is */
+		Rebuilt,	/**< Table rebuilt from source */
+		Failed,		/**< Failed to rebuild table, see StrError */
+	};
+
+	/**
+	 * @brief PostfixTable
+	 * @param source text map file
+	 * @param type postfix table type, i.e. hash, lmdb or cdb
+	 * @param postmap postmap command used for other types than cdb
+	 */
+	PostfixTable(const string& source, const string& type = "hash", const string& postmap = "/usr/sbin/postmap");
+
+	/**
+	 * @brief Update rebuild table if source changed
+	 * @param force rebuild regardless of checksum
+	 * @return result of update
+	 */
+	Result Update(bool force = false);
+
+	/**
+	 * @brief Update rebuild table from entries, if they changed, without
+	 *        reading the source. Entries must match the source content
+	 *        and are compiled in process for cdb tables.
+	 * @param entries key, value pairs
+	 * @param force rebuild regardless of checksum
+	 * @return result of update
+	 */
+	Result Update(const list<pair<string,string>>& entries, bool force = false);
+
+	/**
+	 * @brief TablePath
+	 * @return path of compiled table
+	 */
+	string TablePath() const;
+
+	string StrError() const;
+
+	/**
+	 * @brief Parse parse postfix text map
+	 * @param content text map
+	 * @return key, value pairs in file order. Duplicate keys kept,
+	 *         first one wins upon lookup
+	 */
+	static list<pair<string,string>> Parse(const string& content);
+
+	/**
+	 * @brief WriteCDB write entries as a constant database, the format
+	 *        used by postfix cdb tables
+	 * @param path destination file
+	 * @param entries key, value pairs. Only first of duplicate keys stored
+	 * @param like file to copy owner and mode from, mode 0644 if empty
+	 */
+	static void WriteCDB(const string& path, const list<pair<string,string>>& entries, const string& like = "");
+
+	/**
+	 * @brief Checksum content checksum (64 bit FNV-1a)
+	 * @param content
+	 * @return hex formatted checksum
+	 */
+	static string Checksum(const string& content);
+
+	virtual ~PostfixTable() = default;
+
+private:
+	/*
+	 * Run build unless sum matches the one stored for the table,
+	 * store sum upon successful build
+	 */
+	Result update(const string& sum, bool force, const function<bool()>& build);
+	bool compile(const list<pair<string,string>>& entries);
+	bool postmap(const string& content);
+
+	string source;
+	string type;
+	string postmapcmd;
+	string error;
+};
+
+} // Namespace KGP
+
+#endif // POSTFIXTABLE_H
@@ -0,0 +1,235 @@
+#include "RemoteAccounts.h"
+
+#include <libutils/Logger.h>
+
+using namespace Utils;
+using namespace OPI;
+
+namespace KGP
+{
+
+RemoteAccounts::RemoteAccounts(const string &path):
+	path(path), mtime({0, 0}), size(0), inode(0), dirty(false)
+{
+}
+
+list<map<string, string> > RemoteAccounts::GetAccounts(const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	list<map<string,string>> ret;
+	if( user.empty() )
+	{
+		for( const auto& account: this->accounts )
+		{
+			ret.push_back( account.second );
+		}
+		return ret;
+	}
+
+	const auto& ua = this->useraccounts.find( user );
+	if( ua != this->useraccounts.end() )
+	{
+		for( const Key& key: ua->second )
+		{
+			ret.push_back( this->accounts[key] );
+		}
+	}
+
+	return ret;
+}
+
+map<string, string> RemoteAccounts::GetAccount(const string &host, const string &identity)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	const auto& account = this->accounts.find( Key( host, identity ) );
+
+	return account != this->accounts.end() ? account->second : map<string,string>();
+}
+
+void RemoteAccounts::AddAccount(const string &email, const string &host, const string &identity, const string &password, const string &user, bool ssl)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->cfg->AddAccount( email, host, identity, password, user, ssl );
+	this->dirty = true;
+	this->indexAccount( host, identity );
+}
+
+void RemoteAccounts::UpdateAccount(const string &email, const string &host, const string &identity, const string &password, const string &user, bool ssl)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->cfg->UpdateAccount( email, host, identity, password, user, ssl );
+	this->dirty = true;
+	this->unindexAccount( host, identity );
+	this->indexAccount( host, identity );
+}
+
+void RemoteAccounts::DeleteAccount(const string &host, const string &identity)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	this->cfg->DeleteAccount( host, identity );
+	this->dirty = true;
+	this->unindexAccount( host, identity );
+}
+
+size_t RemoteAccounts::DeleteUserAccounts(const string &user)
+{
+	lock_guard<mutex> l( this->lock );
+	this->revalidate();
+
+	const auto& ua = this->useraccounts.find( user );
+	if( ua == this->useraccounts.end() )
+	{
+		return 0;
+	}
+
+	// Copy, unindex modifies set
+	const set<Key> remove = ua->second;
+	for( const Key& key: remove )
+	{
+		this->cfg->DeleteAccount( key.first, key.second );
+		this->unindexAccount( key.first, key.second );
+	}
+	this->dirty = true;
+
+	return remove.size();
+}
+
+bool RemoteAccounts::Write()
+{
+	lock_guard<mutex> l( this->lock );
+
+	if( ! this->dirty )
+	{
+		return false;
+	}
+
+	this->cfg->WriteConfig();
+	this->dirty = false;
+
+	// Our own write, no need to reread
+	struct stat st{};
+	if( stat( this->path.c_str(), &st ) == 0 )
+	{
+		this->inode = st.st_ino;
+		this->size = st.st_size;
+		this->mtime = st.st_mtim;
+	}
+
+	return true;
+}
+
+bool RemoteAccounts::Dirty()
+{
+	lock_guard<mutex> l( this->lock );
+
+	return this->dirty;
+}
+
+void RemoteAccounts::Discard()
+{
+	lock_guard<mutex> l( this->lock );
+
+	this->cfg.reset();
+	this->accounts.clear();
+	this->useraccounts.clear();
+	this->dirty = false;
+}
+
+void RemoteAccounts::revalidate()
+{
+	if( this->cfg && ( this->dirty || ! this->changedOnDisk() ) )
+	{
+		// Unwritten local changes wins over changes on disk
+		return;
+	}
+
+	this->load();
+}
+
+bool RemoteAccounts::changedOnDisk()
+{
+	struct stat st{};
+
+	if( stat( this->path.c_str(), &st ) != 0 )
+	{
+		return this->inode != 0;
+	}
+
+	return st.st_ino != this->inode ||
+			st.st_size != this->size ||
+			st.st_mtim.tv_sec != this->mtime.tv_sec ||
+			st.st_mtim.tv_nsec != this->mtime.tv_nsec;
+}
+
+void RemoteAccounts::load()
+{
+	logg << Logger::Debug << "Loading fetchmail configuration" << lend;
+
+	// Stat before read, a change during read is then caught next time
+	struct stat st{};
+	if( stat( this->path.c_str(), &st ) == 0 )
+	{
+		this->inode = st.st_ino;
+		this->size = st.st_size;
+		this->mtime = st.st_mtim;
+	}
+	else
+	{
+		this->inode = 0;
+		this->size = 0;
+		this->mtime = {0, 0};
+	}
+
+	this->cfg = std::make_unique<FetchmailConfig>( this->path );
+	this->accounts.clear();
+	this->useraccounts.clear();
+	this->dirty = false;
+
+	for( auto& account: this->cfg->GetAccounts() )
+	{
+		const Key key( account["host"], account["identity"] );
+		this->useraccounts[account["username"]].insert( key );
+		this->accounts[key] = std::move( account );
+	}
+}
+
+void RemoteAccounts::indexAccount(const string &host, const string &identity)
+{
+	const Key key( host, identity );
+	map<string,string> account = this->cfg->GetAccount( host, identity );
+
+	this->useraccounts[account["username"]].insert( key );
+	this->accounts[key] = std::move( account );
+}
+
+void RemoteAccounts::unindexAccount(const string &host, const string &identity)
+{
+	const auto& account = this->accounts.find( Key( host, identity ) );
+	if( account == this->accounts.end() )
+	{
+		return;
+	}
+
+	const auto& ua = this->useraccounts.find( account->second["username"] );
+	if( ua != this->useraccounts.end() )
+	{
+		ua->second.erase( account->first );
+		if( ua->second.empty() )
+		{
+			this->useraccounts.erase( ua );
+		}
+	}
+	this->accounts.erase( account );
+}
+
+} // Namespace KGP
@@ -0,0 +1,121 @@
+#ifndef REMOTEACCOUNTS_H
+#define REMOTEACCOUNTS_H
+
+#include <libopi/FetchmailConfig.h>
+
+#include <sys/stat.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief The RemoteAccounts class, in memory copy of the fetchmail
+ *        configuration
+ *
+ * Keeps one parsed fetchmail configuration with the accounts indexed
+ * on host and identity as well as on local user. The configuration is
+ * only reread when the file changed on disk and there are no unwritten
+ * changes.
+ *
+ * Changes are kept in memory until Write, several changes, i.e. all
+ * accounts of a user being deleted, thus results in one write.
+ */
+class RemoteAccounts
+{
+public:
+	/**
+	 * @brief RemoteAccounts
+	 * @param path fetchmail configuration file
+	 */
+	RemoteAccounts(const string& path);
+
+	/**
+	 * @brief GetAccounts
+	 * @param user local user, all accounts if empty
+	 * @return accounts, key value as FetchmailConfig
+	 */
+	list<map<string,string>> GetAccounts(const string& user = "");
+
+	/**
+	 * @brief GetAccount
+	 * @param host
+	 * @param identity
+	 * @return account, empty if not found
+	 */
+	map<string,string> GetAccount(const string& host, const string& identity);
+
+	void AddAccount(const string& email, const string& host, const string& identity,
+					const string& password, const string& user, bool ssl);
+	void UpdateAccount(const string& email, const string& host, const string& identity,
+					const string& password, const string& user, bool ssl);
+	void DeleteAccount(const string& host, const string& identity);
+
+	/**
+	 * @brief DeleteUserAccounts delete all accounts of local user
+	 * @param user
+	 * @return number of accounts deleted
+	 */
+	size_t DeleteUserAccounts(const string& user);
+
+	/**
+	 * @brief Write write configuration if changed
+	 * @return true if written
+	 */
+	bool Write();
+
+	/**
+	 * @brief Dirty
+	 * @return true if there are changes not yet written
+	 */
+	bool Dirty();
+
+	/**
+	 * @brief Discard drop unwritten changes, configuration is
+	 *        reread upon next access
+	 */
+	void Discard();
+
+	virtual ~RemoteAccounts() = default;
+
+private:
+	typedef pair<string,string> Key;	// host, identity
+
+	/*
+	 * Reload if changed on disk, called with lock held
+	 */
+	void revalidate();
+	bool changedOnDisk();
+	void load();
+
+	void indexAccount(const string& host, const string& identity);
+	void unindexAccount(const string& host, const string& identity);
+
+	string path;
+	struct timespec mtime;
+	off_t size;
+	ino_t inode;
+
+	unique_ptr<OPI::FetchmailConfig> cfg;
+	bool dirty;
+
+	map<Key, map<string,string>> accounts;
+
+	// local user -> accounts
+	map<string, set<Key>> useraccounts;
+
+	mutex lock;
+};
+
+} // Namespace KGP
+
+#endif // REMOTEACCOUNTS_H
@@ -0,0 +1,1190 @@
+#include "RemoteFetcher.h"
+
+#include <libutils/Exceptions.h>
+#include <libutils/FileUtils.h>
+#include <libutils/Logger.h>
+
+#include <nlohmann/json.hpp>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using namespace Utils;
+using json = nlohmann::json;
+
+namespace KGP
+{
+
+// Thrown when worker is told to stop while waiting on server
+class FetchStopped: public runtime_error
+{
+public:
+	FetchStopped(): runtime_error("Fetch stopped") {}
+};
+
+/*
+ * Parse unsigned decimal number, data from server or config is not
+ * trusted, all of it has to be a number
+ */
+static bool parseNumber(const string& s, unsigned long& value)
+{
+	if( s.empty() || s.find_first_not_of( "0123456789" ) != string::npos )
+	{
+		return false;
+	}
+
+	errno = 0;
+	value = strtoul( s.c_str(), nullptr, 10 );
+
+	return errno == 0;
+}
+
+/*
+ * Credentials are sent inline, a line break would let them
+ * inject protocol commands
+ */
+static void checkCredential(const string& value, const string& what)
+{
+	if( value.find_first_of( string( "\r\n\0", 3 ) ) != string::npos )
+	{
+		throw runtime_error( "Invalid character in account " + what );
+	}
+}
+
+/*
+ * Line oriented connection, plain or TLS, where every wait can be
+ * interrupted using a stop descriptor
+ */
+class MailConnection
+{
+public:
+	enum Result
+	{
+		Ok,
+		Timeout,
+		Stopped,
+	};
+
+	MailConnection(int stopfd): stopfd(stopfd), fd(-1), ctx(nullptr), ssl(nullptr)
+	{
+	}
+
+	void Connect(const string& host, uint16_t port, bool usessl)
+	{
+		struct addrinfo hints{};
+		struct addrinfo* res = nullptr;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		int err = getaddrinfo( host.c_str(), to_string( port ).c_str(), &hints, &res );
+		if( err != 0 )
+		{
+			throw runtime_error( "Failed to resolve " + host + ": " + gai_strerror( err ) );
+		}
+
+		for( struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next )
+		{
+			this->fd = socket( ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol );
+			if( this->fd < 0 )
+			{
+				continue;
+			}
+			if( connect( this->fd, ai->ai_addr, ai->ai_addrlen ) == 0 )
+			{
+				break;
+			}
+			close( this->fd );
+			this->fd = -1;
+		}
+		freeaddrinfo( res );
+
+		if( this->fd < 0 )
+		{
+			throw runtime_error( "Failed to connect to " + host );
+		}
+
+		if( usessl )
+		{
+			this->startTLS( host );
+		}
+	}
+
+	void WriteLine(const string& line)
+	{
+		string data = line + "\r\n";
+		size_t written = 0;
+
+		while( written < data.size() )
+		{
+			ssize_t res = this->ssl ?
+						SSL_write( this->ssl, data.data() + written, data.size() - written ) :
+						send( this->fd, data.data() + written, data.size() - written, MSG_NOSIGNAL );
+			if( res <= 0 )
+			{
+				throw runtime_error( "Failed to write to server" );
+			}
+			written += res;
+		}
+	}
+
+	Result ReadLine(string& line, chrono::seconds timeout)
+	{
+		size_t pos;
+		while( ( pos = this->buffer.find( "\r\n" ) ) == string::npos )
+		{
+			Result res = this->fill( timeout );
+			if( res != Ok )
+			{
+				return res;
+			}
+		}
+
+		line = this->buffer.substr( 0, pos );
+		this->buffer.erase( 0, pos + 2 );
+
+		return Ok;
+	}
+
+	Result ReadBytes(size_t count, string& data, chrono::seconds timeout)
+	{
+		while( this->buffer.size() < count )
+		{
+			Result res = this->fill( timeout );
+			if( res != Ok )
+			{
+				return res;
+			}
+		}
+
+		data = this->buffer.substr( 0, count );
+		this->buffer.erase( 0, count );
+
+		return Ok;
+	}
+
+	virtual ~MailConnection()
+	{
+		if( this->ssl )
+		{
+			SSL_shutdown( this->ssl );
+			SSL_free( this->ssl );
+		}
+		if( this->ctx )
+		{
+			SSL_CTX_free( this->ctx );
+		}
+		if( this->fd >= 0 )
+		{
+			close( this->fd );
+		}
+	}
+
+private:
+
+	void startTLS(const string& host)
+	{
+		this->ctx = SSL_CTX_new( TLS_client_method() );
+		if( ! this->ctx )
+		{
+			throw runtime_error( "Failed to create TLS context" );
+		}
+		SSL_CTX_set_default_verify_paths( this->ctx );
+		SSL_CTX_set_verify( this->ctx, SSL_VERIFY_PEER, nullptr );
+
+		this->ssl = SSL_new( this->ctx );
+		SSL_set_fd( this->ssl, this->fd );
+		SSL_set_tlsext_host_name( this->ssl, host.c_str() );
+		SSL_set1_host( this->ssl, host.c_str() );
+
+		if( SSL_connect( this->ssl ) != 1 )
+		{
+			char err[256];
+			ERR_error_string_n( ERR_get_error(), err, sizeof( err ) );
+			throw runtime_error( "TLS handshake with " + host + " failed: " + err );
+		}
+	}
+
+	Result fill(chrono::seconds timeout)
+	{
+		char buf[16384];
+
+		// Data already decrypted by TLS layer does not show up in poll
+		if( ! this->ssl || SSL_pending( this->ssl ) == 0 )
+		{
+			struct pollfd fds[2] =
+			{
+				{ this->fd, POLLIN, 0 },
+				{ this->stopfd, POLLIN, 0 },
+			};
+
+			int res = poll( fds, 2, chrono::duration_cast<chrono::milliseconds>( timeout ).count() );
+			if( res < 0 && errno != EINTR )
+			{
+				throw runtime_error( string( "Failed to wait on server: " ) + strerror( errno ) );
+			}
+			if( res == 0 )
+			{
+				return Timeout;
+			}
+			if( fds[1].revents & POLLIN )
+			{
+				return Stopped;
+			}
+			if( res < 0 )
+			{
+				return Timeout;
+			}
+		}
+
+		ssize_t len = this->ssl ?
+					SSL_read( this->ssl, buf, sizeof( buf ) ) :
+					recv( this->fd, buf, sizeof( buf ), 0 );
+		if( len <= 0 )
+		{
+			throw runtime_error( "Connection closed by server" );
+		}
+		this->buffer.append( buf, len );
+
+		return Ok;
+	}
+
+	int stopfd;
+	int fd;
+	SSL_CTX* ctx;
+	SSL* ssl;
+	string buffer;
+};
+
+/*
+ * Minimal IMAP client, enough to fetch and remove messages from INBOX
+ */
+class IMAPClient
+{
+public:
+	struct Response
+	{
+		string status;				// OK, NO or BAD
+		list<string> untagged;		// Untagged responses, literals stripped
+		list<string> literals;		// Literal data in order of appearance
+	};
+
+	IMAPClient(MailConnection& conn, chrono::seconds timeout): conn(conn), timeout(timeout), tag(0)
+	{
+	}
+
+	void Greeting()
+	{
+		string line;
+		this->readLine( line );
+		if( line.compare( 0, 4, "* OK" ) != 0 )
+		{
+			throw runtime_error( "Unexpected IMAP greeting: " + line );
+		}
+	}
+
+	Response Command(const string& command, bool check = true)
+	{
+		const string t = this->nextTag();
+		this->conn.WriteLine( t + " " + command );
+
+		Response resp = this->readResponse( t );
+		if( check && resp.status != "OK" )
+		{
+			// Do not leak credentials into log
+			const string cmd = command.substr( 0, command.find(' ') );
+			throw runtime_error( "IMAP " + cmd + " failed: " + resp.status );
+		}
+		return resp;
+	}
+
+	/*
+	 * Wait for server to report new mail using IDLE
+	 * returns Ok if there is new mail or on timeout, Stopped if stop requested
+	 */
+	MailConnection::Result Idle(chrono::seconds idletime)
+	{
+		const string t = this->nextTag();
+		this->conn.WriteLine( t + " IDLE" );
+
+		string line;
+		this->readLine( line );
+		if( line.compare( 0, 1, "+" ) != 0 )
+		{
+			throw runtime_error( "IDLE not accepted: " + line );
+		}
+
+		const auto deadline = chrono::steady_clock::now() + idletime;
+		MailConnection::Result res = MailConnection::Timeout;
+		while( true )
+		{
+			auto left = chrono::duration_cast<chrono::seconds>( deadline - chrono::steady_clock::now() );
+			if( left.count() <= 0 )
+			{
+				break;
+			}
+
+			res = this->conn.ReadLine( line, left );
+			if( res != MailConnection::Ok ||
+					line.find( " EXISTS" ) != string::npos || line.find( " RECENT" ) != string::npos )
+			{
+				break;
+			}
+		}
+
+		if( res == MailConnection::Stopped )
+		{
+			return res;
+		}
+
+		this->conn.WriteLine( "DONE" );
+		this->readResponse( t );
+
+		return MailConnection::Ok;
+	}
+
+	static string Quote(const string& arg)
+	{
+		// Not representable in a quoted string
+		if( arg.find_first_of( string( "\r\n\0", 3 ) ) != string::npos )
+		{
+			throw runtime_error( "Invalid character in IMAP argument" );
+		}
+
+		string ret = "\"";
+		for( char c: arg )
+		{
+			if( c == '"' || c == '\\' )
+			{
+				ret += '\\';
+			}
+			ret += c;
+		}
+		return ret + "\"";
+	}
+
+private:
+	string nextTag()
+	{
+		return "k" + to_string( ++this->tag );
+	}
+
+	void readLine(string& line)
+	{
+		MailConnection::Result res = this->conn.ReadLine( line, this->timeout );
+		if( res == MailConnection::Timeout )
+		{
+			throw runtime_error( "Timeout waiting for IMAP server" );
+		}
+		if( res == MailConnection::Stopped )
+		{
+			throw FetchStopped();
+		}
+	}
+
+	Response readResponse(const string& t)
+	{
+		Response resp;
+		string line;
+
+		while( true )
+		{
+			this->readLine( line );
+
+			// Literal, {size} at end of line followed by size bytes
+			while( line.size() > 2 && line.back() == '}' )
+			{
+				size_t start = line.rfind( '{' );
+				if( start == string::npos )
+				{
+					break;
+				}
+				unsigned long size = 0;
+				if( ! parseNumber( line.substr( start + 1, line.size() - start - 2 ), size ) )
+				{
+					throw runtime_error( "Malformed IMAP literal: " + line );
+				}
+
+				string data;
+				MailConnection::Result res = this->conn.ReadBytes( size, data, this->timeout );
+				if( res == MailConnection::Stopped )
+				{
+					throw FetchStopped();
+				}
+				if( res == MailConnection::Timeout )
+				{
+					throw runtime_error( "Timeout reading IMAP literal" );
+				}
+				resp.literals.push_back( std::move( data ) );
+
+				string rest;
+				this->readLine( rest );
+				line = line.substr( 0, start ) + rest;
+			}
+
+			if( line.compare( 0, t.size() + 1, t + " " ) == 0 )
+			{
+				size_t end = line.find( ' ', t.size() + 1 );
+				resp.status = line.substr( t.size() + 1, end == string::npos ? string::npos : end - t.size() - 1 );
+				return resp;
+			}
+
+			resp.untagged.push_back( line );
+		}
+	}
+
+	MailConnection& conn;
+	chrono::seconds timeout;
+	unsigned int tag;
+};
+
+// Timeout for regular command responses
+static constexpr chrono::seconds CommandTimeout{120};
+
+bool RemoteFetcher::Account::operator==(const RemoteFetcher::Account &other) const
+{
+	return this->email == other.email &&
+			this->host == other.host &&
+			this->identity == other.identity &&
+			this->password == other.password &&
+			this->user == other.user &&
+			this->ssl == other.ssl &&
+			this->protocol == other.protocol &&
+			this->port == other.port;
+}
+
+RemoteFetcher::RemoteFetcher(RemoteFetcher::Delivery delivery, const string &schedulefile):
+	IdleTimeout(chrono::minutes(25)),
+	PollMin(chrono::minutes(1)),
+	PollMax(chrono::minutes(30)),
+	RetryMin(chrono::seconds(30)),
+	MaxConcurrent(4),
+	delivery(delivery ? delivery : RemoteFetcher::SendmailDelivery),
+	schedulefile(schedulefile),
+	activeslots(0)
+{
+	this->loadSchedules();
+}
+
+void RemoteFetcher::SetAccounts(const list<RemoteFetcher::Account> &accounts)
+{
+	lock_guard<mutex> cl( this->changelock );
+
+	map<string, WorkerPtr> stale;
+	list<Account> start;
+	{
+		lock_guard<mutex> l( this->lock );
+
+		map<string, WorkerPtr> keep;
+		for( const Account& account: accounts )
+		{
+			const string k = RemoteFetcher::key( account.host, account.identity );
+
+			auto it = this->workers.find( k );
+			if( it != this->workers.end() && it->second->account == account )
+			{
+				keep[k] = it->second;
+				this->workers.erase( it );
+				continue;
+			}
+			start.push_back( account );
+		}
+
+		// Whatever is left is removed or changed
+		stale = std::move( this->workers );
+		this->workers = std::move( keep );
+	}
+
+	/*
+	 * Old workers are stopped before replacements start, never two
+	 * workers fetching the same account. Joined without lock held,
+	 * a worker might need it to finish.
+	 */
+	for( auto& worker: stale )
+	{
+		logg << Logger::Debug << "Stopping fetcher for " << worker.first << lend;
+		this->stopWorker( worker.second );
+	}
+
+	lock_guard<mutex> l( this->lock );
+
+	for( const Account& account: start )
+	{
+		const string k = RemoteFetcher::key( account.host, account.identity );
+
+		WorkerPtr worker = make_shared<Worker>();
+		worker->account = account;
+		worker->stopfd = eventfd( 0, EFD_CLOEXEC );
+		worker->stopping = false;
+		worker->hasslot = false;
+		worker->idle = false;
+		worker->fetched = 0;
+		worker->schedule = { this->PollMin, 0, 0, 0 };
+		worker->state = "starting";
+
+		{
+			// Continue where a previous worker left off
+			lock_guard<mutex> sl( this->schedlock );
+			auto sit = this->schedules.find( k );
+			if( sit != this->schedules.end() )
+			{
+				worker->schedule = sit->second;
+				worker->schedule.interval = max( this->PollMin, min( worker->schedule.interval, this->PollMax ) );
+			}
+		}
+
+		if( worker->stopfd < 0 )
+		{
+			logg << Logger::Error << "Failed to create stop event for " << k << lend;
+			continue;
+		}
+
+		worker->thr = thread( &RemoteFetcher::run, this, worker );
+		this->workers[k] = worker;
+	}
+
+	// Forget schedules of removed accounts
+	bool pruned = false;
+	{
+		lock_guard<mutex> sl( this->schedlock );
+		for( auto it = this->schedules.begin(); it != this->schedules.end(); )
+		{
+			if( this->workers.find( it->first ) == this->workers.end() )
+			{
+				it = this->schedules.erase( it );
+				pruned = true;
+			}
+			else
+			{
+				it++;
+			}
+		}
+	}
+	if( pruned )
+	{
+		this->saveSchedules();
+	}
+}
+
+void RemoteFetcher::Stop()
+{
+	lock_guard<mutex> cl( this->changelock );
+
+	map<string, WorkerPtr> stop;
+	{
+		lock_guard<mutex> l( this->lock );
+		stop = std::move( this->workers );
+		this->workers.clear();
+	}
+
+	for( auto& worker: stop )
+	{
+		this->stopWorker( worker.second );
+	}
+}
+
+map<string, string> RemoteFetcher::GetStatus(const string &host, const string &identity)
+{
+	WorkerPtr worker;
+	{
+		lock_guard<mutex> l( this->lock );
+
+		auto it = this->workers.find( RemoteFetcher::key( host, identity ) );
+		if( it == this->workers.end() )
+		{
+			return {};
+		}
+		worker = it->second;
+	}
+
+	lock_guard<mutex> l( worker->lock );
+
+	return {
+		{ "state",		worker->state },
+		{ "error",		worker->error },
+		{ "push",		worker->idle ? "true" : "false" },
+		{ "fetched",	to_string( worker->fetched ) },
+		{ "lastmail",	to_string( worker->schedule.lastmail ) },
+		{ "interval",	to_string( worker->schedule.interval.count() ) },
+		{ "nextpoll",	to_string( worker->schedule.nextpoll ) },
+		{ "polls",		to_string( worker->schedule.polls ) },
+	};
+}
+
+RemoteFetcher::Account RemoteFetcher::FromConfig(const map<string, string> &account)
+{
+	auto value = [&account](const string& key, const string& def = "")
+	{
+		auto it = account.find( key );
+		return it != account.end() ? it->second : def;
+	};
+
+	Account ret;
+	ret.email = value( "email" );
+	ret.host = value( "host" );
+	ret.identity = value( "identity" );
+	ret.password = value( "password" );
+	ret.user = value( "username" );
+	ret.ssl = value( "ssl" ) == "true";
+	ret.protocol = value( "protocol", "imap" );
+
+	unsigned long port = 0;
+	if( ! parseNumber( value( "port", "0" ), port ) || port > 65535 )
+	{
+		throw runtime_error( "Invalid port for account " + ret.identity + "@" + ret.host );
+	}
+	ret.port = static_cast<uint16_t>( port );
+
+	transform( ret.protocol.begin(), ret.protocol.end(), ret.protocol.begin(), ::tolower );
+
+	return ret;
+}
+
+bool RemoteFetcher::SendmailDelivery(const RemoteFetcher::Account &account, const string &message)
+{
+	// No allocations in child, process is multithreaded
+	const string rcpt = account.user + "@localdomain";
+
+	/*
+	 * Socket rather than pipe, send with MSG_NOSIGNAL then reports
+	 * a sendmail exiting early as EPIPE instead of raising SIGPIPE
+	 */
+	int fds[2];
+	if( socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds ) != 0 )
+	{
+		return false;
+	}
+
+	pid_t pid = fork();
+	if( pid < 0 )
+	{
+		close( fds[0] );
+		close( fds[1] );
+		return false;
+	}
+
+	if( pid == 0 )
+	{
+		dup2( fds[0], STDIN_FILENO );
+		execl( "/usr/sbin/sendmail", "sendmail", "-i", "--", rcpt.c_str(), nullptr );
+		_exit( 127 );
+	}
+
+	close( fds[0] );
+
+	// Local mail uses plain newlines
+	string data;
+	data.reserve( message.size() );
+	for( size_t i = 0; i < message.size(); i++ )
+	{
+		if( message[i] == '\r' && i + 1 < message.size() && message[i+1] == '\n' )
+		{
+			continue;
+		}
+		data += message[i];
+	}
+
+	bool ok = true;
+	size_t written = 0;
+	while( written < data.size() )
+	{
+		ssize_t res = send( fds[1], data.data() + written, data.size() - written, MSG_NOSIGNAL );
+		if( res < 0 && errno == EINTR )
+		{
+			continue;
+		}
+		if( res <= 0 )
+		{
+			if( res < 0 && errno == EPIPE )
+			{
+				logg << Logger::Notice << "Sendmail exited before reading message" << lend;
+			}
+			ok = false;
+			break;
+		}
+		written += res;
+	}
+	close( fds[1] );
+
+	int status = 0;
+	if( waitpid( pid, &status, 0 ) != pid )
+	{
+		return false;
+	}
+
+	return ok && WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+}
+
+RemoteFetcher::~RemoteFetcher()
+{
+	this->Stop();
+}
+
+void RemoteFetcher::run(const WorkerPtr& worker)
+{
+	const Account& account = worker->account;
+	const string name = account.identity + "@" + account.host;
+	chrono::seconds retry = this->RetryMin;
+
+	logg << Logger::Debug << "Starting " << account.protocol << " fetcher for " << name << lend;
+
+	while( true )
+	{
+		try
+		{
+			bool stopped = account.protocol == "pop3" ?
+						this->pop3Session( worker ) :
+						this->imapSession( worker );
+			this->releaseSlot( worker );
+			if( stopped )
+			{
+				break;
+			}
+			retry = this->RetryMin;
+			continue;
+		}
+		catch( FetchStopped& )
+		{
+			this->releaseSlot( worker );
+			break;
+		}
+		catch( std::exception& err )
+		{
+			// Not only runtime errors, malformed server data must not end the process
+			this->releaseSlot( worker );
+			logg << Logger::Notice << "Fetching mail for " << name << " failed: " << err.what() << lend;
+
+			lock_guard<mutex> l( worker->lock );
+			worker->error = err.what();
+			worker->state = "waiting";
+			worker->idle = false;
+		}
+
+		// Wait before reconnecting, unless stopped
+		struct pollfd pfd = { worker->stopfd, POLLIN, 0 };
+		if( poll( &pfd, 1, chrono::duration_cast<chrono::milliseconds>( retry ).count() ) > 0 )
+		{
+			break;
+		}
+		retry = min( retry * 2, this->PollMax );
+	}
+
+	this->setState( worker, "stopped" );
+	logg << Logger::Debug << "Fetcher for " << name << " stopped" << lend;
+}
+
+bool RemoteFetcher::imapSession(const WorkerPtr& worker)
+{
+	const Account& account = worker->account;
+
+	this->acquireSlot( worker );
+	this->setState( worker, "connecting" );
+
+	MailConnection conn( worker->stopfd );
+	conn.Connect( account.host, account.port != 0 ? account.port : ( account.ssl ? 993 : 143 ), account.ssl );
+
+	IMAPClient imap( conn, CommandTimeout );
+	imap.Greeting();
+
+	bool idle = false;
+	for( const string& line: imap.Command( "CAPABILITY" ).untagged )
+	{
+		if( line.find( " IDLE" ) != string::npos )
+		{
+			idle = true;
+		}
+	}
+
+	checkCredential( account.identity, "identity" );
+	checkCredential( account.password, "password" );
+	imap.Command( "LOGIN " + IMAPClient::Quote( account.identity ) + " " + IMAPClient::Quote( account.password ) );
+	imap.Command( "SELECT INBOX" );
+
+	{
+		lock_guard<mutex> l( worker->lock );
+		worker->idle = idle;
+		worker->error = "";
+	}
+
+	while( true )
+	{
+		this->acquireSlot( worker );
+		this->setState( worker, "fetching" );
+
+		list<string> uids;
+		for( const string& line: imap.Command( "UID SEARCH UNSEEN" ).untagged )
+		{
+			if( line.compare( 0, 9, "* SEARCH " ) == 0 )
+			{
+				size_t pos = 9;
+				while( pos < line.size() )
+				{
+					size_t end = line.find( ' ', pos );
+					uids.push_back( line.substr( pos, end == string::npos ? string::npos : end - pos ) );
+					pos = end == string::npos ? line.size() : end + 1;
+				}
+			}
+		}
+
+		bool expunge = false;
+		for( const string& uid: uids )
+		{
+			IMAPClient::Response resp = imap.Command( "UID FETCH " + uid + " BODY.PEEK[]" );
+			if( resp.literals.empty() )
+			{
+				continue;
+			}
+
+			if( this->deliver( worker, resp.literals.front() ) )
+			{
+				imap.Command( "UID STORE " + uid + " +FLAGS.SILENT (\\Seen \\Deleted)" );
+				expunge = true;
+			}
+		}
+
+		if( expunge )
+		{
+			imap.Command( "EXPUNGE" );
+		}
+
+		this->releaseSlot( worker );
+		this->reschedule( worker, uids.size(), idle );
+
+		MailConnection::Result res;
+		if( idle )
+		{
+			this->setState( worker, "idle" );
+			res = imap.Idle( this->IdleTimeout );
+		}
+		else
+		{
+			this->setState( worker, "waiting" );
+
+			// Poll, keeping connection alive with NOOP
+			time_t nextpoll;
+			{
+				lock_guard<mutex> l( worker->lock );
+				nextpoll = worker->schedule.nextpoll;
+			}
+			res = RemoteFetcher::waitUntil( worker, nextpoll ) ? MailConnection::Stopped : MailConnection::Ok;
+			if( res == MailConnection::Ok )
+			{
+				imap.Command( "NOOP" );
+			}
+		}
+
+		if( res == MailConnection::Stopped )
+		{
+			try
+			{
+				conn.WriteLine( "k0 LOGOUT" );
+			}
+			catch( std::runtime_error& )
+			{
+			}
+			return true;
+		}
+	}
+}
+
+bool RemoteFetcher::pop3Session(const WorkerPtr& worker)
+{
+	const Account& account = worker->account;
+
+	// Honour schedule, also when picked up from a previous run
+	time_t nextpoll;
+	{
+		lock_guard<mutex> l( worker->lock );
+		nextpoll = worker->schedule.nextpoll;
+	}
+	this->setState( worker, "waiting" );
+	if( RemoteFetcher::waitUntil( worker, nextpoll ) )
+	{
+		return true;
+	}
+
+	this->acquireSlot( worker );
+	this->setState( worker, "connecting" );
+
+	MailConnection conn( worker->stopfd );
+	conn.Connect( account.host, account.port != 0 ? account.port : ( account.ssl ? 995 : 110 ), account.ssl );
+
+	auto readLine = [&conn]()
+	{
+		string line;
+		MailConnection::Result res = conn.ReadLine( line, CommandTimeout );
+		if( res == MailConnection::Stopped )
+		{
+			throw FetchStopped();
+		}
+		if( res == MailConnection::Timeout )
+		{
+			throw runtime_error( "Timeout waiting for POP3 server" );
+		}
+		return line;
+	};
+
+	auto command = [&conn, &readLine](const string& cmd)
+	{
+		if( cmd != "" )
+		{
+			conn.WriteLine( cmd );
+		}
+		string line = readLine();
+		if( line.compare( 0, 3, "+OK" ) != 0 )
+		{
+			throw runtime_error( "POP3 " + cmd.substr( 0, cmd.find(' ') ) + " failed: " + line );
+		}
+		return line;
+	};
+
+	checkCredential( account.identity, "identity" );
+	checkCredential( account.password, "password" );
+
+	command( "" );
+	command( "USER " + account.identity );
+	command( "PASS " + account.password );
+
+	{
+		lock_guard<mutex> l( worker->lock );
+		worker->error = "";
+	}
+
+	this->setState( worker, "fetching" );
+
+	// STAT gives +OK count size
+	string stat = command( "STAT" );
+	unsigned long count = 0;
+	if( stat.size() < 4 || ! parseNumber( stat.substr( 4, stat.find( ' ', 4 ) - 4 ), count ) )
+	{
+		throw runtime_error( "Malformed POP3 STAT response: " + stat );
+	}
+
+	for( unsigned long i = 1; i <= count; i++ )
+	{
+		command( "RETR " + to_string( i ) );
+
+		string message;
+		string line;
+		while( ( line = readLine() ) != "." )
+		{
+			// Undo dot stuffing
+			if( line.compare( 0, 2, ".." ) == 0 )
+			{
+				line.erase( 0, 1 );
+			}
+			message += line + "\r\n";
+		}
+
+		if( this->deliver( worker, message ) )
+		{
+			command( "DELE " + to_string( i ) );
+		}
+	}
+
+	// Changes are committed upon QUIT
+	command( "QUIT" );
+
+	this->releaseSlot( worker );
+	this->reschedule( worker, count, false );
+	this->setState( worker, "waiting" );
+
+	return false;
+}
+
+void RemoteFetcher::setState(const WorkerPtr& worker, const string &state)
+{
+	lock_guard<mutex> l( worker->lock );
+	worker->state = state;
+}
+
+bool RemoteFetcher::deliver(const WorkerPtr& worker, const string &message)
+{
+	if( ! this->delivery( worker->account, message ) )
+	{
+		logg << Logger::Error << "Failed to deliver mail to " << worker->account.user << lend;
+		return false;
+	}
+
+	lock_guard<mutex> l( worker->lock );
+	worker->fetched++;
+	worker->schedule.lastmail = time( nullptr );
+
+	return true;
+}
+
+void RemoteFetcher::acquireSlot(const WorkerPtr &worker)
+{
+	if( worker->hasslot )
+	{
+		return;
+	}
+
+	unique_lock<mutex> l( this->slotlock );
+	const unsigned int maxslots = max( this->MaxConcurrent, 1U );
+	if( this->activeslots >= maxslots )
+	{
+		this->setState( worker, "queued" );
+	}
+	this->slotcond.wait( l, [this, &worker, maxslots]()
+	{
+		return worker->stopping || this->activeslots < maxslots;
+	});
+
+	if( worker->stopping )
+	{
+		throw FetchStopped();
+	}
+
+	this->activeslots++;
+	worker->hasslot = true;
+}
+
+void RemoteFetcher::releaseSlot(const WorkerPtr &worker)
+{
+	if( ! worker->hasslot )
+	{
+		return;
+	}
+
+	{
+		lock_guard<mutex> l( this->slotlock );
+		this->activeslots--;
+		worker->hasslot = false;
+	}
+	this->slotcond.notify_one();
+}
+
+void RemoteFetcher::reschedule(const WorkerPtr &worker, size_t messages, bool push)
+{
+	const time_t now = time( nullptr );
+	Schedule schedule;
+	{
+		lock_guard<mutex> l( worker->lock );
+		Schedule& s = worker->schedule;
+
+		// Busy accounts are polled more often, quiet ones back off
+		s.interval = messages > 0 ? max( s.interval / 2, this->PollMin ) : min( s.interval * 2, this->PollMax );
+		s.nextpoll = now + ( push ? this->IdleTimeout : s.interval ).count();
+		s.polls++;
+		schedule = s;
+	}
+
+	{
+		lock_guard<mutex> l( this->schedlock );
+		this->schedules[RemoteFetcher::key( worker->account.host, worker->account.identity )] = schedule;
+	}
+
+	this->saveSchedules();
+}
+
+bool RemoteFetcher::waitUntil(const WorkerPtr &worker, time_t when)
+{
+	const time_t now = time( nullptr );
+	const int64_t wait = when > now ? static_cast<int64_t>( when - now ) * 1000 : 0;
+
+	struct pollfd pfd = { worker->stopfd, POLLIN, 0 };
+	return poll( &pfd, 1, static_cast<int>( min<int64_t>( wait, INT32_MAX ) ) ) > 0;
+}
+
+void RemoteFetcher::loadSchedules()
+{
+	if( this->schedulefile == "" || ! File::FileExists( this->schedulefile ) )
+	{
+		return;
+	}
+
+	try
+	{
+		json jsched = json::parse( File::GetContentAsString( this->schedulefile, true ) );
+
+		lock_guard<mutex> l( this->schedlock );
+		for( const auto& entry: jsched.items() )
+		{
+			const json& v = entry.value();
+			this->schedules[entry.key()] = { chrono::seconds( v[0].get<int64_t>() ), v[1].get<int64_t>(), v[2].get<int64_t>(), v[3].get<uint64_t>() };
+		}
+	}
+	catch( std::exception& err )
+	{
+		logg << Logger::Notice << "Ignoring malformed fetch schedule: " << err.what() << lend;
+		lock_guard<mutex> l( this->schedlock );
+		this->schedules.clear();
+	}
+}
+
+void RemoteFetcher::saveSchedules()
+{
+	if( this->schedulefile == "" )
+	{
+		return;
+	}
+
+	// Serialize writers, file is small and only written after a poll
+	lock_guard<mutex> l( this->schedlock );
+
+	json jsched = json::object();
+	for( const auto& entry: this->schedules )
+	{
+		const Schedule& s = entry.second;
+		jsched[entry.first] = { s.interval.count(), static_cast<int64_t>( s.nextpoll ), static_cast<int64_t>( s.lastmail ), s.polls };
+	}
+
+	try
+	{
+		const string tmp = this->schedulefile + ".tmp";
+		File::Write( tmp, jsched.dump(), File::UserRW );
+		if( rename( tmp.c_str(), this->schedulefile.c_str() ) != 0 )
+		{
+			throw ErrnoException("Failed to replace fetch schedule");
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		logg << Logger::Notice << "Failed to persist fetch schedule: " << err.what() << lend;
+	}
+}
+
+void RemoteFetcher::stopWorker(const WorkerPtr& worker)
+{
+	{
+		// Wake worker if waiting for a fetch slot
+		lock_guard<mutex> l( this->slotlock );
+		worker->stopping = true;
+	}
+	this->slotcond.notify_all();
+
+	uint64_t val = 1;
+	if( write( worker->stopfd, &val, sizeof( val ) ) != sizeof( val ) )
+	{
+		logg << Logger::Error << "Failed to signal fetcher to stop" << lend;
+	}
+
+	if( worker->thr.joinable() )
+	{
+		worker->thr.join();
+	}
+	close( worker->stopfd );
+}
+
+string RemoteFetcher::key(const string &host, const string &identity)
+{
+	return identity + "@" + host;
+}
+
+} // Namespace KGP
@@ -0,0 +1,200 @@
+#ifndef REMOTEFETCHER_H
+#define REMOTEFETCHER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief The RemoteFetcher class, retrieves mail from remote accounts
+ *
+ * Built in alternative to fetchmail. Each account gets a worker keeping
+ * a persistent connection to the provider.
+ *
+ * IMAP accounts on servers supporting IDLE are notified by the server
+ * when new mail arrives and the mail is fetched right away. Other IMAP
+ * servers and POP3 accounts are polled on a per account schedule. The
+ * poll interval is halved each time mail is found and doubled each
+ * time the account is empty, within PollMin and PollMax. Schedules are
+ * persisted, if a schedule file is given, thus quiet accounts stay
+ * quiet across restarts.
+ *
+ * At most MaxConcurrent accounts are fetching at any time, idling
+ * connections do not count.
+ *
+ * Fetched mail is handed to the local mail system and then removed
+ * from the remote server, as fetchmail does by default.
+ */
+class RemoteFetcher
+{
+public:
+
+	struct Account
+	{
+		string email;
+		string host;
+		string identity;
+		string password;
+		string user;		/**< Local user to deliver to */
+		bool ssl;
+		string protocol;	/**< imap or pop3 */
+		uint16_t port;		/**< 0 for protocol default */
+
+		bool operator==(const Account& other) const;
+	};
+
+	/**
+	 * @brief Delivery function delivering one message to local user
+	 *        should return true if message was accepted
+	 */
+	typedef function<bool(const Account& account, const string& message)> Delivery;
+
+	/**
+	 * @brief RemoteFetcher
+	 * @param delivery delivery function, default hands mail to sendmail
+	 * @param schedulefile file to persist poll schedules in, none if empty
+	 */
+	RemoteFetcher(Delivery delivery = nullptr, const string& schedulefile = "");
+
+	/**
+	 * @brief SetAccounts set accounts to fetch mail for. Workers for
+	 *        unchanged accounts are left running.
+	 * @param accounts
+	 */
+	void SetAccounts(const list<Account>& accounts);
+
+	/**
+	 * @brief Stop stop all workers
+	 */
+	void Stop();
+
+	/**
+	 * @brief GetStatus get state of account worker
+	 * @param host
+	 * @param identity
+	 * @return map with key value, empty if account not handled
+	 */
+	map<string,string> GetStatus(const string& host, const string& identity);
+
+	/**
+	 * @brief FromConfig translate fetchmail account info into account
+	 * @param account as retrieved from FetchmailConfig
+	 * @return
+	 */
+	static Account FromConfig(const map<string,string>& account);
+
+	/**
+	 * @brief SendmailDelivery deliver message to local user using sendmail
+	 */
+	static bool SendmailDelivery(const Account& account, const string& message);
+
+	// Tunables, change before adding accounts
+	chrono::seconds IdleTimeout;	/**< Reissue IDLE this often, RFC 2177 says below 29 min */
+	chrono::seconds PollMin;		/**< Poll interval when mail arrives */
+	chrono::seconds PollMax;		/**< Max interval when account is quiet */
+	chrono::seconds RetryMin;		/**< Reconnect delay after failure, doubles up to PollMax */
+	unsigned int MaxConcurrent;		/**< Max number of accounts fetching at the same time */
+
+	virtual ~RemoteFetcher();
+
+private:
+
+	struct Schedule
+	{
+		chrono::seconds interval;	// Current poll interval
+		time_t nextpoll;			// Next poll, or IDLE renewal
+		time_t lastmail;			// Last time mail was fetched
+		uint64_t polls;				// Number of polls made
+	};
+
+	struct Worker
+	{
+		Account account;
+		thread thr;
+		int stopfd;
+		atomic<bool> stopping;
+		bool hasslot;	// Only touched by worker thread
+
+		mutex lock;		// Protects status below
+		string state;
+		string error;
+		bool idle;
+		uint64_t fetched;
+		Schedule schedule;
+	};
+
+	typedef shared_ptr<Worker> WorkerPtr;
+
+	void run(const WorkerPtr& worker);
+
+	/*
+	 * Session functions, return true if session ended due to stop request
+	 * upon failure, exception thrown
+	 */
+	bool imapSession(const WorkerPtr& worker);
+	bool pop3Session(const WorkerPtr& worker);
+
+	void setState(const WorkerPtr& worker, const string& state);
+	bool deliver(const WorkerPtr& worker, const string& message);
+
+	/*
+	 * Fetch slots, limits number of concurrently fetching accounts.
+	 * acquire throws if worker is stopped while waiting
+	 */
+	void acquireSlot(const WorkerPtr& worker);
+	void releaseSlot(const WorkerPtr& worker);
+
+	/**
+	 * @brief reschedule update poll schedule after a fetch
+	 * @param worker
+	 * @param messages number of messages fetched
+	 * @param push account uses IDLE
+	 */
+	void reschedule(const WorkerPtr& worker, size_t messages, bool push);
+
+	/**
+	 * @brief waitUntil wait until time or stop
+	 * @return true if stopped
+	 */
+	static bool waitUntil(const WorkerPtr& worker, time_t when);
+
+	void loadSchedules();
+	void saveSchedules();
+
+	/*
+	 * Signal worker to stop and join it, call without lock held
+	 */
+	void stopWorker(const WorkerPtr& worker);
+	static string key(const string& host, const string& identity);
+
+	Delivery delivery;
+
+	string schedulefile;
+	mutex schedlock;
+	map<string, Schedule> schedules;
+
+	mutex slotlock;
+	condition_variable slotcond;
+	unsigned int activeslots;
+
+	mutex changelock;	// Serializes SetAccounts and Stop, never taken by workers
+	mutex lock;			// Protects workers
+	map<string, WorkerPtr> workers;
+};
+
+} // Namespace KGP
+
+#endif // REMOTEFETCHER_H
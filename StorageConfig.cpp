@@ -1,9 +1,11 @@
 #include "StorageConfig.h"
+#include "DeviceIdentity.h"
 
 #include <libutils/Logger.h>
 
 #include <libopi/SysInfo.h>
 #include <libopi/DiskHelper.h>
+#include <libopi/Luks.h>
 
 using namespace Utils;
 using namespace OPI;
@@ -104,6 +106,12 @@ static void initStorageConfig()
 
 		cfg.PutKey("storage", "block_devices", list<string>{ sysinfo.StorageDevice() } );
 
+		string id = DeviceIdentity::DiskIdentity( sysinfo.StorageDevice() );
+		if( id != "" )
+		{
+			cfg.PutKey("storage", "block_ids", list<string>{ id } );
+		}
+
 		if( SysInfo::isOpi() )
 		{
 			cfg.PutKey("storage", "logical", "none" );
@@ -208,14 +216,18 @@ void StorageConfig::PhysicalStorage(Storage::Physical::Type type)
 	case Storage::Physical::Unknown:
 	case Storage::Physical::None:
 		cfg.RemoveKey("storage", "partition_path");
+		cfg.RemoveKey("storage", "partition_id");
 		cfg.RemoveKey("storage", "block_devices");
+		cfg.RemoveKey("storage", "block_ids");
 		break;
 	case Storage::Physical::Partition:
 			cfg.RemoveKey("storage", "block_devices");
+			cfg.RemoveKey("storage", "block_ids");
 		break;
 
 	case Storage::Physical::Block:
 			cfg.RemoveKey("storage", "partition_path");
+			cfg.RemoveKey("storage", "partition_id");
 		break;
 	}
 }
@@ -225,16 +237,65 @@ bool StorageConfig::UsePhysicalStorage(Storage::Physical::Type type)
 	return this->physical.Type() == type;
 }
 
+/*
+ * Locate device using stable identity, fall back on recorded path
+ */
+static string resolveDevice(const string& id, const string& path)
+{
+	string dev = DeviceIdentity::Resolve( id );
+
+	if( dev == "" )
+	{
+		logg << Logger::Notice << "Unable to resolve " << id << " using " << path << lend;
+		return path;
+	}
+
+	if( dev != path )
+	{
+		logg << Logger::Debug << "Device " << id << " now at " << dev << " (was " << path << ")" << lend;
+	}
+
+	return dev;
+}
+
 list<string> StorageConfig::PhysicalDevices()
 {
 	if( this->physical.Type() == Storage::Physical::Partition )
 	{
-		return { this->syscfg.GetKeyAsString("storage","partition_path") };
+		string part = this->syscfg.GetKeyAsString("storage","partition_path");
+
+		if( this->syscfg.HasKey("storage", "partition_id") )
+		{
+			return { resolveDevice( this->syscfg.GetKeyAsString("storage","partition_id"), part ) };
+		}
+
+		return { part };
 	}
 
 	if( this->physical.Type() == Storage::Physical::Block )
 	{
-		return this->syscfg.GetKeyAsStringList("storage","block_devices");
+		list<string> devs = this->syscfg.GetKeyAsStringList("storage","block_devices");
+
+		if( ! this->syscfg.HasKey("storage", "block_ids") )
+		{
+			return devs;
+		}
+
+		list<string> ids = this->syscfg.GetKeyAsStringList("storage","block_ids");
+		if( ids.size() != devs.size() )
+		{
+			logg << Logger::Notice << "Block device identities does not match devices, ignoring" << lend;
+			return devs;
+		}
+
+		list<string> ret;
+		auto dit = devs.begin();
+		for( const auto& id: ids )
+		{
+			ret.emplace_back( resolveDevice( id, *dit++ ) );
+		}
+
+		return ret;
 	}
 
 	return {};
@@ -251,6 +312,18 @@ void StorageConfig::PhysicalStorage(const string &partition)
 
 	cfg.PutKey("storage", "partition_path", partition);
 	cfg.RemoveKey("storage", "block_devices");
+	cfg.RemoveKey("storage", "block_ids");
+
+	string id = DeviceIdentity::PartitionIdentity( partition );
+	if( id != "" )
+	{
+		cfg.PutKey("storage", "partition_id", id);
+	}
+	else
+	{
+		logg << Logger::Notice << "No stable identity found for " << partition << lend;
+		cfg.RemoveKey("storage", "partition_id");
+	}
 }
 
 void StorageConfig::PhysicalStorage(const list<string> &devices)
@@ -264,7 +337,28 @@ void StorageConfig::PhysicalStorage(const list<string> &devices)
 
 	cfg.PutKey("storage", "block_devices", devices);
 	cfg.RemoveKey("storage", "partition_path");
+	cfg.RemoveKey("storage", "partition_id");
+
+	list<string> ids;
+	for( const auto& dev: devices )
+	{
+		string id = DeviceIdentity::DiskIdentity( dev );
+		if( id == "" )
+		{
+			logg << Logger::Notice << "No stable identity found for " << dev << lend;
+			break;
+		}
+		ids.emplace_back( id );
+	}
 
+	if( ids.size() == devices.size() )
+	{
+		cfg.PutKey("storage", "block_ids", ids);
+	}
+	else
+	{
+		cfg.RemoveKey("storage", "block_ids");
+	}
 }
 
 /********************************************************************************************
@@ -428,6 +522,7 @@ void StorageConfig::EncryptionStorage(Storage::Encryption::Type type)
 	case Storage::Encryption::Unknown:
 	{
 		cfg.RemoveKey("storage", "luks_device");
+		cfg.RemoveKey("storage", "luks_id");
 		break;
 	}
 	case Storage::Encryption::LUKS:
@@ -471,6 +566,34 @@ void StorageConfig::EncryptionDefaults()
 	this->EncryptionStorage(Storage::Encryption::LUKS);
 }
 
+void StorageConfig::EncryptionIdentity(const string &device)
+{
+	if( this->encryption.Type() != Storage::Encryption::LUKS )
+	{
+		throw std::runtime_error("Illegal encryption identity when type is "s + this->encryption.Name() );
+	}
+
+	string id = DeviceIdentity::LUKSIdentity( device );
+	if( id == "" )
+	{
+		logg << Logger::Notice << "Unable to get LUKS identity of " << device << lend;
+		return;
+	}
+
+	SysConfig(true).PutKey("storage", "luks_id", id);
+	this->syscfg = SysConfig();
+}
+
+string StorageConfig::EncryptionBackingDevice()
+{
+	if( this->encryption.Type() != Storage::Encryption::LUKS || ! this->syscfg.HasKey("storage", "luks_id") )
+	{
+		return "";
+	}
+
+	return DeviceIdentity::Resolve( this->syscfg.GetKeyAsString("storage", "luks_id") );
+}
+
 
 /********************************************************************************************
  *
@@ -501,7 +624,7 @@ string StorageConfig::StorageDevice()
 	// This device is expected to have one partition that should be used
 	if( this->UsePhysicalStorage( Storage::Physical::Block ) )
 	{
-		list<string> devs = this->syscfg.GetKeyAsStringList("storage", "block_devices");
+		list<string> devs = this->PhysicalDevices();
 		if( devs.size() != 1 )
 		{
 			logg << Logger::Error << "Unable to deterimine storage device. Got " << devs.size() << " disks" << lend;
@@ -514,7 +637,7 @@ string StorageConfig::StorageDevice()
 	//Uses separate partition?
 	if( this->UsePhysicalStorage( Storage::Physical::Partition ) )
 	{
-		return this->syscfg.GetKeyAsString("storage","partition_path");
+		return this->PhysicalDevices().front();
 	}
 
 	logg << Logger::Notice << "Unable to determine final storage device path" << lend;
@@ -533,6 +656,92 @@ void StorageConfig::parseConfig()
 
 }
 
+void StorageConfig::MigrateIdentities()
+{
+	using namespace Storage;
+
+	try
+	{
+		if( this->physical.Type() == Physical::Block &&
+				this->syscfg.HasKey("storage", "block_devices") &&
+				! this->syscfg.HasKey("storage", "block_ids") )
+		{
+			list<string> ids;
+			for( const auto& dev: this->syscfg.GetKeyAsStringList("storage", "block_devices") )
+			{
+				string id = DeviceIdentity::DiskIdentity( dev );
+				if( id == "" )
+				{
+					// Device not present atm, retry later
+					logg << Logger::Notice << "Block device " << dev << " not found, not migrating block devices" << lend;
+					ids.clear();
+					break;
+				}
+				ids.emplace_back( id );
+			}
+
+			if( ! ids.empty() )
+			{
+				logg << Logger::Notice << "Migrate block devices to stable identities" << lend;
+				SysConfig(true).PutKey("storage", "block_ids", ids);
+				this->syscfg = SysConfig();
+			}
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		logg << Logger::Notice << "Failed to migrate block device identities: " << err.what() << lend;
+	}
+
+	try
+	{
+		if( this->physical.Type() == Physical::Partition &&
+				this->syscfg.HasKey("storage", "partition_path") &&
+				! this->syscfg.HasKey("storage", "partition_id") )
+		{
+			string id = DeviceIdentity::PartitionIdentity( this->syscfg.GetKeyAsString("storage", "partition_path") );
+			if( id != "" )
+			{
+				logg << Logger::Notice << "Migrate partition to stable identity" << lend;
+				SysConfig(true).PutKey("storage", "partition_id", id);
+				this->syscfg = SysConfig();
+			}
+			else
+			{
+				logg << Logger::Notice << "Partition not found, not migrating partition" << lend;
+			}
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		logg << Logger::Notice << "Failed to migrate partition identity: " << err.what() << lend;
+	}
+
+	try
+	{
+		// LUKS on top of LVM is found through the fixed lvm device path
+		if( this->encryption.Type() == Encryption::LUKS &&
+				this->logical.Type() == Logical::None &&
+				! this->syscfg.HasKey("storage", "luks_id") )
+		{
+			list<string> pdevs = this->PhysicalDevices();
+			if( pdevs.size() == 1 )
+			{
+				string dev = this->physical.Type() == Physical::Block ? DiskHelper::PartitionName( pdevs.front() ) : pdevs.front();
+				if( Luks::isLuks( dev ) )
+				{
+					logg << Logger::Notice << "Migrate LUKS device to stable identity" << lend;
+					this->EncryptionIdentity( dev );
+				}
+			}
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		logg << Logger::Notice << "Failed to migrate LUKS identity: " << err.what() << lend;
+	}
+}
+
 bool StorageConfig::encryptionValid()
 {
 	using namespace Storage;
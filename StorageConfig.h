@@ -322,6 +322,8 @@ public:
 
 	/**
 	 * @brief PhysicalDevices get physical devices used by storage
+	 *        Devices are located using their stable identity if recorded
+	 *        falling back on the stored device path otherwise.
 	 * @return list with strings describing each device
 	 */
 	list<string> PhysicalDevices();
@@ -435,6 +437,20 @@ public:
 	 */
 	void EncryptionDefaults();
 
+	/**
+	 * @brief EncryptionIdentity record stable identity (LUKS UUID) of
+	 *        device holding the encrypted container
+	 * @param device device LUKS was formatted upon
+	 */
+	void EncryptionIdentity(const string& device);
+
+	/**
+	 * @brief EncryptionBackingDevice get device holding encrypted container
+	 *        using recorded identity
+	 * @return device path or empty string if not recorded or not present
+	 */
+	string EncryptionBackingDevice();
+
 	/**
 	 * @brief StorageDevice get top storage device depending upon config
 	 * @return device path to top storage device or empty string if unable
@@ -443,6 +459,15 @@ public:
 	string StorageDevice();
 
 
+	/**
+	 * @brief MigrateIdentities add stable device identities to
+	 *        configs only recording device paths. Writes sysconfig,
+	 *        does nothing once all identities are recorded. Each
+	 *        identity is migrated on its own, devices not present
+	 *        are retried next time.
+	 */
+	void MigrateIdentities();
+
 	virtual ~StorageConfig() = default;
 
 private:
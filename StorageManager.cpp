@@ -5,14 +5,23 @@
 #include <libutils/FileUtils.h>
 #include <libutils/Logger.h>
 #include <libutils/Constants.h>
+#include <libutils/Process.h>
 
 #include <libopi/LVM.h>
 #include <libopi/Luks.h>
 #include <libopi/SysInfo.h>
 #include <libopi/SysConfig.h>
 #include <libopi/DiskHelper.h>
+#include <libopi/ServiceHelper.h>
 
 #include <algorithm>
+#include <numeric>
+#include <fstream>
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/wait.h>
 
 using namespace Utils;
 using namespace Utils::Constants;
@@ -31,10 +40,82 @@ StorageManager &StorageManager::Instance()
 
 StorageManager::StorageManager():
 	dosyncstorage(false),
-	initialized(false)
+	initialized(false),
+	alignment(0)
 {
 }
 
+// What DiskHelper, LVM and cryptsetup align to by default
+constexpr uint64_t DefaultAlignment = 1024 * 1024;
+// Don't trust hints giving an alignment larger than this
+constexpr uint64_t MaxAlignment = 64 * 1024 * 1024;
+constexpr uint64_t SectorSize = 512;
+
+static uint64_t readSysValue(const string& path)
+{
+	uint64_t val = 0;
+	ifstream in( path );
+
+	if( in.is_open() )
+	{
+		in >> val;
+	}
+
+	return in.fail() ? 0 : val;
+}
+
+/**
+ * @brief deviceAlignment work out preferred alignment of data on device
+ *
+ *        Combines discard granularity, optimal io size and, for SD/eMMC,
+ *        the erase block size reported by the kernel.
+ *
+ * @param device device path, whole disk or partition
+ * @return alignment in bytes, never less than DefaultAlignment
+ */
+static uint64_t deviceAlignment(const string& device)
+{
+	string name = File::GetFileName( File::RealPath( device ) );
+	string sysdev = "/sys/class/block/" + name;
+
+	// Queue attributes only available on whole disk
+	if( ! File::DirExists( sysdev + "/queue" ) )
+	{
+		sysdev += "/..";
+	}
+
+	const list<string> hints =
+	{
+		sysdev + "/queue/discard_granularity",
+		sysdev + "/queue/optimal_io_size",
+		sysdev + "/queue/minimum_io_size",
+		sysdev + "/device/preferred_erase_size",
+	};
+
+	uint64_t align = DefaultAlignment;
+	for( const auto& hint: hints )
+	{
+		uint64_t val = readSysValue( hint );
+
+		if( val == 0 || align % val == 0 )
+		{
+			continue;
+		}
+
+		uint64_t lcm = std::lcm( align, val );
+		if( lcm > MaxAlignment )
+		{
+			logg << Logger::Notice << "Ignoring unreasonable alignment hint " << hint << " (" << val << ")" << lend;
+			continue;
+		}
+		align = lcm;
+	}
+
+	logg << Logger::Debug << "Alignment for " << device << " is " << align << " bytes" << lend;
+
+	return align;
+}
+
 
 static bool checkOnce(const string& path)
 {
@@ -133,7 +214,14 @@ bool StorageManager::partitionDisks(const list<string>& devs)
 			}
 
 			logg << Logger::Debug << "Partition: " << pv << lend;
-			DiskHelper::PartitionDevice(File::RealPath(pv));
+			if( this->alignment > DefaultAlignment )
+			{
+				this->partitionAligned( File::RealPath(pv) );
+			}
+			else
+			{
+				DiskHelper::PartitionDevice(File::RealPath(pv));
+			}
 		}
 
 	}
@@ -216,6 +304,51 @@ void StorageManager::umountDevice()
 	DiskHelper::Umount( this->DevicePath() );
 }
 
+shared_future<bool> StorageManager::OpenAsync(const string &password, const string &destination)
+{
+	lock_guard<mutex> lock( this->readylock );
+
+	this->ready = std::async( std::launch::async, [this, password, destination]()
+	{
+		ScopedLog log("Storage bring up");
+
+		if( this->storageConfig.UsePhysicalStorage( Storage::Physical::None ) )
+		{
+			// Storage resides on OS partition, always available
+			return true;
+		}
+
+		try
+		{
+			return this->Open( password ) && this->mountDevice( destination );
+		}
+		catch( std::runtime_error& err )
+		{
+			logg << Logger::Error << "Storage bring up failed: " << err.what() << lend;
+			this->setError( "Unable to bring up storage" );
+		}
+		return false;
+	}).share();
+
+	return this->ready;
+}
+
+bool StorageManager::WaitReady()
+{
+	shared_future<bool> r;
+	{
+		lock_guard<mutex> lock( this->readylock );
+		r = this->ready;
+	}
+
+	if( ! r.valid() )
+	{
+		return true;
+	}
+
+	return r.get();
+}
+
 bool StorageManager::Initialize(const string& password)
 {
 	using namespace Storage;
@@ -232,68 +365,315 @@ bool StorageManager::Initialize(const string& password)
 		return true;
 	}
 
+	this->storageConfig.MigrateIdentities();
+
 	this->encryptionpassword = password;
 
 	if ( ! this->initialized )
 	{
 		logg << Logger::Debug << "Device not initialized, starting initialization"<<lend;
 
-		const map<StorageType, std::function<bool()>> smap =
+		if( ! this->setupDevice() )
 		{
-			{ {Physical::Partition,	Logical::None,	Encryption::None}, [this](){ return this->InitPNNHandler();} },
-			{ {Physical::Partition,	Logical::LVM,	Encryption::None}, [this](){ return this->InitPLNHandler();} },
-			{ {Physical::Partition,	Logical::None,	Encryption::LUKS}, [this](){ return this->InitPNLHandler();} },
-			{ {Physical::Partition,	Logical::LVM,	Encryption::LUKS}, [this](){ return this->InitPLLHandler();} },
-			{ {Physical::Block,		Logical::None,	Encryption::None}, [this](){ return this->InitBNNHandler();} },
-			{ {Physical::Block,		Logical::LVM,	Encryption::None}, [this](){ return this->InitBLNHandler();} },
-			{ {Physical::Block,		Logical::None,	Encryption::LUKS}, [this](){ return this->InitBNLHandler();} },
-			{ {Physical::Block,		Logical::LVM,	Encryption::LUKS}, [this](){ return this->InitBLLHandler();} },
-		};
+			return false;
+		}
 
-		// Workout setup scenario
-		Storage::StorageType stype = make_tuple(
-					this->storageConfig.PhysicalStorage().Type(),
-					this->storageConfig.LogicalStorage().Type(),
-					this->storageConfig.EncryptionStorage().Type());
+		this->initialized = true;
+	}
 
-		logg << Logger::Debug << "Current storage config,"
-			<< " Physical: "<<this->storageConfig.PhysicalStorage().Name()
-			<< " Logical: " << this->storageConfig.LogicalStorage().Name()
-			<< " Encryption: " << this->storageConfig.EncryptionStorage().Name() << lend;
+	return this->setupStorageArea();
+}
 
-		const auto& setupselection = smap.find(stype);
+/*
+ * Setup device stack, partitions, lvm, luks and filesystem, according to config
+ */
+bool StorageManager::setupDevice()
+{
+	using namespace Storage;
 
-		if( setupselection == smap.end() )
+	const map<StorageType, std::function<bool()>> smap =
+	{
+		{ {Physical::Partition,	Logical::None,	Encryption::None}, [this](){ return this->InitPNNHandler();} },
+		{ {Physical::Partition,	Logical::LVM,	Encryption::None}, [this](){ return this->InitPLNHandler();} },
+		{ {Physical::Partition,	Logical::None,	Encryption::LUKS}, [this](){ return this->InitPNLHandler();} },
+		{ {Physical::Partition,	Logical::LVM,	Encryption::LUKS}, [this](){ return this->InitPLLHandler();} },
+		{ {Physical::Block,		Logical::None,	Encryption::None}, [this](){ return this->InitBNNHandler();} },
+		{ {Physical::Block,		Logical::LVM,	Encryption::None}, [this](){ return this->InitBLNHandler();} },
+		{ {Physical::Block,		Logical::None,	Encryption::LUKS}, [this](){ return this->InitBNLHandler();} },
+		{ {Physical::Block,		Logical::LVM,	Encryption::LUKS}, [this](){ return this->InitBLLHandler();} },
+	};
+
+	// Workout setup scenario
+	Storage::StorageType stype = make_tuple(
+				this->storageConfig.PhysicalStorage().Type(),
+				this->storageConfig.LogicalStorage().Type(),
+				this->storageConfig.EncryptionStorage().Type());
+
+	logg << Logger::Debug << "Current storage config,"
+		<< " Physical: "<<this->storageConfig.PhysicalStorage().Name()
+		<< " Logical: " << this->storageConfig.LogicalStorage().Name()
+		<< " Encryption: " << this->storageConfig.EncryptionStorage().Name() << lend;
+
+	const auto& setupselection = smap.find(stype);
+
+	// Largest alignment needed by any of the underlaying devices
+	this->alignment = DefaultAlignment;
+	for( const auto& dev: this->storageConfig.PhysicalDevices() )
+	{
+		try
 		{
-			logg << Logger::Emerg << "Undefined setup configurartion" << lend;
-			return false;
-		}
+			this->alignment = std::max( this->alignment, deviceAlignment( dev ) );
 
-		try {
-			if( ! setupselection->second() )
+			// Can't move an existing partition, but tell if it is off
+			string start = "/sys/class/block/" + File::GetFileName( File::RealPath( dev ) ) + "/start";
+			if( File::FileExists( start ) && ( readSysValue( start ) * SectorSize ) % this->alignment != 0 )
 			{
-				logg << Logger::Error << "Failed to setup storage" << lend;
-				return false;
+				logg << Logger::Notice << "Partition " << dev << " not aligned to " << this->alignment << " bytes" << lend;
 			}
 		}
-		catch ( std::runtime_error& err)
+		catch( std::runtime_error& err )
 		{
-			logg << Logger::Error << "Storage setup failed with exception: " << err.what() << lend;
+			logg << Logger::Notice << "Unable to get alignment for " << dev << ": " << err.what() << lend;
+		}
+	}
+
+	if( setupselection == smap.end() )
+	{
+		logg << Logger::Emerg << "Undefined setup configurartion" << lend;
+		return false;
+	}
+
+	try {
+		if( ! setupselection->second() )
+		{
+			logg << Logger::Error << "Failed to setup storage" << lend;
 			return false;
 		}
+	}
+	catch ( std::runtime_error& err)
+	{
+		logg << Logger::Error << "Storage setup failed with exception: " << err.what() << lend;
+		return false;
+	}
+
+	return true;
+}
+
+// Done copying with services running when last pass moved less than this
+constexpr int64_t MigrationMaxDelta = 32 * 1024 * 1024;
+constexpr int MigrationMaxPasses = 8;
+
+// Single quote argument for the shell
+static string shellQuote(const string& arg)
+{
+	string ret = "'";
+	for( char c: arg )
+	{
+		if( c == '\'' )
+		{
+			ret += "'\\''";
+		}
+		else
+		{
+			ret += c;
+		}
+	}
+	return ret + "'";
+}
+
+int64_t StorageManager::syncPass(const string &source, const string &target, bool final)
+{
+	// Exit status is needed, Process::Exec only tells success
+	const string cmd = "/usr/bin/rsync -aHAX --numeric-ids --delete --stats " + shellQuote( source + "/" ) + " " + shellQuote( target + "/" );
+
+	FILE* pipe = popen( cmd.c_str(), "r" );
+	if( pipe == nullptr )
+	{
+		logg << Logger::Error << "Failed to start copy pass " << source << " -> " << target << lend;
+		return -1;
+	}
+
+	string out;
+	char buf[4096];
+	size_t len;
+	while( ( len = fread( buf, 1, sizeof( buf ), pipe ) ) > 0 )
+	{
+		out.append( buf, len );
+	}
+
+	const int status = pclose( pipe );
+	const int code = status != -1 && WIFEXITED( status ) ? WEXITSTATUS( status ) : -1;
+
+	/*
+	 * With services running files change under rsync, 24 (source files
+	 * vanished) and 23 (partial transfer) are expected and picked up by
+	 * the next pass. The final pass, services stopped, has to be clean.
+	 */
+	if( code != 0 && ( final || ( code != 23 && code != 24 ) ) )
+	{
+		logg << Logger::Error << "Copy pass " << source << " -> " << target << " failed (" << code << ")" << lend;
+		return -1;
+	}
+
+	if( code != 0 )
+	{
+		logg << Logger::Notice << "Copy pass " << source << " -> " << target << " incomplete (" << code << "), retried next pass" << lend;
+	}
+
+	// i.e. "Total transferred file size: 1,234,567 bytes"
+	const string tag = "Total transferred file size: ";
+	size_t pos = out.find( tag );
+	if( pos == string::npos )
+	{
+		logg << Logger::Notice << "Unable to parse copy stats" << lend;
+		return -1;
+	}
+
+	int64_t bytes = 0;
+	for( pos += tag.size(); pos < out.size() && ( isdigit( out[pos] ) || out[pos] == ',' ); pos++ )
+	{
+		if( out[pos] != ',' )
+		{
+			bytes = bytes * 10 + ( out[pos] - '0' );
+		}
+	}
+
+	return bytes;
+}
+
+MigrationResult StorageManager::Migrate(const string &password, const list<string> &services)
+{
+	using namespace std::chrono;
+	ScopedLog log("Storage migration");
 
+	MigrationResult result = {false, 0, 0, milliseconds(0)};
+
+	this->storageConfig = StorageConfig();
+
+	if( this->storageConfig.UsePhysicalStorage( Storage::Physical::None ) )
+	{
+		this->setError( "No storage configured to migrate to" );
+		return result;
+	}
+
+	const string mountpoint = SysConfig().GetKeyAsString("filesystem", "storagemount");
+
+	this->encryptionpassword = password;
+
+	if( ! this->initialized )
+	{
+		if( ! this->setupDevice() )
+		{
+			this->setError( "Failed to setup storage device" );
+			return result;
+		}
 		this->initialized = true;
 	}
 
-	return this->setupStorageArea();
+	// Template sync not wanted, we copy everything below
+	this->dosyncstorage = false;
+
+	const string device = this->DevicePath();
+	try
+	{
+		DiskHelper::Mount( device, TMP_MOUNT );
+	}
+	catch( ErrnoException& err)
+	{
+		logg << Logger::Error << "Failed to mount migration target: " << err.what() << lend;
+		this->setError( "Unable to access storage device" );
+		return result;
+	}
+
+	// Copy while services keep running until changes between passes are small
+	int64_t delta = 0;
+	do
+	{
+		delta = this->syncPass( mountpoint, TMP_MOUNT, false );
+		result.passes++;
+		logg << Logger::Info << "Migration pass " << result.passes << " copied " << delta << " bytes" << lend;
+	} while( delta > MigrationMaxDelta && result.passes < MigrationMaxPasses );
+
+	if( delta < 0 || delta > MigrationMaxDelta )
+	{
+		logg << Logger::Error << "Migration did not converge, aborting" << lend;
+		this->setError( "Storage migration failed, data changing too fast or copy failed" );
+		try
+		{
+			DiskHelper::Umount( device );
+		}
+		catch( ErrnoException& err)
+		{
+			logg << Logger::Error << "Failed to unmount migration target: " << err.what() << lend;
+		}
+		return result;
+	}
+
+	// Final pass with services stopped
+	auto start = steady_clock::now();
+
+	for( const auto& service: services )
+	{
+		if( ! ServiceHelper::Stop( service ) )
+		{
+			logg << Logger::Notice << "Failed to stop " << service << lend;
+		}
+	}
+
+	delta = this->syncPass( mountpoint, TMP_MOUNT, true );
+	result.finaldelta = delta < 0 ? 0 : delta;
+
+	try
+	{
+		DiskHelper::Umount( device );
+		if( delta >= 0 )
+		{
+			DiskHelper::Mount( device, mountpoint );
+			result.success = true;
+		}
+	}
+	catch( ErrnoException& err)
+	{
+		logg << Logger::Error << "Failed to remount storage: " << err.what() << lend;
+	}
+
+	for( auto it = services.rbegin(); it != services.rend(); it++ )
+	{
+		if( ! ServiceHelper::Start( *it ) )
+		{
+			logg << Logger::Notice << "Failed to start " << *it << lend;
+		}
+	}
+
+	result.downtime = duration_cast<milliseconds>( steady_clock::now() - start );
+
+	logg << Logger::Notice << "Migration " << (result.success ? "completed" : "failed")
+		 << " after " << result.passes << " passes, downtime " << result.downtime.count() << " ms"
+		 << " final delta " << result.finaldelta << " bytes" << lend;
+
+	if( ! result.success )
+	{
+		this->setError( "Failed to finalize storage migration" );
+	}
+
+	return result;
 }
 
 bool StorageManager::Open(const string& password)
 {
+	// Configs from older releases only record device paths
+	this->storageConfig.MigrateIdentities();
+
 	if( this->UseLocking() )
 	{
-		// Use lvm or raw blockdevice?
-		string ld = this->UseLogicalStorage() ? this->getLogicalDevice() : DiskHelper::PartitionName(this->getPysicalDevice());
+		// Recorded identity avoids depending on device enumeration
+		string ld = this->storageConfig.EncryptionBackingDevice();
+
+		if( ld == "" )
+		{
+			// Use lvm or raw blockdevice?
+			ld = this->UseLogicalStorage() ? this->getLogicalDevice() : DiskHelper::PartitionName(this->getPysicalDevice());
+		}
 
 		Luks l( ld );
 
@@ -303,7 +683,7 @@ bool StorageManager::Open(const string& password)
 			if ( !l.Open("opi", password) )
 			{
 				logg << Logger::Debug << "Failed to openLUKS volume on "<< ld << lend;
-				this->global_error = "Unable to unlock crypto storage. (Wrong password?)";
+				this->setError( "Unable to unlock crypto storage. (Wrong password?)" );
 				return false;
 			}
 		}
@@ -657,9 +1037,23 @@ size_t StorageManager::Size()
 
 string StorageManager::Error()
 {
+	return this->StrError();
+}
+
+string StorageManager::StrError()
+{
+	lock_guard<mutex> lock( this->errorlock );
+
 	return this->global_error;
 }
 
+void StorageManager::setError(const string &error)
+{
+	lock_guard<mutex> lock( this->errorlock );
+
+	this->global_error = error;
+}
+
 StorageManager::~StorageManager() = default;
 
 bool StorageManager::setupLUKS(const string &path, const string& password)
@@ -667,11 +1061,27 @@ bool StorageManager::setupLUKS(const string &path, const string& password)
 	try
 	{
 		Luks l( Utils::File::RealPath( path ) );
-		l.Format( password );
+
+		if( this->alignment > DefaultAlignment )
+		{
+			if( ! this->formatLUKSAligned( Utils::File::RealPath( path ), password ) )
+			{
+				return false;
+			}
+		}
+		else
+		{
+			l.Format( password );
+		}
+
+		if( ! this->UseLogicalStorage() )
+		{
+			this->storageConfig.EncryptionIdentity( Utils::File::RealPath( path ) );
+		}
 
 		if( ! l.Open("opi", password ) )
 		{
-			this->global_error = "Wrong password";
+			this->setError( "Wrong password" );
 			return false;
 		}
 	}
@@ -693,7 +1103,7 @@ bool StorageManager::unlockLUKS(const string &path, const string& password)
 		logg << Logger::Debug << "Activating LUKS volume"<<lend;
 		if ( !l.Open("opi", password ) )
 		{
-			this->global_error = "Wrong password";
+			this->setError( "Wrong password" );
 			return false;
 		}
 	}
@@ -758,7 +1168,7 @@ bool StorageManager::setupStorageArea()
 	catch( ErrnoException& err)
 	{
 		logg << Logger::Error << "Finalize unlock failed: " << err.what() << lend;
-		this->global_error = "Unable to access storage device";
+		this->setError( "Unable to access storage device" );
 		return false;
 	}
 
@@ -767,6 +1177,11 @@ bool StorageManager::setupStorageArea()
 
 bool StorageManager::CreateLVM(const list<string>& physdevs)
 {
+	if( this->alignment > DefaultAlignment )
+	{
+		return this->createLVMAligned( physdevs );
+	}
+
 	LVM lvm;
 	list<PhysicalVolumePtr> pvs;
 	try
@@ -790,6 +1205,99 @@ bool StorageManager::CreateLVM(const list<string>& physdevs)
 	return true;
 }
 
+/*
+ * Create one partition covering device with start aligned to device geometry
+ */
+void StorageManager::partitionAligned(const string &device)
+{
+	uint64_t start = this->alignment / SectorSize;
+
+	logg << Logger::Debug << "Partition " << device << " starting at sector " << start << lend;
+
+	stringstream cmd;
+	cmd << "echo 'start=" << start << ", type=83' | /sbin/sfdisk -q --wipe always --label dos " << device;
+
+	bool res = false;
+	tie(res, std::ignore) = Process::Exec( cmd.str() );
+	if( ! res )
+	{
+		throw std::runtime_error("Failed to partition " + device);
+	}
+}
+
+/*
+ * LUKS payload aligned to device geometry. Format using cryptsetup
+ * directly since Luks::Format only uses defaults.
+ */
+bool StorageManager::formatLUKSAligned(const string &device, const string &password)
+{
+	char keyfile[] = "/run/kgp-luksXXXXXX";
+	int fd = mkstemp( keyfile );
+	if( fd < 0 )
+	{
+		logg << Logger::Error << "Failed to create keyfile: " << strerror(errno) << lend;
+		return false;
+	}
+
+	bool written = write( fd, password.c_str(), password.size() ) == static_cast<ssize_t>( password.size() );
+	close( fd );
+
+	bool res = false;
+	if( written )
+	{
+		stringstream cmd;
+		cmd << "/sbin/cryptsetup -q luksFormat --align-payload=" << this->alignment / SectorSize
+			<< " " << device << " " << keyfile;
+		tie(res, std::ignore) = Process::Exec( cmd.str() );
+	}
+
+	unlink( keyfile );
+
+	if( ! res )
+	{
+		logg << Logger::Error << "Failed to format LUKS on " << device << lend;
+	}
+
+	return res;
+}
+
+/*
+ * Physical volume data area aligned to device geometry. LVM wrapper
+ * only uses defaults thus setup using lvm tools directly.
+ */
+bool StorageManager::createLVMAligned(const list<string> &physdevs)
+{
+	SysConfig cfg;
+	const string vg = cfg.GetKeyAsString("storage", "lvm_vg");
+	const string lv = cfg.GetKeyAsString("storage", "lvm_lv");
+
+	stringstream devs;
+	for(const auto& pdev : physdevs)
+	{
+		devs << " " << File::RealPath( pdev );
+	}
+
+	const list<string> cmds =
+	{
+		"/sbin/pvcreate -ff -y --dataalignment " + to_string( this->alignment / 1024 ) + "k" + devs.str(),
+		"/sbin/vgcreate -y " + vg + devs.str(),
+		"/sbin/lvcreate -y -l 100%FREE -n " + lv + " " + vg,
+	};
+
+	for( const auto& cmd: cmds )
+	{
+		bool res = false;
+		tie(res, std::ignore) = Process::Exec( cmd );
+		if( ! res )
+		{
+			logg << Logger::Notice << "Create LVM failed: " << cmd << lend;
+			return false;
+		}
+	}
+
+	return true;
+}
+
 bool StorageManager::InitPNNHandler()
 {
 	ScopedLog log("Init Partition|None|None");
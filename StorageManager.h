@@ -3,6 +3,9 @@
 
 #include <string>
 #include <list>
+#include <future>
+#include <mutex>
+#include <chrono>
 
 
 #include "BaseManager.h"
@@ -13,6 +16,17 @@ using namespace std;
 namespace KGP
 {
 
+/**
+ * @brief The MigrationResult struct, outcome of a storage migration
+ */
+struct MigrationResult
+{
+	bool success;					/**< Migration completed and storage mounted */
+	int passes;						/**< Copy passes done while services running */
+	uint64_t finaldelta;			/**< Bytes copied while services stopped */
+	chrono::milliseconds downtime;	/**< Time services were stopped */
+};
+
 class StorageManager: public BaseManager
 {
 private:
@@ -28,6 +42,24 @@ public:
 	 */
 	bool Initialize(const string &password);
 
+	/**
+	 * @brief Migrate move data from OS partition to newly configured storage
+	 *
+	 *        Sets up storage according to current config, copies the
+	 *        content of storagemount to it while services keep running and
+	 *        repeats incremental passes until remaining delta is small.
+	 *        Services are then stopped for a final pass and remount.
+	 *
+	 *        If copying doesn't converge services are never stopped and
+	 *        migration fails.
+	 *
+	 * @param password to use if device requires locking
+	 * @param services services to stop during final pass, stopped in
+	 *        given order and started in reverse order
+	 * @return result of migration
+	 */
+	MigrationResult Migrate(const string& password, const list<string>& services);
+
 	/**
 	 * @brief Open unlock device if it uses locking
 	 * @param password
@@ -38,6 +70,25 @@ public:
 	bool mountDevice(const string& destination);
 	void umountDevice();
 
+	/**
+	 * @brief OpenAsync unlock and mount device in the background
+	 *
+	 *        Other StorageManager operations should not be used
+	 *        until the returned future is ready.
+	 *
+	 * @param password to use if device requires locking
+	 * @param destination where to mount device
+	 * @return future with result of unlock and mount
+	 */
+	shared_future<bool> OpenAsync(const string& password, const string& destination);
+
+	/**
+	 * @brief WaitReady wait for background unlock and mount to complete
+	 * @return true if storage available, i.e. no pending operation or
+	 *         operation succeeded
+	 */
+	bool WaitReady();
+
 	/**
 	 * @brief UseLock tells if device needs some form of unlock
 	 * @return true if unlock needed, false otherwise
@@ -129,6 +180,13 @@ public:
 
 	string Error();
 
+	/**
+	 * @brief StrError
+	 * @return last reported error message, safe to call while
+	 *         storage is brought up in the background
+	 */
+	string StrError();
+
 	virtual ~StorageManager();
 private:
 
@@ -142,8 +200,25 @@ private:
 
 	bool setupStorageArea();
 
+	bool setupDevice();
+
+	/**
+	 * @brief syncPass do one copy pass from storagemount to migration target
+	 * @param final last pass with services stopped, must copy everything
+	 * @return bytes transferred or -1 upon failure
+	 */
+	int64_t syncPass(const string& source, const string& target, bool final);
+
 	bool CreateLVM(const list<string>& physdevs);
 
+	/*
+	 * Setup honoring device alignment, used when device prefers
+	 * a larger alignment than the tools default to.
+	 */
+	void partitionAligned(const string& device);
+	bool formatLUKSAligned(const string& device, const string& password);
+	bool createLVMAligned(const list<string>& physdevs);
+
 	/*
 	 * Functions to handle the different setup options/scenarios
 	 */
@@ -178,9 +253,17 @@ private:
 
 	bool dosyncstorage;
 	bool initialized;
+	uint64_t alignment;	// Preferred data alignment of physical devices in bytes
 
 	string encryptionpassword;
 
+	mutex readylock;
+	shared_future<bool> ready;
+
+	// Protects global_error, also written by background bring up
+	void setError(const string& error);
+	mutex errorlock;
+
 	StorageConfig storageConfig;
 };
 } // Namespace KGP
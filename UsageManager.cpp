@@ -0,0 +1,619 @@
+#include "UsageManager.h"
+#include "StorageManager.h"
+
+#include <libutils/FileUtils.h>
+#include <libutils/Logger.h>
+
+#include <libopi/SysConfig.h>
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <future>
+#include <set>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Default location of size cache, sysconfig usage/cache overrides
+#define USAGECACHE	"/var/opi/etc/usagecache.json"
+
+using namespace Utils;
+using json = nlohmann::json;
+
+namespace KGP
+{
+
+constexpr uint32_t WatchMask = IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR;
+
+// Write back cache at most this often while monitoring
+constexpr int PersistInterval = 10 * 60 * 1000; // ms
+
+static list<pair<string, UsageManager::Area>> areaRoots()
+{
+	const string storage = OPI::SysConfig().GetKeyAsString("filesystem", "storagemount");
+
+	return {
+		{ storage + "/mail/data", UsageManager::Mail },
+		{ storage + "/nextcloud/data", UsageManager::Cloud },
+	};
+}
+
+static string cachePath()
+{
+	OPI::SysConfig cfg;
+
+	return cfg.HasKey("usage", "cache") ? cfg.GetKeyAsString("usage", "cache") : USAGECACHE;
+}
+
+UsageManager::UsageManager(): inotifyfd(-1), stopfd(-1), dirty(false), stopping(false), scanned(false)
+{
+}
+
+UsageManager &UsageManager::Instance()
+{
+	static UsageManager mgr;
+
+	return mgr;
+}
+
+bool UsageManager::Start()
+{
+	ScopedLog log("Usage accounting start");
+
+	if( this->monitorthread.joinable() )
+	{
+		return true;
+	}
+
+	if( ! StorageManager::Instance().WaitReady() )
+	{
+		this->global_error = "Storage not available";
+		return false;
+	}
+
+	this->inotifyfd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	this->stopfd = eventfd( 0, EFD_CLOEXEC );
+
+	if( this->inotifyfd < 0 || this->stopfd < 0 )
+	{
+		this->global_error = string("Failed to setup file monitoring: ") + strerror(errno);
+		logg << Logger::Error << this->global_error << lend;
+		return false;
+	}
+
+	/*
+	 * Answer from last known sizes until the trees are walked, the cache
+	 * can not tell files grown in place since it was written
+	 */
+	map<string, Directory> cache;
+	this->loadCache( cache );
+	{
+		lock_guard<mutex> l( this->lock );
+		this->dirs.clear();
+		this->watches.clear();
+		this->mailtotals.clear();
+		this->cloudtotals.clear();
+
+		for( const auto& dir: cache )
+		{
+			this->dirs[dir.first] = dir.second;
+			if( dir.second.user != "" )
+			{
+				this->totals( dir.second.area )[dir.second.user] += dir.second.size;
+			}
+		}
+	}
+
+	this->stopping = false;
+	this->scanned = false;
+	this->monitorthread = thread( [this]()
+	{
+		this->scan();
+		this->monitor();
+	});
+
+	return true;
+}
+
+bool UsageManager::Scanned()
+{
+	return this->scanned;
+}
+
+void UsageManager::Stop()
+{
+	if( ! this->monitorthread.joinable() )
+	{
+		return;
+	}
+
+	this->stopping = true;
+
+	uint64_t val = 1;
+	if( write( this->stopfd, &val, sizeof(val) ) != sizeof(val) )
+	{
+		logg << Logger::Error << "Failed to signal usage monitor" << lend;
+	}
+	this->monitorthread.join();
+
+	if( this->inotifyfd >= 0 )
+	{
+		close( this->inotifyfd );
+		this->inotifyfd = -1;
+	}
+
+	if( this->stopfd >= 0 )
+	{
+		close( this->stopfd );
+		this->stopfd = -1;
+	}
+
+	this->Persist();
+}
+
+uint64_t UsageManager::Usage(const string &user, UsageManager::Area area)
+{
+	lock_guard<mutex> l( this->lock );
+
+	const auto& tot = this->totals( area );
+	const auto& it = tot.find( user );
+
+	return it != tot.end() ? it->second : 0;
+}
+
+uint64_t UsageManager::Usage(const string &user)
+{
+	return this->Usage( user, Mail ) + this->Usage( user, Cloud );
+}
+
+map<string, uint64_t> UsageManager::Usages()
+{
+	lock_guard<mutex> l( this->lock );
+	map<string, uint64_t> ret;
+
+	for( const auto& u: this->mailtotals )
+	{
+		ret[u.first] += u.second;
+	}
+
+	for( const auto& u: this->cloudtotals )
+	{
+		ret[u.first] += u.second;
+	}
+
+	return ret;
+}
+
+bool UsageManager::Persist()
+{
+	json cache = json::object();
+
+	{
+		lock_guard<mutex> l( this->lock );
+		for( const auto& dir: this->dirs )
+		{
+			cache[dir.first] = { dir.second.area, dir.second.user, dir.second.size };
+		}
+		this->dirty = false;
+	}
+
+	try
+	{
+		const string path = cachePath();
+		const string tmp = path + ".tmp";
+		File::Write( tmp, cache.dump(), File::UserRW );
+		if( rename( tmp.c_str(), path.c_str() ) != 0 )
+		{
+			throw ErrnoException("Failed to replace usage cache");
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		this->global_error = string("Failed to persist usage cache: ") + err.what();
+		logg << Logger::Notice << this->global_error << lend;
+		return false;
+	}
+
+	return true;
+}
+
+UsageManager::~UsageManager()
+{
+	this->Stop();
+}
+
+bool UsageManager::scanDirectory(const string &path, UsageManager::Directory &dir, list<string> *subdirs)
+{
+	int fd = open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+	if( fd < 0 )
+	{
+		return false;
+	}
+
+	struct stat st{};
+	if( fstat( fd, &st ) != 0 )
+	{
+		close( fd );
+		return false;
+	}
+
+	DIR* d = fdopendir( fd );
+	if( d == nullptr )
+	{
+		close( fd );
+		return false;
+	}
+
+	dir.size = 0;
+	struct dirent* ent = nullptr;
+	while( ( ent = readdir( d ) ) != nullptr )
+	{
+		if( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 )
+		{
+			continue;
+		}
+
+		if( fstatat( fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW ) != 0 )
+		{
+			// Removed while scanning
+			continue;
+		}
+
+		if( S_ISDIR( st.st_mode ) )
+		{
+			if( subdirs != nullptr )
+			{
+				subdirs->emplace_back( path + "/" + ent->d_name );
+			}
+		}
+		else
+		{
+			// Count allocated blocks, as du
+			dir.size += static_cast<uint64_t>( st.st_blocks ) * 512;
+		}
+	}
+	closedir( d );
+
+	return true;
+}
+
+map<string, UsageManager::Directory> UsageManager::walk(const string &root, Area area, const string &user)
+{
+	map<string, Directory> tree;
+	list<string> pending = { root };
+
+	while( pending.size() > 0 )
+	{
+		string path = pending.front();
+		pending.pop_front();
+
+		Directory dir = {area, user, 0, -1};
+		if( scanDirectory( path, dir, &pending ) )
+		{
+			tree[path] = dir;
+		}
+	}
+
+	return tree;
+}
+
+void UsageManager::scan()
+{
+	ScopedLog log("Usage accounting scan");
+
+	// One job per user tree
+	struct Job
+	{
+		string root;
+		Area area;
+		string user;
+	};
+	vector<Job> jobs;
+	set<string> found;
+
+	for( const auto& root: areaRoots() )
+	{
+		Directory rdir = {root.second, "", 0, -1};
+		list<string> users;
+		if( ! scanDirectory( root.first, rdir, &users ) )
+		{
+			logg << Logger::Notice << "Unable to read " << root.first << lend;
+			lock_guard<mutex> l( this->lock );
+			this->removeTree( root.first );
+			continue;
+		}
+
+		{
+			lock_guard<mutex> l( this->lock );
+			Directory& d = this->dirs[root.first];
+			d = rdir;
+			this->addWatch( root.first, d );
+		}
+
+		for( const auto& user: users )
+		{
+			jobs.push_back( {user, root.second, File::GetFileName( user )} );
+			found.insert( user );
+		}
+	}
+
+	size_t workers = std::max( 1U, std::min( thread::hardware_concurrency(), static_cast<unsigned>( jobs.size() ) ) );
+	atomic<size_t> next(0);
+	list<future<void>> running;
+
+	for( size_t i = 0; i < workers; i++ )
+	{
+		running.emplace_back( std::async( std::launch::async, [this, &jobs, &next]()
+		{
+			for( size_t job = next++; job < jobs.size() && ! this->stopping; job = next++ )
+			{
+				map<string, Directory> tree = walk( jobs[job].root, jobs[job].area, jobs[job].user );
+				this->replaceTree( jobs[job].root, tree );
+			}
+		}));
+	}
+
+	for( auto& w: running )
+	{
+		w.get();
+	}
+
+	if( this->stopping )
+	{
+		return;
+	}
+
+	// Drop cached users no longer present
+	{
+		lock_guard<mutex> l( this->lock );
+		list<string> stale;
+		for( const auto& root: areaRoots() )
+		{
+			const string prefix = root.first + "/";
+			for( auto it = this->dirs.upper_bound( prefix ); it != this->dirs.end() && it->first.compare( 0, prefix.size(), prefix ) == 0; it++ )
+			{
+				if( it->first.find( '/', prefix.size() ) == string::npos && found.find( it->first ) == found.end() )
+				{
+					stale.push_back( it->first );
+				}
+			}
+		}
+
+		for( const auto& path: stale )
+		{
+			this->removeTree( path );
+		}
+
+		logg << Logger::Info << "Usage accounting tracking " << this->dirs.size() << " directories" << lend;
+	}
+
+	this->scanned = true;
+	this->Persist();
+}
+
+void UsageManager::replaceTree(const string &root, const map<string, UsageManager::Directory> &tree)
+{
+	lock_guard<mutex> l( this->lock );
+
+	this->removeTree( root );
+	for( const auto& dir: tree )
+	{
+		Directory& d = this->dirs[dir.first];
+		d = dir.second;
+		this->addWatch( dir.first, d );
+		if( d.user != "" )
+		{
+			this->totals( d.area )[d.user] += d.size;
+		}
+	}
+	this->dirty = true;
+}
+
+void UsageManager::loadCache(map<string, UsageManager::Directory> &cache)
+{
+	const string path = cachePath();
+	if( ! File::FileExists( path ) )
+	{
+		return;
+	}
+
+	try
+	{
+		json jcache = json::parse( File::GetContentAsString( path, true ) );
+
+		for( const auto& entry: jcache.items() )
+		{
+			const json& v = entry.value();
+			cache[entry.key()] = { static_cast<Area>( v[0].get<int>() ), v[1].get<string>(), v[2].get<uint64_t>(), -1 };
+		}
+	}
+	catch( std::exception& err )
+	{
+		logg << Logger::Notice << "Ignoring malformed usage cache: " << err.what() << lend;
+		cache.clear();
+	}
+}
+
+void UsageManager::addWatch(const string &path, UsageManager::Directory &dir)
+{
+	dir.wd = inotify_add_watch( this->inotifyfd, path.c_str(), WatchMask );
+	if( dir.wd < 0 )
+	{
+		logg << Logger::Notice << "Unable to monitor " << path << ": " << strerror(errno) << lend;
+		return;
+	}
+	this->watches[dir.wd] = path;
+}
+
+// Called with lock held
+void UsageManager::removeTree(const string &path)
+{
+	auto remove = [this](map<string, Directory>::iterator it)
+	{
+		const Directory& d = it->second;
+		if( d.user != "" )
+		{
+			auto& tot = this->totals( d.area );
+			tot[d.user] -= std::min( tot[d.user], d.size );
+			if( tot[d.user] == 0 )
+			{
+				tot.erase( d.user );
+			}
+		}
+		if( d.wd >= 0 )
+		{
+			inotify_rm_watch( this->inotifyfd, d.wd );
+			this->watches.erase( d.wd );
+		}
+		return this->dirs.erase( it );
+	};
+
+	auto it = this->dirs.find( path );
+	if( it != this->dirs.end() )
+	{
+		remove( it );
+	}
+
+	const string prefix = path + "/";
+	it = this->dirs.lower_bound( prefix );
+	while( it != this->dirs.end() && it->first.compare( 0, prefix.size(), prefix ) == 0 )
+	{
+		it = remove( it );
+	}
+	this->dirty = true;
+}
+
+// Called with lock held
+void UsageManager::rescan(const string &path)
+{
+	auto it = this->dirs.find( path );
+	if( it == this->dirs.end() )
+	{
+		return;
+	}
+
+	Directory& d = it->second;
+	uint64_t oldsize = d.size;
+	list<string> subdirs;
+
+	if( ! scanDirectory( path, d, &subdirs ) )
+	{
+		this->removeTree( path );
+		return;
+	}
+
+	if( d.user != "" )
+	{
+		auto& tot = this->totals( d.area );
+		tot[d.user] = tot[d.user] - std::min( tot[d.user], oldsize ) + d.size;
+	}
+
+	// Pick up any new sub directories
+	for( const auto& sub: subdirs )
+	{
+		if( this->dirs.find( sub ) == this->dirs.end() )
+		{
+			string user = d.user != "" ? d.user : File::GetFileName( sub );
+			map<string, Directory> tree = walk( sub, d.area, user );
+			for( auto& dir: tree )
+			{
+				Directory& nd = this->dirs[dir.first];
+				nd = dir.second;
+				this->addWatch( dir.first, nd );
+				this->totals( nd.area )[nd.user] += nd.size;
+			}
+		}
+	}
+
+	this->dirty = true;
+}
+
+void UsageManager::monitor()
+{
+	vector<char> buf( 64 * 1024 );
+	struct pollfd fds[2] = {
+		{ this->inotifyfd, POLLIN, 0 },
+		{ this->stopfd, POLLIN, 0 },
+	};
+
+	int sincepersist = 0;
+	constexpr int timeout = 1000;
+
+	for(;;)
+	{
+		int res = poll( fds, 2, timeout );
+		if( res < 0 && errno != EINTR )
+		{
+			logg << Logger::Error << "Usage monitor failed: " << strerror(errno) << lend;
+			break;
+		}
+
+		if( fds[1].revents & POLLIN )
+		{
+			break;
+		}
+
+		if( res == 0 )
+		{
+			sincepersist += timeout;
+			if( sincepersist >= PersistInterval && this->dirty )
+			{
+				this->Persist();
+				sincepersist = 0;
+			}
+			continue;
+		}
+
+		// Collect changed directories in this batch, rescan each once
+		set<string> changed;
+		ssize_t len = 0;
+		while( ( len = read( this->inotifyfd, buf.data(), buf.size() ) ) > 0 )
+		{
+			lock_guard<mutex> l( this->lock );
+			for( char* p = buf.data(); p < buf.data() + len; )
+			{
+				auto* ev = reinterpret_cast<struct inotify_event*>( p );
+				p += sizeof( struct inotify_event ) + ev->len;
+
+				const auto& w = this->watches.find( ev->wd );
+				if( w == this->watches.end() )
+				{
+					continue;
+				}
+
+				if( ev->mask & IN_DELETE_SELF )
+				{
+					this->removeTree( w->second );
+					continue;
+				}
+
+				if( ( ev->mask & IN_ISDIR ) && ( ev->mask & IN_MOVED_FROM ) && ev->len > 0 )
+				{
+					this->removeTree( w->second + "/" + ev->name );
+				}
+
+				changed.insert( w->second );
+			}
+		}
+
+		lock_guard<mutex> l( this->lock );
+		for( const auto& path: changed )
+		{
+			this->rescan( path );
+		}
+	}
+}
+
+unordered_map<string, uint64_t> &UsageManager::totals(UsageManager::Area area)
+{
+	return area == Mail ? this->mailtotals : this->cloudtotals;
+}
+
+} // Namespace KGP
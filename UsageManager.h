@@ -0,0 +1,160 @@
+#ifndef USAGEMANAGER_H
+#define USAGEMANAGER_H
+
+#include "BaseManager.h"
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+using namespace std;
+
+namespace KGP
+{
+
+/**
+ * @brief The UsageManager class keeps track of per user storage usage
+ *
+ * Usage is accounted for the users mail, storagemount/mail/data/<user>,
+ * and nextcloud files, storagemount/nextcloud/data/<user>.
+ *
+ * Upon start usage is answered from a persisted per directory size
+ * cache, while the trees are walked in parallel in the background.
+ * The cache may be off for files changed while not monitored, each
+ * user tree is replaced by the walked sizes as soon as it is done.
+ * After that the trees are monitored using inotify and only
+ * directories with changes are rescanned. Thus queries are answered
+ * directly from memory.
+ *
+ * The cache is kept in sysconfig usage/cache, default
+ * /var/opi/etc/usagecache.json.
+ */
+class UsageManager: public BaseManager
+{
+private:
+	UsageManager();
+public:
+
+	enum Area
+	{
+		Mail,		/**< storagemount/mail/data */
+		Cloud,		/**< storagemount/nextcloud/data */
+	};
+
+	static UsageManager& Instance();
+
+	/**
+	 * @brief Start load cached usage, start initial scan and monitoring
+	 *        of changes
+	 * @return true upon success
+	 */
+	bool Start();
+
+	/**
+	 * @brief Scanned
+	 * @return true when initial scan is done, usage no longer from cache
+	 */
+	bool Scanned();
+
+	/**
+	 * @brief Stop stop monitoring and persist current usage
+	 */
+	void Stop();
+
+	/**
+	 * @brief Usage get usage of user in specific area
+	 * @param user
+	 * @param area
+	 * @return usage in bytes
+	 */
+	uint64_t Usage(const string& user, Area area);
+
+	/**
+	 * @brief Usage get total usage of user
+	 * @param user
+	 * @return usage in bytes
+	 */
+	uint64_t Usage(const string& user);
+
+	/**
+	 * @brief Usages get total usage of all users
+	 * @return map with user, bytes
+	 */
+	map<string, uint64_t> Usages();
+
+	/**
+	 * @brief Persist write size cache to disk
+	 * @return true upon success
+	 */
+	bool Persist();
+
+	virtual ~UsageManager();
+
+private:
+
+	struct Directory
+	{
+		Area area;
+		string user;		// Empty for area roots
+		uint64_t size;		// Size of files directly in directory
+		int wd;				// inotify watch descriptor or -1
+	};
+
+	/**
+	 * @brief scanDirectory size up files in directory, not recursive
+	 * @param path directory to scan
+	 * @param dir entry to update
+	 * @param subdirs will get sub directories appended
+	 * @return true if directory could be read
+	 */
+	static bool scanDirectory(const string& path, Directory& dir, list<string>* subdirs);
+
+	/**
+	 * @brief walk recursively scan tree
+	 * @param root top of tree
+	 * @param area
+	 * @param user
+	 * @return scanned directories
+	 */
+	static map<string, Directory> walk(const string& root, Area area, const string& user);
+
+	/*
+	 * Initial parallel walk of all trees, run by monitor thread
+	 */
+	void scan();
+
+	void loadCache(map<string, Directory>& cache);
+
+	/*
+	 * Replace root and everything below with tree
+	 */
+	void replaceTree(const string& root, const map<string, Directory>& tree);
+	void removeTree(const string& path);
+	void rescan(const string& path);
+	void addWatch(const string& path, Directory& dir);
+
+	void monitor();
+
+	unordered_map<string, uint64_t>& totals(Area area);
+
+	mutex lock;
+	map<string, Directory> dirs;
+	unordered_map<int, string> watches;
+	unordered_map<string, uint64_t> mailtotals;
+	unordered_map<string, uint64_t> cloudtotals;
+
+	int inotifyfd;
+	int stopfd;
+	atomic<bool> dirty;
+	atomic<bool> stopping;
+	atomic<bool> scanned;
+	thread monitorthread;
+};
+
+} // Namespace KGP
+
+#endif // USAGEMANAGER_H
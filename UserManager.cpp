@@ -3,7 +3,12 @@
 #include "IdentityManager.h"
 
 #include <algorithm>
+#include <atomic>
+#include <exception>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <utility>
 
 #include <libutils/FileUtils.h>
@@ -21,10 +26,11 @@ using namespace std;
 
 namespace KGP {
 
-UserManager::UserManager(SecopPtr authdb):authdb(std::move(authdb))
+UserManager::UserManager(SecopPtr authdb):authdb(std::move(authdb)), ownauthdb(false)
 {
 	if( ! this->authdb )
 	{
+		this->ownauthdb = true;
 		this->authdb = std::make_shared<Secop>();
 		this->authdb->SockAuth();
 	}
@@ -59,10 +65,18 @@ bool UserManager::AddUser(const string &username, const string &password, const
 
 	MailManager &mmgr = MailManager::Instance();
 
+	// Collect all mail changes and write them out once
+	if( ! mmgr.Begin() )
+	{
+		this->global_error = mmgr.StrError();
+		return false;
+	}
+
 	// Set local mail address
 	if( ! mmgr.SetLocalAddress( username ) )
 	{
 		this->global_error = mmgr.StrError();
+		mmgr.Rollback();
 		return false;
 	}
 
@@ -71,6 +85,7 @@ bool UserManager::AddUser(const string &username, const string &password, const
 		if( ! this->authdb->AddGroupMember("admin", username) )
 		{
 			this->global_error = "Failed to make user admin";
+			mmgr.Rollback();
 			return false;
 		}
 
@@ -78,35 +93,35 @@ bool UserManager::AddUser(const string &username, const string &password, const
 		if( !mmgr.AddToAdmin(username))
 		{
 			this->global_error = mmgr.StrError();
+			mmgr.Rollback();
 			return false;
 		}
 	}
 
 	// Add default email
-	IdentityManager &idmgr = IdentityManager::Instance();
-
 	string host, domain;
-	if( idmgr.HasDnsProvider() )
-	{
-		tie(host, domain) = idmgr.GetCurrentDnsName();
-	}
-	else
-	{
-		logg << Logger::Notice << "No dns-provider available, assigning local mail address" << lend;
-		tie(host,domain) = idmgr.GetFqdn();
-	}
+	tie(host, domain) = UserManager::mailHost();
 
 	if( host!="" && domain != "" )
 	{
 		logg << Logger::Debug << "Adding address " << username << "@"<< host << "."<<domain << " to " << username << lend;
-		mmgr.SetAddress(host+"."+domain, username, username);
+		try
+		{
+			mmgr.SetAddress(host+"."+domain, username, username);
+		}
+		catch( std::runtime_error& err )
+		{
+			this->global_error = string("Failed to add mail address: ") + err.what();
+			mmgr.Rollback();
+			return false;
+		}
 	}
 	else
 	{
 		logg << Logger::Notice << "No valid hostname, not adding email address to user " << username << lend;
 	}
 
-	if( !mmgr.Synchronize()	)
+	if( !mmgr.Commit() )
 	{
 		this->global_error = mmgr.StrError();
 		return false;
@@ -125,34 +140,364 @@ bool UserManager::AddUser(const UserPtr& user, const string &password, bool isAd
 	return this->AddUser( user->GetUsername(), password, user->GetDisplayname(), isAdmin, user->GetAttributes());
 }
 
-UserPtr UserManager::GetUser(const string &username)
+vector<UserManager::AddResult> UserManager::AddUsers(const vector<NewUser> &users)
 {
+	vector<AddResult> results( users.size(), AddResult{ "", false, "" } );
+	vector<size_t> todo;
 
-	if( ! this->UserExists( username ) )
+	// One user listing instead of a failing create per existing user
+	const vector<string> existing = this->authdb->GetUsers();
+	set<string> seen( existing.begin(), existing.end() );
+
+	for( size_t i = 0; i < users.size(); i++ )
 	{
-		this->global_error = "User not found";
-		return nullptr;
+		if( users[i].user == nullptr || users[i].user->GetUsername() == "" )
+		{
+			results[i].error = "Missing user object or username";
+			continue;
+		}
+
+		results[i].username = users[i].user->GetUsername();
+		if( ! seen.insert( results[i].username ).second )
+		{
+			results[i].error = "User exists";
+			continue;
+		}
+		todo.push_back( i );
+	}
+
+	this->parallel( todo.size(), [&](const SecopPtr& db, size_t n)
+	{
+		const size_t i = todo[n];
+		try
+		{
+			results[i].success = UserManager::createUser( db, users[i], results[i].error );
+		}
+		catch( std::runtime_error& err )
+		{
+			results[i].error = string("Failed to create user: ") + err.what();
+		}
+	});
+
+	// All mail changes in one transaction
+	MailManager &mmgr = MailManager::Instance();
+	string host, domain;
+	tie(host, domain) = UserManager::mailHost();
+	if( host == "" || domain == "" )
+	{
+		logg << Logger::Notice << "No valid hostname, not adding email addresses to new users" << lend;
+	}
+
+	list<size_t> created;
+	for( size_t i: todo )
+	{
+		if( results[i].success )
+		{
+			created.push_back( i );
+		}
 	}
 
+	if( ! created.empty() )
+	{
+		string mailerror;
+		if( mmgr.Begin() )
+		{
+			for( size_t i: created )
+			{
+				const string& username = results[i].username;
+				try
+				{
+					if( ! mmgr.SetLocalAddress( username ) ||
+							( users[i].isAdmin && ! mmgr.AddToAdmin( username ) ) )
+					{
+						results[i].success = false;
+						results[i].error = mmgr.StrError();
+					}
+					else if( host != "" && domain != "" )
+					{
+						mmgr.SetAddress( host+"."+domain, username, username );
+					}
+				}
+				catch( std::runtime_error& err )
+				{
+					results[i].success = false;
+					results[i].error = string("Failed to add mail address: ") + err.what();
+				}
+
+				if( ! results[i].success )
+				{
+					// Leave nothing of this user behind in the transaction
+					if( users[i].isAdmin && ! mmgr.RemoveFromAdmin( username ) )
+					{
+						logg << Logger::Error << "Failed to remove admin mail aliases for " << username << ": " << mmgr.StrError() << lend;
+					}
+
+					try
+					{
+						mmgr.DeleteUser( username );
+					}
+					catch( std::runtime_error& err )
+					{
+						logg << Logger::Error << "Failed to undo mail changes for " << username << ": " << err.what() << lend;
+					}
+				}
+			}
+
+			// Maps are written upon commit, a failed synchronize is retried in the background
+			if( ! mmgr.Commit( false ) )
+			{
+				mailerror = mmgr.StrError();
+			}
+			else if( ! mmgr.Synchronize() )
+			{
+				logg << Logger::Notice << "Failed to synchronize mail for new users: " << mmgr.StrError() << lend;
+				mmgr.SynchronizeAsync();
+			}
+		}
+		else
+		{
+			mailerror = mmgr.StrError();
+		}
+
+		if( mailerror != "" )
+		{
+			for( size_t i: created )
+			{
+				results[i].success = false;
+				results[i].error = mailerror;
+			}
+		}
+
+		// Users without mail are not usable, remove them from secop
+		for( size_t i: created )
+		{
+			if( results[i].success )
+			{
+				continue;
+			}
+
+			if( users[i].isAdmin && ! this->authdb->RemoveGroupMember( "admin", results[i].username ) )
+			{
+				logg << Logger::Error << "Failed to remove half added user " << results[i].username << " from admin group" << lend;
+			}
+
+			if( ! this->authdb->RemoveUser( results[i].username ) )
+			{
+				results[i].error += " (user left in secop without mail)";
+				logg << Logger::Error << "Failed to remove half added user " << results[i].username << lend;
+			}
+		}
+	}
+
+	size_t failed = 0;
+	for( const AddResult& res: results )
+	{
+		if( ! res.success )
+		{
+			logg << Logger::Notice << "Failed to add user " << res.username << ": " << res.error << lend;
+			failed++;
+		}
+	}
+
+	if( failed > 0 )
+	{
+		this->global_error = "Failed to add " + to_string( failed ) + " of " + to_string( users.size() ) + " users";
+	}
+
+	return results;
+}
+
+bool UserManager::createUser(const SecopPtr &db, const NewUser &nu, string &error)
+{
+	const string username = nu.user->GetUsername();
+
+	if( ! db->CreateUser( username, nu.password, nu.user->GetDisplayname() ) )
+	{
+		error = "Failed to create user (User exists?)";
+		return false;
+	}
+
+	// Remove user again if not completely set up
+	try
+	{
+		for( const pair<const string, string>& attr: nu.user->GetAttributes() )
+		{
+			db->AddAttribute( username, attr.first, attr.second );
+		}
+
+		if( nu.isAdmin && ! db->AddGroupMember( "admin", username ) )
+		{
+			error = "Failed to make user admin";
+		}
+	}
+	catch( std::runtime_error& err )
+	{
+		error = string("Failed to setup user: ") + err.what();
+	}
+
+	if( error != "" )
+	{
+		if( ! db->RemoveUser( username ) )
+		{
+			error += " (user left in secop)";
+		}
+		return false;
+	}
+
+	return true;
+}
+
+UserPtr UserManager::readUser(const SecopPtr &db, const string &username)
+{
 	string displayname;
-	try {
-		displayname = this->authdb->GetAttribute(username, "displayname");
-	} catch (std::runtime_error& err) {
-		logg << Logger::Info << "Missing displayname for "<< username << " ("<< err.what()<<")"<<lend;
+	map<string,string> attributes;
+
+	// Displayname is one of the attributes, no separate request
+	for( const string& attr: db->GetAttributes( username ) )
+	{
+		if( attr == "displayname" )
+		{
+			try {
+				displayname = db->GetAttribute(username, "displayname");
+			} catch (std::runtime_error& err) {
+				logg << Logger::Info << "Missing displayname for "<< username << " ("<< err.what()<<")"<<lend;
+			}
+		}
+		else
+		{
+			attributes[attr] = db->GetAttribute( username, attr );
+		}
 	}
 
-	UserPtr user = std::make_shared<User>(username, displayname );
+	return std::make_shared<User>( username, displayname, attributes );
+}
 
-	vector<string> attrs = this->authdb->GetAttributes( username );
-	for(const string& attr: attrs)
+// Extra secop connections, kept open between calls and shared by all instances
+static mutex poollock;
+static list<SecopPtr> pool;
+
+SecopPtr UserManager::acquireConnection()
+{
 	{
-		if( attr != "displayname" )
+		lock_guard<mutex> l( poollock );
+		if( ! pool.empty() )
 		{
-			user->AddAttribute(attr, this->authdb->GetAttribute(username, attr) );
+			SecopPtr db = pool.front();
+			pool.pop_front();
+			return db;
 		}
 	}
 
-	return user;
+	SecopPtr db = std::make_shared<Secop>();
+	if( ! db->SockAuth() )
+	{
+		throw std::runtime_error("Secop authentication failed");
+	}
+	return db;
+}
+
+void UserManager::releaseConnection(const SecopPtr &db)
+{
+	lock_guard<mutex> l( poollock );
+	if( pool.size() < SecopConnections - 1 )
+	{
+		pool.push_back( db );
+	}
+}
+
+void UserManager::parallel(size_t count, const function<void (const SecopPtr &, size_t)> &job)
+{
+	/*
+	 * Secop handles one request at a time per connection, spread
+	 * jobs over several connections. A provided authdb is used as is.
+	 */
+	atomic<size_t> next( 0 );
+	mutex errlock;
+	exception_ptr error;
+
+	// Returns false if a job failed, connection might be unusable
+	auto worker = [&](const SecopPtr& db)
+	{
+		bool ok = true;
+		for( size_t n = next++; n < count; n = next++ )
+		{
+			try
+			{
+				job( db, n );
+			}
+			catch( ... )
+			{
+				lock_guard<mutex> l( errlock );
+				if( ! error )
+				{
+					error = current_exception();
+				}
+				next = count;
+				ok = false;
+			}
+		}
+		return ok;
+	};
+
+	const size_t connections = this->ownauthdb ? min( SecopConnections, count ) : 1;
+	vector<thread> workers;
+	for( size_t c = 1; c < connections; c++ )
+	{
+		workers.emplace_back( [&worker]()
+		{
+			SecopPtr db;
+			try
+			{
+				db = UserManager::acquireConnection();
+			}
+			catch( std::runtime_error& err )
+			{
+				// Remaining connections take over
+				logg << Logger::Notice << "Failed to open extra secop connection: " << err.what() << lend;
+				return;
+			}
+
+			if( worker( db ) )
+			{
+				UserManager::releaseConnection( db );
+			}
+		});
+	}
+	worker( this->authdb );
+	for( thread& t: workers )
+	{
+		t.join();
+	}
+
+	if( error )
+	{
+		rethrow_exception( error );
+	}
+}
+
+tuple<string, string> UserManager::mailHost()
+{
+	IdentityManager &idmgr = IdentityManager::Instance();
+
+	if( idmgr.HasDnsProvider() )
+	{
+		return idmgr.GetCurrentDnsName();
+	}
+
+	logg << Logger::Notice << "No dns-provider available, assigning local mail address" << lend;
+	return idmgr.GetFqdn();
+}
+
+UserPtr UserManager::GetUser(const string &username)
+{
+
+	if( ! this->UserExists( username ) )
+	{
+		this->global_error = "User not found";
+		return nullptr;
+	}
+
+	return UserManager::readUser( this->authdb, username );
 }
 
 bool UserManager::UpdateUser(const UserPtr& user)
@@ -189,8 +534,37 @@ bool UserManager::DeleteUser(const string &user)
 
 	// Remove all mail
 	MailManager& mmgr = MailManager::Instance();
-	mmgr.DeleteUser( user );
-	mmgr.Synchronize();
+	if( mmgr.Begin() )
+	{
+		try
+		{
+			mmgr.DeleteUser( user );
+			if( mmgr.Commit( false ) )
+			{
+				// Coalesce with other pending removals
+				mmgr.SynchronizeAsync();
+			}
+		}
+		catch( std::runtime_error& err )
+		{
+			logg << Logger::Error << "Failed to remove mail for user: " << err.what() << lend;
+			mmgr.Rollback();
+		}
+	}
+	else
+	{
+		// Remove mail change by change rather than leave it behind
+		logg << Logger::Error << "Failed to start mail transaction: " << mmgr.StrError() << lend;
+		try
+		{
+			mmgr.DeleteUser( user );
+			mmgr.SynchronizeAsync();
+		}
+		catch( std::runtime_error& err )
+		{
+			logg << Logger::Error << "Failed to remove mail for user: " << err.what() << lend;
+		}
+	}
 
 	// delete the users files and mail
 	logg << Logger::Debug << "Deleting files for user: " << user << lend;
@@ -264,15 +638,16 @@ bool UserManager::UpdateUserPassword(const string &user, const string &new_pass,
 
 list<UserPtr> UserManager::GetUsers()
 {
-	list<UserPtr> users;
+	// List once, users listed are known to exist
+	const vector<string> usernames = this->authdb->GetUsers();
+	vector<UserPtr> users( usernames.size() );
 
-	vector<string> usernames = this->authdb->GetUsers();
-	for(const auto& user: usernames)
+	this->parallel( usernames.size(), [&](const SecopPtr& db, size_t i)
 	{
-		users.push_back(this->GetUser( user ) );
-	}
+		users[i] = UserManager::readUser( db, usernames[i] );
+	});
 
-	return users;
+	return list<UserPtr>( users.begin(), users.end() );
 }
 
 list<string> UserManager::GetGroups()
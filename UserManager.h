@@ -7,9 +7,12 @@
 
 #include <nlohmann/json.hpp>
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <map>
+#include <tuple>
+#include <vector>
 
 using namespace std;
 using json = nlohmann::json;
@@ -144,6 +147,43 @@ public:
 	 */
 	bool AddUser(const UserPtr &user, const string& password, bool isAdmin);
 
+	/**
+	 * @brief The NewUser struct, user to add using AddUsers
+	 */
+	struct NewUser
+	{
+		UserPtr user;
+		string password;
+		bool isAdmin;
+	};
+
+	/**
+	 * @brief The AddResult struct, outcome of adding one user
+	 */
+	struct AddResult
+	{
+		string username;
+		bool success;
+		string error;
+	};
+
+	/**
+	 * @brief AddUsers add several users to system
+	 *
+	 * Users are created in secop over several connections in parallel,
+	 * unless an authdb was provided upon construction. All mail changes
+	 * are then made in one mail transaction with a single synchronize.
+	 * A user failing does not stop the others from being added. Mail
+	 * changes of a failed user, admin aliases included, are undone and
+	 * the user is removed from the admin group and secop, if that
+	 * removal fails the error says so. A failed synchronize is retried
+	 * in the background.
+	 *
+	 * @param users users to add
+	 * @return one result per user, in the order given
+	 */
+	vector<AddResult> AddUsers(const vector<NewUser>& users);
+
 	/**
 	 * @brief GetUser retrieve userinfo on user
 	 * @param username
@@ -250,7 +290,41 @@ public:
 
 	virtual ~UserManager() = default;
 private:
+	// Secop connections used when adding users in bulk
+	static constexpr size_t SecopConnections = 4;
+
+	/*
+	 * Create user in secop and set attributes and admin membership,
+	 * user is removed again upon failure
+	 */
+	static bool createUser(const OPI::SecopPtr& db, const NewUser& nu, string& error);
+
+	/*
+	 * Read user and all attributes, user must exist
+	 */
+	static UserPtr readUser(const OPI::SecopPtr& db, const string& username);
+
+	/*
+	 * Extra connections used by parallel, taken from a pool shared by
+	 * all instances and kept open between calls. At most
+	 * SecopConnections - 1 idle connections are kept.
+	 */
+	static OPI::SecopPtr acquireConnection();
+	static void releaseConnection(const OPI::SecopPtr& db);
+
+	/*
+	 * Run job for 0..count-1 over up to SecopConnections connections,
+	 * first exception thrown by a job is rethrown when all are done
+	 */
+	void parallel(size_t count, const function<void(const OPI::SecopPtr& db, size_t n)>& job);
+
+	/*
+	 * Host and domain of default mail address
+	 */
+	static tuple<string,string> mailHost();
+
 	OPI::SecopPtr authdb;
+	bool ownauthdb;
 };
 
 } // Namespace KGP
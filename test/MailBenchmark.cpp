@@ -0,0 +1,416 @@
+/*
+ * Mail management benchmark
+ *
+ * Runs MailManager against a temporary storagemount and prints per
+ * operation latencies as JSON on stdout.
+ *
+ * Usage: mailbench [addresses ...], default 10 1000 10000 100000
+ *
+ * Sysconfig storagemount is temporarily pointed at the benchmark
+ * directory. Original settings are restored on exit, on failure and
+ * on SIGINT, SIGTERM and SIGHUP. Hash tables are built by the system
+ * postmap, compared against cdb tables compiled in process. Where
+ * postfix is not installed postmap is replaced by a stub, hash timings
+ * then only cover the library side, see "postmap" in output. Service
+ * reloads are not carried out. Must run as root with a postfix user
+ * present, map files are handed over to postfix.
+ */
+
+#include "MailManager.h"
+
+#include <libopi/SysConfig.h>
+
+#include <libutils/FileUtils.h>
+#include <libutils/Logger.h>
+
+#include <nlohmann/json.hpp>
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+
+using namespace std;
+using namespace Utils;
+using namespace KGP;
+using json = nlohmann::json;
+
+// Max calls timed per operation and size
+static constexpr size_t MaxSamples = 1000;
+
+// Domains addresses are spread over
+static constexpr size_t Domains = 10;
+
+// Used for hash tables if present
+static const char* SystemPostmap = "/usr/sbin/postmap";
+
+// Sysconfig keys overridden, scope, key, value if missing
+static const list<tuple<string,string,string>> keys =
+{
+	{ "filesystem",	"storagemount",	"" },
+	{ "mail",		"postmap",		"" },
+	{ "mail",		"tabletype",	"" },
+	{ "mail",		"vmailbox",		"/mail/vmailbox" },
+	{ "mail",		"vdomains",		"/mail/vdomains" },
+	{ "mail",		"localmail",	"/mail/localmail" },
+	{ "mail",		"virtualalias",	"/mail/virtual" },
+	{ "mail",		"saslpasswd",	"/mail/saslpasswd" },
+};
+
+class Samples
+{
+public:
+	void Time(const function<void()>& op)
+	{
+		const auto start = chrono::steady_clock::now();
+		op();
+		this->samples.push_back( chrono::duration<double, micro>( chrono::steady_clock::now() - start ).count() );
+	}
+
+	json Result()
+	{
+		json ret;
+		if( this->samples.empty() )
+		{
+			return ret;
+		}
+
+		sort( this->samples.begin(), this->samples.end() );
+		double total = 0;
+		for( double s: this->samples )
+		{
+			total += s;
+		}
+
+		ret["calls"] = this->samples.size();
+		ret["total_ms"] = total / 1000;
+		ret["mean_us"] = total / this->samples.size();
+		ret["p50_us"] = this->percentile( 0.50 );
+		ret["p99_us"] = this->percentile( 0.99 );
+		ret["max_us"] = this->samples.back();
+
+		return ret;
+	}
+
+private:
+	double percentile(double p)
+	{
+		const size_t pos = static_cast<size_t>( p * ( this->samples.size() - 1 ) + 0.5 );
+		return this->samples[ min( pos, this->samples.size() - 1 ) ];
+	}
+
+	vector<double> samples;
+};
+
+static string domain(size_t i)
+{
+	return "d" + to_string( i % Domains ) + ".bench";
+}
+
+/*
+ * Overrides sysconfig keys and puts original values back, once, upon
+ * Restore or destruction. Removes benchmark directory as well.
+ */
+class ConfigGuard
+{
+public:
+	ConfigGuard(const string& root): root(root), restored(false)
+	{
+	}
+
+	/*
+	 * Remember key, and set def if missing and def not empty
+	 */
+	void Save(const string& scope, const string& key, const string& def)
+	{
+		lock_guard<mutex> l( this->lock );
+
+		OPI::SysConfig cfg( true );
+		this->saved.push_back( { scope, key, cfg.HasKey( scope, key ), "" } );
+		if( this->saved.back().existed )
+		{
+			this->saved.back().value = cfg.GetKeyAsString( scope, key );
+		}
+		else if( ! def.empty() )
+		{
+			cfg.PutKey( scope, key, def );
+		}
+	}
+
+	void Set(const string& scope, const string& key, const string& value)
+	{
+		lock_guard<mutex> l( this->lock );
+		OPI::SysConfig( true ).PutKey( scope, key, value );
+	}
+
+	void Restore()
+	{
+		lock_guard<mutex> l( this->lock );
+		if( this->restored )
+		{
+			return;
+		}
+		this->restored = true;
+
+		OPI::SysConfig cfg( true );
+		for( const Saved& s: this->saved )
+		{
+			try
+			{
+				if( s.existed )
+				{
+					cfg.PutKey( s.scope, s.key, s.value );
+				}
+				else
+				{
+					cfg.RemoveKey( s.scope, s.key );
+				}
+			}
+			catch( std::exception& err )
+			{
+				cerr << "Failed to restore " << s.scope << "/" << s.key << ": " << err.what() << endl;
+			}
+		}
+
+		if( system( ( "rm -rf " + this->root ).c_str() ) != 0 )
+		{
+			cerr << "Failed to remove " << this->root << endl;
+		}
+	}
+
+	virtual ~ConfigGuard()
+	{
+		this->Restore();
+	}
+
+private:
+	struct Saved
+	{
+		string scope;
+		string key;
+		bool existed;
+		string value;
+	};
+
+	string root;
+	bool restored;
+	list<Saved> saved;
+	mutex lock;
+};
+
+static ConfigGuard* guard = nullptr;
+
+static json run(MailManager& mm, ConfigGuard& cfg, size_t count, const string& tag)
+{
+	// Fresh domains and users per size, earlier runs are left behind
+	const auto dom = [&tag](size_t i) { return tag + domain( i ); };
+	const auto user = [&tag](size_t i) { return tag + "u" + to_string( i ); };
+	const size_t samples = min( count, MaxSamples );
+	json ops;
+
+	mm.Begin();
+	for( size_t i = 0; i < min( count, Domains ); i++ )
+	{
+		mm.AddDomain( dom( i ) );
+	}
+	for( size_t i = 0; i < count; i++ )
+	{
+		mm.SetAddress( dom( i ), user( i ), user( i ) );
+	}
+	if( ! mm.Commit( false ) )
+	{
+		throw runtime_error( "Failed to populate: " + mm.StrError() );
+	}
+
+	mt19937 rnd( count );
+	uniform_int_distribution<size_t> pick( 0, count - 1 );
+
+	Samples add;
+	for( size_t i = 0; i < samples; i++ )
+	{
+		add.Time( [&]{ mm.SetAddress( dom( i ), "n" + to_string( i ), user( i ) ); } );
+	}
+	ops["SetAddress"] = add.Result();
+
+	Samples flush;
+	flush.Time( [&]{ mm.Flush(); } );
+	ops["Flush"] = flush.Result();
+
+	Samples lookup;
+	for( size_t i = 0; i < samples; i++ )
+	{
+		const size_t n = pick( rnd );
+		lookup.Time( [&]{ mm.hasAddress( dom( n ), user( n ) ); } );
+	}
+	ops["hasAddress"] = lookup.Result();
+
+	Samples alias;
+	for( size_t i = 0; i < samples; i++ )
+	{
+		mm.AddUserAlias( "a" + to_string( i ) + "@" + dom( i ), user( i ) );
+	}
+	for( size_t i = 0; i < samples; i++ )
+	{
+		alias.Time( [&]{ mm.RemoveUserAliases( user( i ) ); } );
+	}
+	ops["RemoveUserAliases"] = alias.Result();
+
+	Samples del;
+	for( size_t i = 0; i < samples; i++ )
+	{
+		const size_t n = count - 1 - i;
+		del.Time( [&]{ mm.DeleteAddresses( user( n ) ); } );
+	}
+	mm.Flush();
+	ops["DeleteAddresses"] = del.Result();
+
+	Samples adddomain;
+	for( size_t i = 0; i < samples; i++ )
+	{
+		adddomain.Time( [&]{ mm.AddDomain( tag + "x" + to_string( i ) + ".bench" ); } );
+	}
+	mm.Flush();
+	ops["AddDomain"] = adddomain.Result();
+
+	Samples change;
+	change.Time( [&]{ mm.ChangeDomain( dom( 0 ), tag + "moved.bench" ); } );
+	ops["ChangeDomain"] = change.Result();
+
+	for( const string type: { "hash", "cdb" } )
+	{
+		cfg.Set( "mail", "tabletype", type );
+
+		// A change makes sure all tables are rebuilt
+		Samples sync;
+		for( size_t i = 0; i < 3; i++ )
+		{
+			mm.AddDomain( tag + type + to_string( i ) + ".bench" );
+			sync.Time( [&]{ mm.Synchronize(); } );
+		}
+		ops["Synchronize_" + type] = sync.Result();
+	}
+
+	return ops;
+}
+
+int main(int argc, char** argv)
+{
+	logg.SetLevel( Logger::Error );
+
+	list<size_t> sizes;
+	for( int i = 1; i < argc; i++ )
+	{
+		sizes.push_back( strtoul( argv[i], nullptr, 10 ) );
+	}
+	if( sizes.empty() )
+	{
+		sizes = { 10, 1000, 10000, 100000 };
+	}
+
+	char tmpl[] = "/tmp/mailbench.XXXXXX";
+	if( ! mkdtemp( tmpl ) )
+	{
+		cerr << "Failed to create benchmark directory" << endl;
+		return 1;
+	}
+	const string root = tmpl;
+
+	/*
+	 * Sysconfig is system wide, make sure original settings are back
+	 * however the benchmark ends. Signals are blocked before any thread
+	 * is started and handled by a dedicated thread.
+	 */
+	sigset_t signals;
+	sigemptyset( &signals );
+	sigaddset( &signals, SIGINT );
+	sigaddset( &signals, SIGTERM );
+	sigaddset( &signals, SIGHUP );
+	pthread_sigmask( SIG_BLOCK, &signals, nullptr );
+
+	ConfigGuard cfg( root );
+	guard = &cfg;
+
+	thread( [signals]()
+	{
+		int sig = 0;
+		sigwait( &signals, &sig );
+		guard->Restore();
+		_exit( 128 + sig );
+	}).detach();
+
+	set_terminate( []()
+	{
+		guard->Restore();
+		abort();
+	});
+
+	int ret = 0;
+	try
+	{
+		string postmap = SystemPostmap;
+		const bool stub = access( postmap.c_str(), X_OK ) != 0;
+		if( stub )
+		{
+			postmap = root + "/postmap";
+			File::Write( postmap, "#!/bin/sh\ntouch \"${1#*:}.db\"\n", File::UserRWX );
+			chmod( postmap.c_str(), 0700 );
+		}
+
+		for( const auto& key: keys )
+		{
+			cfg.Save( get<0>( key ), get<1>( key ), get<2>( key ) );
+		}
+		cfg.Set( "filesystem", "storagemount", root );
+		cfg.Set( "mail", "postmap", postmap );
+
+		// Empty map files, the real SetupEnvironment touches main.cf
+		for( const auto& key: keys )
+		{
+			if( get<0>( key ) == "mail" && ! get<2>( key ).empty() )
+			{
+				const string path = root + OPI::SysConfig().GetKeyAsString( "mail", get<1>( key ) );
+				File::MkPath( File::GetPath( path ), File::UserRWX );
+				File::Write( path, "", File::UserRW );
+			}
+		}
+
+		MailManager& mm = MailManager::Instance();
+		mm.SetServiceControl( [](const string&, const string&) { return true; } );
+
+		json result;
+		result["postmap"] = stub ? "stub" : postmap;
+		for( size_t count: sizes )
+		{
+			if( count == 0 )
+			{
+				continue;
+			}
+			json size;
+			size["addresses"] = count;
+			size["ops"] = run( mm, cfg, count, "s" + to_string( count ) );
+			result["results"].push_back( size );
+		}
+		mm.Flush();
+
+		cout << result.dump( 1, '\t' ) << endl;
+	}
+	catch( std::exception& err )
+	{
+		cerr << "Benchmark failed: " << err.what() << endl;
+		ret = 1;
+	}
+
+	cfg.Restore();
+
+	return ret;
+}
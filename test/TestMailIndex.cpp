@@ -0,0 +1,98 @@
+#include "TestMailIndex.h"
+
+#include "MailIndex.h"
+
+#include <libutils/FileUtils.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION ( TestMailIndex );
+
+using namespace KGP;
+using namespace Utils;
+
+#define TESTDIR "/tmp/kgp-mailindex"
+#define INDEX TESTDIR "/index"
+#define SOURCE TESTDIR "/source"
+
+void TestMailIndex::setUp()
+{
+	File::MkPath( TESTDIR, File::UserRWX );
+	File::Write( SOURCE, "one\n", File::UserRW );
+}
+
+void TestMailIndex::tearDown()
+{
+	for( const char* file: { INDEX, SOURCE } )
+	{
+		unlink( file );
+	}
+	rmdir( TESTDIR );
+}
+
+void TestMailIndex::TestLookup()
+{
+	unordered_map<string, unordered_map<string,string>> addresses;
+	addresses["example.com"] = { { "info", "alice" }, { "bob", "bob" }, { "b", "carol" } };
+	addresses["empty.org"];
+	for( int i = 0; i < 1000; i++ )
+	{
+		addresses["d" + to_string( i ) + ".net"]["u" + to_string( i )] = "user" + to_string( i );
+	}
+
+	MailIndex writer( INDEX, { SOURCE } );
+	writer.Write( addresses );
+
+	struct stat st{};
+	CPPUNIT_ASSERT_EQUAL( 0, stat( INDEX, &st ) );
+	CPPUNIT_ASSERT_EQUAL( 0640, static_cast<int>( st.st_mode & 07777 ) );
+
+	MailIndex idx( INDEX, { SOURCE } );
+	CPPUNIT_ASSERT( idx.Current() );
+
+	CPPUNIT_ASSERT( idx.hasDomain( "example.com" ) );
+	CPPUNIT_ASSERT( idx.hasDomain( "empty.org" ) );
+	CPPUNIT_ASSERT( idx.hasDomain( "d999.net" ) );
+	CPPUNIT_ASSERT( ! idx.hasDomain( "example" ) );
+	CPPUNIT_ASSERT( ! idx.hasDomain( "example.com." ) );
+	CPPUNIT_ASSERT( ! idx.hasDomain( "" ) );
+
+	CPPUNIT_ASSERT( idx.hasAddress( "example.com", "b" ) );
+	CPPUNIT_ASSERT( idx.hasAddress( "d500.net", "u500" ) );
+	CPPUNIT_ASSERT( ! idx.hasAddress( "d500.net", "u501" ) );
+	CPPUNIT_ASSERT( ! idx.hasAddress( "empty.org", "info" ) );
+	CPPUNIT_ASSERT( ! idx.hasAddress( "missing.org", "info" ) );
+
+	const char* user = nullptr;
+	size_t len = 0;
+	CPPUNIT_ASSERT( idx.GetAddress( "example.com", "info", user, len ) );
+	CPPUNIT_ASSERT_EQUAL( string("alice"), string( user, len ) );
+	CPPUNIT_ASSERT( idx.GetAddress( "example.com", "b", user, len ) );
+	CPPUNIT_ASSERT_EQUAL( string("carol"), string( user, len ) );
+	CPPUNIT_ASSERT( ! idx.GetAddress( "example.com", "bo", user, len ) );
+}
+
+void TestMailIndex::TestCurrent()
+{
+	MailIndex idx( INDEX, { SOURCE } );
+	CPPUNIT_ASSERT( ! idx.Current() );
+
+	MailIndex writer( INDEX, { SOURCE } );
+	writer.Write( { { "example.com", { { "info", "alice" } } } } );
+	CPPUNIT_ASSERT( idx.Current() );
+
+	// Source changed after index written
+	File::Write( SOURCE, "one\ntwo\n", File::UserRW );
+	CPPUNIT_ASSERT( ! idx.Current() );
+
+	// New index picked up by existing reader
+	writer.Write( { { "example.org", { { "info", "bob" } } } } );
+	CPPUNIT_ASSERT( idx.Current() );
+	CPPUNIT_ASSERT( idx.hasAddress( "example.org", "info" ) );
+	CPPUNIT_ASSERT( ! idx.hasDomain( "example.com" ) );
+
+	// Damaged index ignored
+	File::Write( INDEX, "KGPMIDX1 garbage", File::UserRW );
+	CPPUNIT_ASSERT( ! idx.Current() );
+}
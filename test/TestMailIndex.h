@@ -0,0 +1,19 @@
+#ifndef TESTMAILINDEX_H_
+#define TESTMAILINDEX_H_
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class TestMailIndex: public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE( TestMailIndex );
+	CPPUNIT_TEST( TestLookup );
+	CPPUNIT_TEST( TestCurrent );
+	CPPUNIT_TEST_SUITE_END();
+public:
+	void setUp();
+	void tearDown();
+	void TestLookup();
+	void TestCurrent();
+};
+
+#endif /* TESTMAILINDEX_H_ */
@@ -0,0 +1,85 @@
+#include "TestMailQueue.h"
+
+#include "MailQueue.h"
+
+#include <libutils/FileUtils.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+CPPUNIT_TEST_SUITE_REGISTRATION ( TestMailQueue );
+
+using namespace KGP;
+using namespace Utils;
+
+#define SPOOL "/tmp/kgp-mailqueue"
+
+// Minimal queue file, size, time and start of content records
+static void queueFile(const string& path, time_t arrival)
+{
+	const string t = to_string( arrival ) + " 0";
+	const string content = string("C\003100") + "T" + static_cast<char>( t.size() ) + t + "M" + '\0';
+	File::Write( path, content, File::UserRW );
+}
+
+void TestMailQueue::setUp()
+{
+	for( const char* dir: { "/active", "/deferred/A", "/defer/A", "/hold", "/incoming" } )
+	{
+		File::MkPath( string(SPOOL) + dir, File::UserRWX );
+	}
+}
+
+void TestMailQueue::tearDown()
+{
+	CPPUNIT_ASSERT_EQUAL( 0, system("rm -rf " SPOOL) );
+}
+
+void TestMailQueue::TestStats()
+{
+	queueFile( SPOOL "/active/B1", 1000 );
+	queueFile( SPOOL "/deferred/A/A1", 500 );
+	queueFile( SPOOL "/deferred/A/A2", 800 );
+	queueFile( SPOOL "/hold/C1", 2000 );
+	File::Write( SPOOL "/defer/A/A1", "recipient=a@Example.com\nstatus=4.4.1\nrecipient=b@example.com\nrecipient=c@example.org\n", File::UserRW );
+	File::Write( SPOOL "/defer/A/A2", "recipient=a@example.com\n", File::UserRW );
+
+	// Six files to open, three per scan
+	MailQueue q( SPOOL, chrono::seconds(0), 3 );
+
+	MailQueue::Stats s = q.GetStats();
+	CPPUNIT_ASSERT_EQUAL( (size_t) 0, s.incoming );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, s.active );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2, s.deferred );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, s.hold );
+	CPPUNIT_ASSERT( ! s.complete );
+
+	s = q.GetStats();
+	CPPUNIT_ASSERT( s.complete );
+	CPPUNIT_ASSERT_EQUAL( (time_t) 500, s.oldest );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2, s.domains.size() );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2, s.domains["example.com"].deferred );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, s.domains["example.org"].deferred );
+
+	// Delivered and newly deferred
+	remove( SPOOL "/deferred/A/A1" );
+	remove( SPOOL "/defer/A/A1" );
+	rename( SPOOL "/active/B1", SPOOL "/deferred/A/B1" );
+	File::Write( SPOOL "/defer/A/B1", "recipient=x@example.org\n", File::UserRW );
+
+	s = q.GetStats();
+	CPPUNIT_ASSERT( s.complete );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 0, s.active );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2, s.deferred );
+	CPPUNIT_ASSERT_EQUAL( (time_t) 800, s.oldest );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, s.domains["example.com"].deferred );
+	CPPUNIT_ASSERT( s.domains["example.com"].rate == 0 );
+	CPPUNIT_ASSERT( s.domains["example.org"].rate > 0 );
+
+	// Cached within interval
+	MailQueue cached( SPOOL, chrono::seconds(3600) );
+	s = cached.GetStats();
+	queueFile( SPOOL "/hold/C2", 3000 );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 1, cached.GetStats().hold );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 2, cached.GetStats( true ).hold );
+}
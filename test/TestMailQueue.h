@@ -0,0 +1,17 @@
+#ifndef TESTMAILQUEUE_H_
+#define TESTMAILQUEUE_H_
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class TestMailQueue: public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE( TestMailQueue );
+	CPPUNIT_TEST( TestStats );
+	CPPUNIT_TEST_SUITE_END();
+public:
+	void setUp();
+	void tearDown();
+	void TestStats();
+};
+
+#endif /* TESTMAILQUEUE_H_ */
@@ -0,0 +1,93 @@
+#include "TestPostfixConfig.h"
+
+#include "PostfixConfig.h"
+
+#include <libutils/FileUtils.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION ( TestPostfixConfig );
+
+using namespace KGP;
+using namespace Utils;
+
+#define TESTDIR "/tmp/kgp-postfixconfig"
+#define MAINCF TESTDIR "/main.cf"
+
+static const char* maincf =
+		"# Global settings\n"
+		"myhostname = old.example.com\n"
+		"\n"
+		"virtual_alias_maps = hash:/etc/postfix/a,\n"
+		"    # comment inside\n"
+		"\thash:/etc/postfix/b\n"
+		"relayhost=\n"
+		"myhostname = other.example.com\n"
+		"smtpd_banner = $myhostname ESMTP\n";
+
+void TestPostfixConfig::setUp()
+{
+	File::MkPath( TESTDIR, File::UserRWX );
+	File::Write( MAINCF, maincf, File::UserRW );
+	chmod( MAINCF, 0640 );
+}
+
+void TestPostfixConfig::tearDown()
+{
+	unlink( MAINCF );
+	rmdir( TESTDIR );
+}
+
+void TestPostfixConfig::TestGet()
+{
+	PostfixConfig cfg( MAINCF );
+
+	CPPUNIT_ASSERT_EQUAL( string("other.example.com"), cfg.Get("myhostname") );
+	CPPUNIT_ASSERT_EQUAL( string("hash:/etc/postfix/a, hash:/etc/postfix/b"), cfg.Get("virtual_alias_maps") );
+	CPPUNIT_ASSERT_EQUAL( string("$myhostname ESMTP"), cfg.Get("smtpd_banner") );
+	CPPUNIT_ASSERT( cfg.HasKey("relayhost") );
+	CPPUNIT_ASSERT_EQUAL( string(""), cfg.Get("relayhost", "none") );
+	CPPUNIT_ASSERT_EQUAL( string("none"), cfg.Get("mydomain", "none") );
+	CPPUNIT_ASSERT( ! cfg.HasKey("mydomain") );
+
+	map<string,string> params = cfg.Parameters();
+	CPPUNIT_ASSERT_EQUAL( (size_t) 4, params.size() );
+	CPPUNIT_ASSERT_EQUAL( string("other.example.com"), params["myhostname"] );
+
+	CPPUNIT_ASSERT_EQUAL( string(""), PostfixConfig( TESTDIR "/missing.cf" ).Get("myhostname") );
+}
+
+void TestPostfixConfig::TestWrite()
+{
+	PostfixConfig cfg( MAINCF );
+
+	CPPUNIT_ASSERT_THROW( cfg.Set("myhostname", "a\nrelayhost = evil"), std::runtime_error );
+	CPPUNIT_ASSERT_THROW( cfg.Set("my hostname", "a"), std::runtime_error );
+
+	// Unchanged values do not touch file
+	cfg.Set("smtpd_banner", "$myhostname ESMTP");
+	CPPUNIT_ASSERT( ! cfg.Write() );
+
+	cfg.Set("myhostname", "new.example.com");
+	cfg.Set("virtual_alias_maps", "cdb:/etc/postfix/c");
+	cfg.Set("mydomain", "example.com");
+	cfg.Remove("relayhost");
+	CPPUNIT_ASSERT( cfg.Write() );
+
+	CPPUNIT_ASSERT_EQUAL( string(
+		"# Global settings\n"
+		"\n"
+		"virtual_alias_maps = cdb:/etc/postfix/c\n"
+		"    # comment inside\n"
+		"myhostname = new.example.com\n"
+		"smtpd_banner = $myhostname ESMTP\n"
+		"mydomain = example.com\n"), File::GetContentAsString( MAINCF, true ) );
+
+	struct stat st{};
+	CPPUNIT_ASSERT_EQUAL( 0, stat( MAINCF, &st ) );
+	CPPUNIT_ASSERT_EQUAL( 0640, static_cast<int>( st.st_mode & 07777 ) );
+
+	// Queue emptied by write
+	CPPUNIT_ASSERT( ! cfg.Write() );
+}
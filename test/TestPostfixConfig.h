@@ -0,0 +1,19 @@
+#ifndef TESTPOSTFIXCONFIG_H_
+#define TESTPOSTFIXCONFIG_H_
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class TestPostfixConfig: public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE( TestPostfixConfig );
+	CPPUNIT_TEST( TestGet );
+	CPPUNIT_TEST( TestWrite );
+	CPPUNIT_TEST_SUITE_END();
+public:
+	void setUp();
+	void tearDown();
+	void TestGet();
+	void TestWrite();
+};
+
+#endif /* TESTPOSTFIXCONFIG_H_ */
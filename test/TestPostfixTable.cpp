@@ -0,0 +1,171 @@
+#include "TestPostfixTable.h"
+
+#include "PostfixTable.h"
+
+#include <libutils/FileUtils.h>
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION ( TestPostfixTable );
+
+using namespace KGP;
+using namespace Utils;
+
+#define TESTDIR "/tmp/kgp-postfixtable"
+
+void TestPostfixTable::setUp()
+{
+	File::MkPath( TESTDIR, File::UserRWX );
+}
+
+void TestPostfixTable::tearDown()
+{
+	for( const char* file: { "map", "map.cdb", "map.sum", "table.cdb" } )
+	{
+		unlink( ( string(TESTDIR "/") + file ).c_str() );
+	}
+	rmdir( TESTDIR );
+}
+
+static uint32_t getUint32(const string& buf, size_t pos)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>( buf.data() + pos );
+	return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( static_cast<uint32_t>( p[3] ) << 24 );
+}
+
+// Straight cdb lookup, as done by postfix
+static bool lookup(const string& db, const string& key, string& value)
+{
+	uint32_t h = 5381;
+	for( unsigned char c: key )
+	{
+		h = ( ( h << 5 ) + h ) ^ c;
+	}
+
+	const uint32_t tpos = getUint32( db, ( h & 0xff ) * 8 );
+	const uint32_t tlen = getUint32( db, ( h & 0xff ) * 8 + 4 );
+
+	for( uint32_t i = 0; i < tlen; i++ )
+	{
+		const uint32_t slot = tpos + ( ( ( h >> 8 ) + i ) % tlen ) * 8;
+		const uint32_t rpos = getUint32( db, slot + 4 );
+
+		if( rpos == 0 )
+		{
+			return false;
+		}
+
+		const uint32_t klen = getUint32( db, rpos );
+		if( getUint32( db, slot ) == h && db.compare( rpos + 8, klen, key ) == 0 )
+		{
+			value = db.substr( rpos + 8 + klen, getUint32( db, rpos + 4 ) );
+			return true;
+		}
+	}
+	return false;
+}
+
+static string readFile(const string& path)
+{
+	ifstream in( path, ios::binary );
+	return string( istreambuf_iterator<char>( in ), istreambuf_iterator<char>() );
+}
+
+void TestPostfixTable::TestParse()
+{
+	list<pair<string,string>> entries = PostfixTable::Parse(
+				"# comment\n"
+				"User@Example.com   user\n"
+				"\n"
+				"  # indented comment\n"
+				"other@example.com\tfirst,\n"
+				"\tsecond\n"
+				"empty@example.com\n"
+				);
+
+	CPPUNIT_ASSERT_EQUAL( (size_t) 3, entries.size() );
+
+	auto it = entries.begin();
+	CPPUNIT_ASSERT_EQUAL( string("user@example.com"), it->first );
+	CPPUNIT_ASSERT_EQUAL( string("user"), it->second );
+	it++;
+	CPPUNIT_ASSERT_EQUAL( string("other@example.com"), it->first );
+	CPPUNIT_ASSERT_EQUAL( string("first, second"), it->second );
+	it++;
+	CPPUNIT_ASSERT_EQUAL( string("empty@example.com"), it->first );
+	CPPUNIT_ASSERT_EQUAL( string(""), it->second );
+}
+
+void TestPostfixTable::TestCDB()
+{
+	list<pair<string,string>> entries;
+	for( int i = 0; i < 1000; i++ )
+	{
+		entries.emplace_back( "user" + to_string(i) + "@example.com", "user" + to_string(i) );
+	}
+	entries.emplace_back( "user1@example.com", "duplicate" );
+
+	PostfixTable::WriteCDB( TESTDIR "/table.cdb", entries );
+
+	string db = readFile( TESTDIR "/table.cdb" );
+	string value;
+
+	for( int i = 0; i < 1000; i++ )
+	{
+		CPPUNIT_ASSERT( lookup( db, "user" + to_string(i) + "@example.com", value ) );
+		CPPUNIT_ASSERT_EQUAL( "user" + to_string(i), value );
+	}
+
+	CPPUNIT_ASSERT( lookup( db, "user1@example.com", value ) );
+	CPPUNIT_ASSERT_EQUAL( string("user1"), value );
+
+	CPPUNIT_ASSERT( ! lookup( db, "nobody@example.com", value ) );
+}
+
+void TestPostfixTable::TestUpdate()
+{
+	File::Write( TESTDIR "/map", "a@example.com a\n", File::UserRW );
+	chmod( TESTDIR "/map", 0600 );
+
+	PostfixTable pt( TESTDIR "/map", "cdb" );
+
+	CPPUNIT_ASSERT_EQUAL( PostfixTable::Rebuilt, pt.Update() );
+
+	// Same access as source
+	struct stat st{};
+	CPPUNIT_ASSERT_EQUAL( 0, stat( pt.TablePath().c_str(), &st ) );
+	CPPUNIT_ASSERT_EQUAL( 0600, static_cast<int>( st.st_mode & 07777 ) );
+	CPPUNIT_ASSERT_EQUAL( PostfixTable::Unchanged, pt.Update() );
+	CPPUNIT_ASSERT_EQUAL( PostfixTable::Rebuilt, pt.Update( true ) );
+
+	File::Write( TESTDIR "/map", "a@example.com a\nb@example.com b\n", File::UserRW );
+	CPPUNIT_ASSERT_EQUAL( PostfixTable::Rebuilt, pt.Update() );
+
+	string value;
+	CPPUNIT_ASSERT( lookup( readFile( pt.TablePath() ), "b@example.com", value ) );
+	CPPUNIT_ASSERT_EQUAL( string("b"), value );
+}
+
+void TestPostfixTable::TestUpdateEntries()
+{
+	list<pair<string,string>> entries = { { "A@Example.com", "a" } };
+
+	PostfixTable pt( TESTDIR "/map", "cdb" );
+
+	CPPUNIT_ASSERT_EQUAL( PostfixTable::Rebuilt, pt.Update( entries ) );
+	CPPUNIT_ASSERT_EQUAL( PostfixTable::Unchanged, pt.Update( entries ) );
+
+	entries.emplace_back( "b@example.com", "b" );
+	CPPUNIT_ASSERT_EQUAL( PostfixTable::Rebuilt, pt.Update( entries ) );
+
+	string db = readFile( pt.TablePath() );
+	string value;
+	CPPUNIT_ASSERT( lookup( db, "a@example.com", value ) );
+	CPPUNIT_ASSERT_EQUAL( string("a"), value );
+	CPPUNIT_ASSERT( lookup( db, "b@example.com", value ) );
+	CPPUNIT_ASSERT_EQUAL( string("b"), value );
+}
@@ -0,0 +1,23 @@
+#ifndef TESTPOSTFIXTABLE_H_
+#define TESTPOSTFIXTABLE_H_
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class TestPostfixTable: public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE( TestPostfixTable );
+	CPPUNIT_TEST( TestParse );
+	CPPUNIT_TEST( TestCDB );
+	CPPUNIT_TEST( TestUpdate );
+	CPPUNIT_TEST( TestUpdateEntries );
+	CPPUNIT_TEST_SUITE_END();
+public:
+	void setUp();
+	void tearDown();
+	void TestParse();
+	void TestCDB();
+	void TestUpdate();
+	void TestUpdateEntries();
+};
+
+#endif /* TESTPOSTFIXTABLE_H_ */
@@ -0,0 +1,343 @@
+#include "TestRemoteFetcher.h"
+
+#include "RemoteFetcher.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <libutils/FileUtils.h>
+
+#include <condition_variable>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
+
+CPPUNIT_TEST_SUITE_REGISTRATION ( TestRemoteFetcher );
+
+using namespace KGP;
+using namespace Utils;
+
+#define SCHEDULEFILE "/tmp/kgp-fetchschedule.json"
+
+/*
+ * IMAP stand-in, serves one connection with just enough of the
+ * protocol for the fetcher
+ */
+class IMAPStandIn
+{
+public:
+	IMAPStandIn(): port(0), idling(false)
+	{
+		this->lfd = socket( AF_INET, SOCK_STREAM, 0 );
+
+		struct sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+		bind( this->lfd, reinterpret_cast<struct sockaddr*>( &addr ), sizeof( addr ) );
+		listen( this->lfd, 1 );
+
+		socklen_t len = sizeof( addr );
+		getsockname( this->lfd, reinterpret_cast<struct sockaddr*>( &addr ), &len );
+		this->port = ntohs( addr.sin_port );
+
+		this->thr = thread( &IMAPStandIn::serve, this );
+	}
+
+	void AddMessage(const string& msg)
+	{
+		lock_guard<mutex> l( this->lock );
+		this->messages[++this->lastuid] = msg;
+
+		if( this->idling )
+		{
+			this->send( "* " + to_string( this->messages.size() ) + " EXISTS" );
+		}
+	}
+
+	size_t Count()
+	{
+		lock_guard<mutex> l( this->lock );
+		return this->messages.size();
+	}
+
+	uint16_t port;
+
+	virtual ~IMAPStandIn()
+	{
+		shutdown( this->lfd, SHUT_RDWR );
+		if( this->fd >= 0 )
+		{
+			shutdown( this->fd, SHUT_RDWR );
+		}
+		this->thr.join();
+		close( this->lfd );
+	}
+
+private:
+	void send(const string& line)
+	{
+		string data = line + "\r\n";
+		::send( this->fd, data.data(), data.size(), MSG_NOSIGNAL );
+	}
+
+	bool readLine(string& line)
+	{
+		size_t pos;
+		while( ( pos = this->buffer.find("\r\n") ) == string::npos )
+		{
+			char buf[1024];
+			ssize_t len = recv( this->fd, buf, sizeof( buf ), 0 );
+			if( len <= 0 )
+			{
+				return false;
+			}
+			this->buffer.append( buf, len );
+		}
+		line = this->buffer.substr( 0, pos );
+		this->buffer.erase( 0, pos + 2 );
+		return true;
+	}
+
+	void serve()
+	{
+		this->fd = accept( this->lfd, nullptr, nullptr );
+		if( this->fd < 0 )
+		{
+			return;
+		}
+
+		this->send( "* OK IMAP stand-in ready" );
+
+		string line;
+		while( this->readLine( line ) )
+		{
+			string tag, cmd;
+			istringstream in( line );
+			in >> tag >> cmd;
+
+			lock_guard<mutex> l( this->lock );
+			if( tag == "DONE" )
+			{
+				this->idling = false;
+				this->send( this->idletag + " OK IDLE done" );
+			}
+			else if( cmd == "CAPABILITY" )
+			{
+				this->send( "* CAPABILITY IMAP4rev1 IDLE" );
+				this->send( tag + " OK done" );
+			}
+			else if( cmd == "SELECT" )
+			{
+				this->send( "* " + to_string( this->messages.size() ) + " EXISTS" );
+				this->send( tag + " OK [READ-WRITE] done" );
+			}
+			else if( cmd == "UID" )
+			{
+				string sub, uid;
+				in >> sub >> uid;
+				if( sub == "SEARCH" )
+				{
+					string res = "* SEARCH";
+					for( const auto& msg: this->messages )
+					{
+						if( this->deleted.find( msg.first ) == this->deleted.end() )
+						{
+							res += " " + to_string( msg.first );
+						}
+					}
+					this->send( res );
+				}
+				else if( sub == "FETCH" )
+				{
+					const string& msg = this->messages[stoul( uid )];
+					this->send( "* 1 FETCH (UID " + uid + " BODY[] {" + to_string( msg.size() ) + "}\r\n" + msg + ")" );
+				}
+				else if( sub == "STORE" )
+				{
+					this->deleted.insert( stoul( uid ) );
+				}
+				this->send( tag + " OK done" );
+			}
+			else if( cmd == "EXPUNGE" )
+			{
+				for( unsigned long uid: this->deleted )
+				{
+					this->messages.erase( uid );
+				}
+				this->deleted.clear();
+				this->send( tag + " OK done" );
+			}
+			else if( cmd == "IDLE" )
+			{
+				this->idling = true;
+				this->idletag = tag;
+				this->send( "+ idling" );
+			}
+			else if( cmd == "LOGOUT" )
+			{
+				this->send( "* BYE" );
+				this->send( tag + " OK done" );
+				break;
+			}
+			else
+			{
+				// LOGIN, NOOP
+				this->send( tag + " OK done" );
+			}
+		}
+		close( this->fd );
+		this->fd = -1;
+	}
+
+	int lfd;
+	int fd = -1;
+	bool idling;
+	string idletag;
+	string buffer;
+	unsigned long lastuid = 0;
+	map<unsigned long, string> messages;
+	set<unsigned long> deleted;
+	mutex lock;
+	thread thr;
+};
+
+void TestRemoteFetcher::setUp()
+{
+	unlink( SCHEDULEFILE );
+}
+
+void TestRemoteFetcher::tearDown()
+{
+	unlink( SCHEDULEFILE );
+}
+
+void TestRemoteFetcher::TestIMAPIdle()
+{
+	IMAPStandIn server;
+	server.AddMessage("Subject: one\r\n\r\nFirst\r\n");
+	server.AddMessage("Subject: two\r\n\r\nSecond\r\n");
+
+	mutex lock;
+	condition_variable cond;
+	list<string> delivered;
+
+	RemoteFetcher fetcher( [&](const RemoteFetcher::Account& account, const string& msg)
+	{
+		CPPUNIT_ASSERT_EQUAL( string("local"), account.user );
+		lock_guard<mutex> l( lock );
+		delivered.push_back( msg );
+		cond.notify_all();
+		return true;
+	});
+
+	auto waitFor = [&](size_t count)
+	{
+		unique_lock<mutex> l( lock );
+		return cond.wait_for( l, chrono::seconds(5), [&]{ return delivered.size() >= count; } );
+	};
+
+	RemoteFetcher::Account account{ "remote@example.com", "127.0.0.1", "remote", "secret", "local", false, "imap", server.port };
+	fetcher.SetAccounts( { account } );
+
+	CPPUNIT_ASSERT( waitFor( 2 ) );
+	CPPUNIT_ASSERT_EQUAL( string("Subject: one\r\n\r\nFirst\r\n"), delivered.front() );
+
+	// Wait for fetcher to settle in IDLE, then push a new message
+	for( int i = 0; i < 50 && fetcher.GetStatus("127.0.0.1", "remote")["state"] != "idle"; i++ )
+	{
+		usleep( 100000 );
+	}
+	CPPUNIT_ASSERT_EQUAL( string("idle"), fetcher.GetStatus("127.0.0.1", "remote")["state"] );
+	CPPUNIT_ASSERT_EQUAL( string("true"), fetcher.GetStatus("127.0.0.1", "remote")["push"] );
+	CPPUNIT_ASSERT_EQUAL( (size_t) 0, server.Count() );
+
+	server.AddMessage("Subject: three\r\n\r\nThird\r\n");
+
+	CPPUNIT_ASSERT( waitFor( 3 ) );
+	CPPUNIT_ASSERT_EQUAL( string("Subject: three\r\n\r\nThird\r\n"), delivered.back() );
+
+	// Counted once delivery returns
+	for( int i = 0; i < 50 && fetcher.GetStatus("127.0.0.1", "remote")["fetched"] != "3"; i++ )
+	{
+		usleep( 100000 );
+	}
+	CPPUNIT_ASSERT_EQUAL( string("3"), fetcher.GetStatus("127.0.0.1", "remote")["fetched"] );
+
+	fetcher.Stop();
+	CPPUNIT_ASSERT( fetcher.GetStatus("127.0.0.1", "remote").empty() );
+}
+
+void TestRemoteFetcher::TestSchedule()
+{
+	RemoteFetcher::Account account{ "remote@example.com", "127.0.0.1", "remote", "secret", "local", false, "imap", 0 };
+	auto deliver = [](const RemoteFetcher::Account&, const string&) { return true; };
+
+	{
+		IMAPStandIn server;
+		account.port = server.port;
+
+		RemoteFetcher fetcher( deliver, SCHEDULEFILE );
+		fetcher.PollMin = chrono::seconds(10);
+		fetcher.PollMax = chrono::seconds(40);
+		fetcher.IdleTimeout = chrono::seconds(1);
+		fetcher.SetAccounts( { account } );
+
+		// Quiet account, every IDLE renewal finds nothing and backs off
+		for( int i = 0; i < 50 && fetcher.GetStatus("127.0.0.1", "remote")["interval"] != "40"; i++ )
+		{
+			usleep( 100000 );
+		}
+		CPPUNIT_ASSERT_EQUAL( string("40"), fetcher.GetStatus("127.0.0.1", "remote")["interval"] );
+		fetcher.Stop();
+	}
+
+	CPPUNIT_ASSERT( File::FileExists( SCHEDULEFILE ) );
+
+	// New fetcher picks up where the previous one left off, mail
+	// arriving halves the interval
+	IMAPStandIn server;
+	server.AddMessage("Subject: one\r\n\r\nFirst\r\n");
+	account.port = server.port;
+
+	RemoteFetcher fetcher( deliver, SCHEDULEFILE );
+	fetcher.PollMin = chrono::seconds(10);
+	fetcher.PollMax = chrono::seconds(40);
+	fetcher.SetAccounts( { account } );
+
+	for( int i = 0; i < 50 && fetcher.GetStatus("127.0.0.1", "remote")["fetched"] != "1"; i++ )
+	{
+		usleep( 100000 );
+	}
+	usleep( 100000 );
+
+	map<string,string> status = fetcher.GetStatus("127.0.0.1", "remote");
+	CPPUNIT_ASSERT_EQUAL( string("20"), status["interval"] );
+	CPPUNIT_ASSERT( stoul( status["polls"] ) >= 3 );
+
+	// Removed accounts are forgotten
+	fetcher.SetAccounts( {} );
+	CPPUNIT_ASSERT( fetcher.GetStatus("127.0.0.1", "remote").empty() );
+	CPPUNIT_ASSERT( File::GetContentAsString( SCHEDULEFILE, true ).find("remote@127.0.0.1") == string::npos );
+}
+
+void TestRemoteFetcher::TestMalformed()
+{
+	CPPUNIT_ASSERT_THROW( RemoteFetcher::FromConfig( { { "host", "h" }, { "port", "imap" } } ), std::runtime_error );
+	CPPUNIT_ASSERT_THROW( RemoteFetcher::FromConfig( { { "host", "h" }, { "port", "70000" } } ), std::runtime_error );
+	CPPUNIT_ASSERT_EQUAL( (uint16_t) 993, RemoteFetcher::FromConfig( { { "host", "h" }, { "port", "993" } } ).port );
+
+	// Line break in password would inject commands, refused before login
+	IMAPStandIn server;
+	RemoteFetcher fetcher( [](const RemoteFetcher::Account&, const string&) { return true; } );
+	RemoteFetcher::Account account{ "remote@example.com", "127.0.0.1", "remote", "x\r\nk9 LOGOUT", "local", false, "imap", server.port };
+	fetcher.SetAccounts( { account } );
+
+	for( int i = 0; i < 50 && fetcher.GetStatus("127.0.0.1", "remote")["error"] == ""; i++ )
+	{
+		usleep( 100000 );
+	}
+	CPPUNIT_ASSERT( fetcher.GetStatus("127.0.0.1", "remote")["error"].find("Invalid character") != string::npos );
+	fetcher.Stop();
+}
@@ -0,0 +1,21 @@
+#ifndef TESTREMOTEFETCHER_H_
+#define TESTREMOTEFETCHER_H_
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class TestRemoteFetcher: public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE( TestRemoteFetcher );
+	CPPUNIT_TEST( TestIMAPIdle );
+	CPPUNIT_TEST( TestSchedule );
+	CPPUNIT_TEST( TestMalformed );
+	CPPUNIT_TEST_SUITE_END();
+public:
+	void setUp();
+	void tearDown();
+	void TestIMAPIdle();
+	void TestSchedule();
+	void TestMalformed();
+};
+
+#endif /* TESTREMOTEFETCHER_H_ */